@@ -3,16 +3,22 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "lookup_index.h"
+#include "range_aggregates.h"
+#include "trace_events.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
-#include <memory>
+#include <cstdint>
+#include <iterator>
 #include <optional>
 #include <sstream>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -58,285 +64,579 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// Comparisons have the lowest grammatic precedence, so any other operator needs
+// parentheses around a comparison child; A < (B < C) needs them on the right.
+// Function arguments are printed as separate top-level expressions.
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
+namespace {
+// The numeric value of a referenced cell: empty cells are zero, text must
+// be a number, and errors propagate
+double CellToNumber(const CellInterface* cell) {
+    if(cell == nullptr) {
+        return 0;
+    }
+    auto value = cell->GetValue();
+    if(std::holds_alternative<std::string>(value)) {
+        if(std::get<std::string>(value).size() == 0) {
+            return 0;
+        }
+        size_t converted = 0;
+        double v = 0;
+        try {
+            v = std::stod(std::get<std::string>(value), &converted);
+        } catch (const std::invalid_argument&) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if(converted == std::get<std::string>(value).size()) {
+            return v;
+        } else {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+    } else if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    } else {
+        throw std::get<FormulaError>(value);
+    }
+}
+
+// Node::op of comparisons; they evaluate to 1 when true and to 0 when false
+enum class ComparisonType : uint8_t {
+    Equal,
+    NotEqual,
+    Less,
+    LessOrEqual,
+    Greater,
+    GreaterOrEqual,
+};
+
+// Node::op of functions
+enum class FunctionType : uint8_t {
+    If,
+    And,
+    Or,
+    VLookup,
+    Match,
+    XLookup,
+    Sum,
+    Count,
+    Min,
+    Max,
+};
+
+struct Signature {
+    std::string_view name;
+    size_t min_args;
+    size_t max_args;
+    // bit i is set when the argument i must be a range
+    unsigned range_args;
+    // every argument may be either a range or an expression
+    bool any_ranges;
+};
+
+// indexed by FunctionType
+constexpr Signature SIGNATURES[] = {
+    {"IF", 2, 3, 0b0000, false},
+    {"AND", 1, SIZE_MAX, 0b0000, false},
+    {"OR", 1, SIZE_MAX, 0b0000, false},
+    {"VLOOKUP", 3, 4, 0b0010, false},
+    {"MATCH", 2, 3, 0b0010, false},
+    {"XLOOKUP", 3, 4, 0b0110, false},
+    {"SUM", 1, SIZE_MAX, 0b0000, true},
+    {"COUNT", 1, SIZE_MAX, 0b0000, true},
+    {"MIN", 1, SIZE_MAX, 0b0000, true},
+    {"MAX", 1, SIZE_MAX, 0b0000, true},
+};
+
+std::optional<FunctionType> FunctionFromName(std::string_view name) {
+    for (size_t i = 0; i < std::size(SIGNATURES); ++i) {
+        if (SIGNATURES[i].name == name) {
+            return static_cast<FunctionType>(i);
+        }
+    }
+    return std::nullopt;
+}
+}  // namespace
+
+// Read-only view of the node array and the tables it refers to. Printing
+// and evaluation walk the nodes recursively by index.
+//
+// Built-in functions evaluate their arguments lazily: IF evaluates only the
+// taken branch, AND/OR stop at the first argument that decides the result
+// and lookups read only the cell they return, so cells referenced by the
+// skipped arguments are never read.
+class Tree {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<const CellInterface*(const Position&)> pos_mapper) const = 0;
+    Tree(const std::vector<Node>& nodes, const std::vector<uint32_t>& args,
+         const std::vector<Position>& cells, const std::vector<Range>& ranges)
+        : nodes_(nodes)
+        , args_(args)
+        , cells_(cells)
+        , ranges_(ranges) {
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    // throws ParsingError if the arguments of the function node don't fit it
+    void CheckArgs(const Node& function) const {
+        const Signature& signature = SIGNATURES[function.op];
+        const std::string name(signature.name);
+        const size_t count = function.rhs;
+        if (count < signature.min_args || count > signature.max_args) {
+            throw ParsingError("Invalid number of arguments for " + name);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            bool range_expected = i < 32 && (signature.range_args >> i) & 1;
+            if (!signature.any_ranges && range_expected != (AsRange(Arg(function, i)) != nullptr)) {
+                throw ParsingError("Invalid argument " + std::to_string(i + 1) + " for " + name);
+            }
+        }
+
+        // lookup and result columns of MATCH and XLOOKUP
+        const auto type = static_cast<FunctionType>(function.op);
+        if (type == FunctionType::Match || type == FunctionType::XLookup) {
+            const Range& lookup = *AsRange(Arg(function, 1));
+            if (lookup.GetSize().cols != 1) {
+                throw ParsingError(name + " expects a single-column range");
+            }
+            if (type == FunctionType::XLookup) {
+                const Range& result = *AsRange(Arg(function, 2));
+                if (result.GetSize().cols != 1 || result.GetSize().rows != lookup.GetSize().rows) {
+                    throw ParsingError(name + " expects result and lookup ranges of the same size");
+                }
+            }
+        }
+    }
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void Print(std::ostream& out, uint32_t index) const {
+        const Node& node = nodes_[index];
+        switch (node.type) {
+            case Node::Type::Number:
+            case Node::Type::Cell:
+            case Node::Type::Range:
+                PrintAtom(out, node);
+                return;
+            case Node::Type::UnaryOp:
+                out << '(' << static_cast<char>(node.op) << ' ';
+                Print(out, node.lhs);
+                out << ')';
+                return;
+            case Node::Type::BinaryOp:
+            case Node::Type::Comparison:
+                out << '(' << GetSign(node) << ' ';
+                Print(out, node.lhs);
+                out << ' ';
+                Print(out, node.rhs);
+                out << ')';
+                return;
+            case Node::Type::Function:
+                out << '(' << SIGNATURES[node.op].name;
+                for (uint32_t i = 0; i < node.rhs; ++i) {
+                    out << ' ';
+                    Print(out, Arg(node, i));
+                }
+                out << ')';
+                return;
+        }
+    }
+
+    void PrintFormula(std::ostream& out, uint32_t index, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
-        auto precedence = GetPrecedence();
+        const Node& node = nodes_[index];
+        auto precedence = GetPrecedence(node);
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
         bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
         if (parens_needed) {
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        switch (node.type) {
+            case Node::Type::Number:
+            case Node::Type::Cell:
+            case Node::Type::Range:
+                PrintAtom(out, node);
+                break;
+            case Node::Type::UnaryOp:
+                out << static_cast<char>(node.op);
+                PrintFormula(out, node.lhs, precedence);
+                break;
+            case Node::Type::BinaryOp:
+            case Node::Type::Comparison:
+                PrintFormula(out, node.lhs, precedence);
+                out << GetSign(node);
+                PrintFormula(out, node.rhs, precedence, /* right_child = */ true);
+                break;
+            case Node::Type::Function:
+                // arguments are printed as separate top-level expressions
+                out << SIGNATURES[node.op].name << '(';
+                for (uint32_t i = 0; i < node.rhs; ++i) {
+                    if (i > 0) {
+                        out << ',';
+                    }
+                    PrintFormula(out, Arg(node, i), EP_ATOM);
+                }
+                out << ')';
+                break;
+        }
 
         if (parens_needed) {
             out << ')';
         }
     }
-};
 
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
+    double Evaluate(uint32_t index, const FormulaContext& context) const {
+        const Node& node = nodes_[index];
+        switch (node.type) {
+            case Node::Type::Number:
+                return node.value;
+            case Node::Type::Cell:
+                return CellToNumber(context.pos_mapper(cells_[node.lhs]));
+            case Node::Type::Range:
+                // a range has no numeric value of its own: functions read
+                // the cells they need from it
+                throw FormulaError(FormulaError::Category::Value);
+            case Node::Type::UnaryOp: {
+                double value = Evaluate(node.lhs, context);
+                return node.op == '-' ? -1 * value : value;
+            }
+            case Node::Type::BinaryOp:
+                return EvaluateBinaryOp(node, context);
+            case Node::Type::Comparison:
+                return EvaluateComparison(node, context);
+            case Node::Type::Function:
+                return EvaluateFunction(node, context);
+        }
+        assert(false);
+        return 0;
+    }
 
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
+private:
+    uint32_t Arg(const Node& function, size_t i) const {
+        return args_[function.lhs + i];
+    }
+
+    // the range for range arguments of functions, nullptr for other nodes
+    const Range* AsRange(uint32_t index) const {
+        const Node& node = nodes_[index];
+        return node.type == Node::Type::Range ? &ranges_[node.lhs] : nullptr;
+    }
+
+    void PrintAtom(std::ostream& out, const Node& node) const {
+        switch (node.type) {
+            case Node::Type::Number:
+                out << node.value;
+                break;
+            case Node::Type::Cell: {
+                const Position& cell = cells_[node.lhs];
+                if (!cell.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                } else {
+                    out << cell.ToString();
+                }
+                break;
+            }
+            case Node::Type::Range:
+                out << ranges_[node.lhs].ToString();
+                break;
             default:
-                // have to do this because VC++ has a buggy warning
                 assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
         }
     }
 
-    double Evaluate(std::function<const CellInterface*(const Position&)> pos_mapper) const override {
+    // higher is tighter
+    static ExprPrecedence GetPrecedence(const Node& node) {
+        switch (node.type) {
+            case Node::Type::UnaryOp:
+                return EP_UNARY;
+            case Node::Type::Comparison:
+                return EP_CMP;
+            case Node::Type::BinaryOp:
+                switch (node.op) {
+                    case '+':
+                        return EP_ADD;
+                    case '-':
+                        return EP_SUB;
+                    case '*':
+                        return EP_MUL;
+                    default:
+                        return EP_DIV;
+                }
+            default:
+                return EP_ATOM;
+        }
+    }
+
+    static std::string_view GetSign(const Node& node) {
+        if (node.type == Node::Type::BinaryOp) {
+            static constexpr std::string_view OPERATORS = "+-*/";
+            return OPERATORS.substr(OPERATORS.find(static_cast<char>(node.op)), 1);
+        }
+        switch (static_cast<ComparisonType>(node.op)) {
+            case ComparisonType::Equal:
+                return "=";
+            case ComparisonType::NotEqual:
+                return "<>";
+            case ComparisonType::Less:
+                return "<";
+            case ComparisonType::LessOrEqual:
+                return "<=";
+            case ComparisonType::Greater:
+                return ">";
+            case ComparisonType::GreaterOrEqual:
+                return ">=";
+        }
+        assert(false);
+        return "";
+    }
+
+    double EvaluateBinaryOp(const Node& node, const FormulaContext& context) const {
         double result = 0;
-        double left = lhs_->Evaluate(pos_mapper);
-        double right = rhs_->Evaluate(pos_mapper);
-        switch (type_) {
-            case Add:
+        double left = Evaluate(node.lhs, context);
+        double right = Evaluate(node.rhs, context);
+        switch (node.op) {
+            case '+':
                 result = left + right;
                 break;
-            case Subtract:
+            case '-':
                 result = left - right;
                 break;
-            case Multiply:
+            case '*':
                 result = left * right;
                 break;
-            case Divide:
+            case '/':
                 result = left / right;
                 if(std::abs(right) < THRESHOLD) {
                     throw FormulaError(FormulaError::Category::Arithmetic);
                 }
-                break;;
+                break;
             default:
-                // have to do this because VC++ has a buggy warning
                 assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+                return 0;
         }
-        
+
         if(std::isinf(result)) {
             throw FormulaError(FormulaError::Category::Arithmetic);
         }
         return result;
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
-};
-
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
-
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+    double EvaluateComparison(const Node& node, const FormulaContext& context) const {
+        double left = Evaluate(node.lhs, context);
+        double right = Evaluate(node.rhs, context);
+        switch (static_cast<ComparisonType>(node.op)) {
+            case ComparisonType::Equal:
+                return left == right;
+            case ComparisonType::NotEqual:
+                return left != right;
+            case ComparisonType::Less:
+                return left < right;
+            case ComparisonType::LessOrEqual:
+                return left <= right;
+            case ComparisonType::Greater:
+                return left > right;
+            case ComparisonType::GreaterOrEqual:
+                return left >= right;
+        }
+        assert(false);
+        return 0;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    double EvaluateFunction(const Node& node, const FormulaContext& context) const {
+        switch (static_cast<FunctionType>(node.op)) {
+            case FunctionType::If:
+                if (Evaluate(Arg(node, 0), context) != 0) {
+                    return Evaluate(Arg(node, 1), context);
+                }
+                // IF without the third argument is 0 when the condition is false
+                return node.rhs == 3 ? Evaluate(Arg(node, 2), context) : 0;
+            case FunctionType::And:
+                for (uint32_t i = 0; i < node.rhs; ++i) {
+                    if (Evaluate(Arg(node, i), context) == 0) {
+                        return 0;
+                    }
+                }
+                return 1;
+            case FunctionType::Or:
+                for (uint32_t i = 0; i < node.rhs; ++i) {
+                    if (Evaluate(Arg(node, i), context) != 0) {
+                        return 1;
+                    }
+                }
+                return 0;
+            case FunctionType::VLookup:
+                return EvaluateVLookup(node, context);
+            case FunctionType::Match:
+                return EvaluateMatch(node, context);
+            case FunctionType::XLookup:
+                return EvaluateXLookup(node, context);
+            case FunctionType::Sum:
+            case FunctionType::Count:
+            case FunctionType::Min:
+            case FunctionType::Max:
+                return EvaluateAggregate(node, context);
+        }
+        assert(false);
+        return 0;
     }
 
-    double Evaluate(std::function<const CellInterface*(const Position&)> pos_mapper) const override {
-        double value = operand_->Evaluate(pos_mapper);
-        switch(type_) {
-            case UnaryPlus:
-                return value;
-            case UnaryMinus:
-                return -1 * value;
-            default:
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+    // row of the key in a single-column range, counted from its top
+    static std::optional<int> Find(const FormulaContext& context, Range column, double key,
+                                   LookupInterface::Match match) {
+        if (context.lookup != nullptr) {
+            return context.lookup->Find(column, key, match);
         }
+        std::vector<std::optional<double>> keys;
+        keys.reserve(column.GetSize().rows);
+        for (int row = column.top_left.row; row <= column.bottom_right.row; ++row) {
+            const CellInterface* cell = context.pos_mapper({row, column.top_left.col});
+            keys.push_back(cell != nullptr ? ToLookupKey(cell->GetValue()) : std::nullopt);
+        }
+        return ColumnIndex(std::move(keys)).Find(key, match);
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
-
-class CellExpr final : public Expr {
-public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
-    }
+    // VLOOKUP(key, table, column[, approximate]): approximate lookup is the default
+    double EvaluateVLookup(const Node& node, const FormulaContext& context) const {
+        double key = Evaluate(Arg(node, 0), context);
+        const Range& table = *AsRange(Arg(node, 1));
+        double column = std::trunc(Evaluate(Arg(node, 2), context));
+        bool approximate = node.rhs < 4 || Evaluate(Arg(node, 3), context) != 0;
+        if (column < 1) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (column > table.GetSize().cols) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+        Range first_column{table.top_left, {table.bottom_right.row, table.top_left.col}};
+        auto row = Find(context, first_column, key,
+                        approximate ? LookupInterface::Match::LessOrEqual
+                                    : LookupInterface::Match::Exact);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
         }
+        Position result{table.top_left.row + *row, table.top_left.col + static_cast<int>(column) - 1};
+        return CellToNumber(context.pos_mapper(result));
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    // MATCH(key, column[, type]): 1-based row; type 1 (default) finds the largest
+    // value not above the key, 0 an equal value, -1 the smallest value not below it
+    double EvaluateMatch(const Node& node, const FormulaContext& context) const {
+        double key = Evaluate(Arg(node, 0), context);
+        double match_type = node.rhs < 3 ? 1 : Evaluate(Arg(node, 2), context);
+        auto match = match_type > 0   ? LookupInterface::Match::LessOrEqual
+                     : match_type < 0 ? LookupInterface::Match::GreaterOrEqual
+                                      : LookupInterface::Match::Exact;
+        auto row = Find(context, *AsRange(Arg(node, 1)), key, match);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return *row + 1;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // XLOOKUP(key, lookup column, result column[, if not found]): exact lookup
+    double EvaluateXLookup(const Node& node, const FormulaContext& context) const {
+        double key = Evaluate(Arg(node, 0), context);
+        auto row = Find(context, *AsRange(Arg(node, 1)), key, LookupInterface::Match::Exact);
+        if (!row) {
+            if (node.rhs == 4) {
+                return Evaluate(Arg(node, 3), context);
+            }
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        const Range& result = *AsRange(Arg(node, 2));
+        return CellToNumber(context.pos_mapper({result.top_left.row + *row, result.top_left.col}));
     }
 
-    double Evaluate(std::function<const CellInterface*(const Position&)> pos_mapper) const override {
-        auto cell = pos_mapper(*cell_);
-        if(cell == nullptr) {
-            return 0;
+    // numbers in a range; cells with errors throw them
+    static RangeAggregate Aggregate(const FormulaContext& context, Range range) {
+        if (context.aggregates != nullptr) {
+            return context.aggregates->Aggregate(range);
         }
-        auto value = cell->GetValue();
-        if(std::holds_alternative<std::string>(value)) {
-            if(std::get<std::string>(value).size() == 0) {
-                return 0;
-            }
-            size_t converted = 0;
-            double v = 0;
-            try {
-                v = std::stod(std::get<std::string>(value), &converted);
-            } catch (const std::invalid_argument&) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-            if(converted == std::get<std::string>(value).size()) {
-                return v;
-            } else {
-                throw FormulaError(FormulaError::Category::Value);
+        RangeAggregate result;
+        for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+            for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                const CellInterface* cell = context.pos_mapper({row, col});
+                if (cell == nullptr) {
+                    continue;
+                }
+                CellInterface::Value value = cell->GetValue();
+                if (std::holds_alternative<FormulaError>(value)) {
+                    throw std::get<FormulaError>(value);
+                }
+                if (auto number = ToLookupKey(value)) {
+                    result.Add(*number);
+                }
             }
-        } else if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
-        } else {
-            throw std::get<FormulaError>(value);
         }
+        return result;
     }
 
-private:
-    const Position* cell_;
-};
-
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << value_;
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
-    }
-
-    double Evaluate(std::function<const CellInterface*(const Position&)> pos_mapper) const override {
-        return value_;
+    // SUM, COUNT, MIN and MAX: ranges contribute their numbers, other
+    // arguments are evaluated as usual; MIN and MAX of no numbers are 0
+    double EvaluateAggregate(const Node& node, const FormulaContext& context) const {
+        RangeAggregate result;
+        for (uint32_t i = 0; i < node.rhs; ++i) {
+            if (const Range* range = AsRange(Arg(node, i))) {
+                result.Merge(Aggregate(context, *range));
+            } else {
+                result.Add(Evaluate(Arg(node, i), context));
+            }
+        }
+        switch (static_cast<FunctionType>(node.op)) {
+            case FunctionType::Sum:
+                if (!std::isfinite(result.sum)) {
+                    throw FormulaError(FormulaError::Category::Arithmetic);
+                }
+                return result.sum;
+            case FunctionType::Count:
+                return result.count;
+            case FunctionType::Min:
+                return result.count > 0 ? result.min : 0;
+            case FunctionType::Max:
+                return result.count > 0 ? result.max : 0;
+            default:
+                assert(false);
+                return 0;
+        }
     }
 
-private:
-    double value_;
+    const std::vector<Node>& nodes_;
+    const std::vector<uint32_t>& args_;
+    const std::vector<Position>& cells_;
+    const std::vector<Range>& ranges_;
 };
 
+namespace {
+// Builds the node array bottom-up: every exit callback turns the indexes of
+// its children on top of the stack into one new node.
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
-
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    FormulaAST MoveAST() {
+        assert(stack_.size() == 1 && stack_.front() == nodes_.size() - 1);
+        stack_.clear();
+        return FormulaAST(std::move(nodes_), std::move(args_), std::move(cells_),
+                          std::move(ranges_), has_branches_);
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+        assert(stack_.size() >= 1);
 
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
+        Node node{Node::Type::UnaryOp};
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            node.op = '-';
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            node.op = '+';
         }
-
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        node.lhs = stack_.back();
+        stack_.back() = AddNode(node);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -348,8 +648,9 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        Node node{Node::Type::Number};
+        node.value = value;
+        stack_.push_back(AddNode(node));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -359,33 +660,95 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        Node node{Node::Type::Cell};
+        node.lhs = static_cast<uint32_t>(cells_.size());
+        cells_.push_back(value);
+        stack_.push_back(AddNode(node));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
-
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+        assert(stack_.size() >= 2);
 
-        auto lhs = std::move(args_.back());
-
-        BinaryOpExpr::Type type;
+        Node node{Node::Type::BinaryOp};
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            node.op = '+';
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            node.op = '-';
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            node.op = '*';
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            node.op = '/';
+        }
+        AddOperator(node);
+    }
+
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(stack_.size() >= 2);
+
+        ComparisonType type;
+        if (ctx->EQ()) {
+            type = ComparisonType::Equal;
+        } else if (ctx->NE()) {
+            type = ComparisonType::NotEqual;
+        } else if (ctx->LT()) {
+            type = ComparisonType::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonType::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonType::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = ComparisonType::GreaterOrEqual;
+        }
+
+        Node node{Node::Type::Comparison};
+        node.op = static_cast<uint8_t>(type);
+        AddOperator(node);
+    }
+
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        auto second_str = ctx->CELL(1)->getSymbol()->getText();
+        auto first = Position::FromString(first_str);
+        auto second = Position::FromString(second_str);
+        if (!first.IsValid() || !second.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ':' + second_str);
+        }
+
+        // B3:A1 is the same range as A1:B3
+        Node node{Node::Type::Range};
+        node.lhs = static_cast<uint32_t>(ranges_.size());
+        ranges_.push_back({{std::min(first.row, second.row), std::min(first.col, second.col)},
+                           {std::max(first.row, second.row), std::max(first.col, second.col)}});
+        stack_.push_back(AddNode(node));
+    }
+
+    void enterFunction(FormulaParser::FunctionContext* /* ctx */) override {
+        // the arguments are pushed on top of the stack while the function is walked
+        function_args_begin_.push_back(stack_.size());
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->NAME()->getSymbol()->getText();
+        auto type = FunctionFromName(name);
+        if (!type) {
+            throw ParsingError("Unknown function: " + name);
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        // the arguments of every function take a contiguous slice of args_
+        auto args_begin = stack_.begin() + function_args_begin_.back();
+        function_args_begin_.pop_back();
+        Node node{Node::Type::Function};
+        node.op = static_cast<uint8_t>(*type);
+        node.lhs = static_cast<uint32_t>(args_.size());
+        node.rhs = static_cast<uint32_t>(stack_.end() - args_begin);
+        args_.insert(args_.end(), args_begin, stack_.end());
+        stack_.erase(args_begin, stack_.end());
+        Tree(nodes_, args_, cells_, ranges_).CheckArgs(node);
+
+        stack_.push_back(AddNode(node));
+        has_branches_ = true;
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -393,8 +756,27 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    uint32_t AddNode(const Node& node) {
+        nodes_.push_back(node);
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    // replaces the two operands on top of the stack with the operator node
+    void AddOperator(Node node) {
+        node.rhs = stack_.back();
+        stack_.pop_back();
+        node.lhs = stack_.back();
+        stack_.back() = AddNode(node);
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> args_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    // indexes of the nodes that are not attached to a parent yet
+    std::vector<uint32_t> stack_;
+    std::vector<size_t> function_args_begin_;
+    bool has_branches_ = false;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -410,33 +792,67 @@ public:
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+namespace {
+// Lexer and parser objects are expensive to set up, so every thread keeps
+// one set and resets it for each formula. The DFA cache they warm up is
+// shared by all threads.
+class ThreadParser {
+public:
+    ThreadParser()
+        : lexer_(&input_)
+        , tokens_(&lexer_)
+        , parser_(&tokens_) {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser_.removeErrorListeners();
+    }
 
-    CommonTokenStream tokens(&lexer);
+    FormulaAST Parse(std::string_view text) {
+        using antlr4::atn::ParserATNSimulator;
+        using antlr4::atn::PredictionMode;
+
+        input_.load(text.data(), text.size(), /* lenient = */ false);
+        lexer_.setInputStream(&input_);
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+
+        // SLL prediction is faster and succeeds for almost every input;
+        // full LL is needed only to tell its failures from real syntax errors
+        auto interpreter = parser_.getInterpreter<ParserATNSimulator>();
+        antlr4::tree::ParseTree* tree = nullptr;
+        try {
+            interpreter->setPredictionMode(PredictionMode::SLL);
+            tree = parser_.main();
+        } catch (const antlr4::ParseCancellationException&) {
+            parser_.reset();
+            interpreter->setPredictionMode(PredictionMode::LL);
+            tree = parser_.main();
+        }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+        ASTImpl::ParseASTListener listener;
+        antlr4::tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+        return listener.MoveAST();
+    }
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+private:
+    ASTImpl::BailErrorListener error_listener_;
+    antlr4::ANTLRInputStream input_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+};
+}  // namespace
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(std::string_view(in_str));
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaAST(std::string_view in_str) {
+    TRACE_SCOPE("Parse");
+    thread_local ThreadParser parser;
+    return parser.Parse(in_str);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -446,21 +862,62 @@ void FormulaAST::PrintCells(std::ostream& out) const {
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    GetTree().Print(out, GetRoot());
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    GetTree().PrintFormula(out, GetRoot(), ASTImpl::EP_ATOM);
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    return sizeof(*this) + nodes_.capacity() * sizeof(ASTImpl::Node)
+           + args_.capacity() * sizeof(uint32_t) + cells_.capacity() * sizeof(Position)
+           + ranges_.capacity() * sizeof(Range);
 }
 
 double FormulaAST::Execute(std::function<const CellInterface*(const Position&)> pos_mapper) const {
-    return root_expr_->Evaluate(pos_mapper);
+    return Execute(FormulaContext{std::move(pos_mapper)});
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+double FormulaAST::Execute(const FormulaContext& context) const {
+    TRACE_SCOPE("Evaluate");
+    return GetTree().Evaluate(GetRoot(), context);
+}
+
+FormulaAST::FormulaAST(std::vector<ASTImpl::Node> nodes, std::vector<uint32_t> args,
+                       std::vector<Position> cells, std::vector<Range> ranges, bool has_branches)
+    : nodes_(std::move(nodes))
+    , args_(std::move(args))
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges))
+    , has_branches_(has_branches) {
+    assert(!nodes_.empty());
+    // the tables are sorted once here, so that GetReferencedCells needs no
+    // sorting; nodes are switched to the indexes in the sorted tables
+    const std::vector<Position> node_cells = cells_;
+    const std::vector<Range> node_ranges = ranges_;
+    std::sort(cells_.begin(), cells_.end());
+    cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+    for (ASTImpl::Node& node : nodes_) {
+        if (node.type == ASTImpl::Node::Type::Cell) {
+            node.lhs = static_cast<uint32_t>(
+                std::lower_bound(cells_.begin(), cells_.end(), node_cells[node.lhs]) - cells_.begin());
+        } else if (node.type == ASTImpl::Node::Type::Range) {
+            node.lhs = static_cast<uint32_t>(
+                std::lower_bound(ranges_.begin(), ranges_.end(), node_ranges[node.lhs]) - ranges_.begin());
+        }
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
+
+ASTImpl::Tree FormulaAST::GetTree() const {
+    return ASTImpl::Tree(nodes_, args_, cells_, ranges_);
+}
+
+uint32_t FormulaAST::GetRoot() const {
+    // children precede their parents, so the root is the last node
+    return static_cast<uint32_t>(nodes_.size() - 1);
+}
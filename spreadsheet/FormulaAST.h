@@ -3,49 +3,110 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <vector>
 
 #define THRESHOLD 1e-20
 
 namespace ASTImpl {
-class Expr;
+// A node of the flat expression array. Children are stored before their
+// parents, so the root is the last node and a formula is built without a
+// separate allocation per node.
+struct Node {
+    enum class Type : uint8_t {
+        Number,
+        Cell,
+        Range,
+        UnaryOp,
+        BinaryOp,
+        Comparison,
+        Function,
+    };
+
+    Type type;
+    // operator character, comparison or function, depending on the type
+    uint8_t op = 0;
+    // operands of operators; the index in the cells or ranges table for
+    // references; the first argument in the arguments table and the number
+    // of arguments for functions
+    uint32_t lhs = 0;
+    uint32_t rhs = 0;
+    double value = 0;
+};
+
+class Tree;
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+class LookupInterface;
+class AggregateInterface;
+
+// What a formula reads from the sheet while it is evaluated
+struct FormulaContext {
+    std::function<const CellInterface*(const Position&)> pos_mapper;
+    // indexes for lookup functions; ranges are scanned when there are none
+    const LookupInterface* lookup = nullptr;
+    // range aggregates for SUM, COUNT, MIN and MAX; scanned when there are none
+    const AggregateInterface* aggregates = nullptr;
+};
+
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // cells and ranges may contain duplicates: they are sorted and made
+    // unique, and the nodes are switched to the new indexes
+    FormulaAST(std::vector<ASTImpl::Node> nodes,
+               std::vector<uint32_t> args,
+               std::vector<Position> cells,
+               std::vector<Range> ranges = {},
+               bool has_branches = false);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
     double Execute(std::function<const CellInterface*(const Position&)> pos_mapper) const;
+    double Execute(const FormulaContext& context) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells() {
+    // Bytes occupied by the AST nodes and the tables, including this object
+    size_t GetMemoryUsage() const;
+
+    // Referenced cells, sorted and without duplicates
+    const std::vector<Position>& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // Ranges used as function arguments, sorted and without duplicates
+    const std::vector<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+    // True if the formula calls functions, so an evaluation may skip some of
+    // the cells in GetCells()
+    bool HasBranches() const {
+        return has_branches_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ASTImpl::Tree GetTree() const;
+    uint32_t GetRoot() const;
 
+    std::vector<ASTImpl::Node> nodes_;
+    // arguments of every function node, one contiguous slice per function
+    std::vector<uint32_t> args_;
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    bool has_branches_ = false;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in_str);
@@ -0,0 +1,93 @@
+// Выполняет над новой таблицей поток команд из файла или стандартного ввода
+// (формат команд описан в batch_processor.h) и выводит результаты в
+// стандартный вывод. Статистика выполнения выводится в stderr.
+//
+// Использование: spreadsheet_batch [<файл команд>]
+
+#include "batch_processor.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+
+namespace {
+
+// Вывод в FILE* крупными блоками
+class BufferedWriter : public std::streambuf {
+public:
+    explicit BufferedWriter(std::FILE* file, size_t buffer_size = 1 << 20)
+        : file_(file)
+        , buffer_(buffer_size) {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    ~BufferedWriter() {
+        sync();
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if(sync() != 0) {
+            return traits_type::eof();
+        }
+        if(!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        const size_t size = pptr() - pbase();
+        if(size > 0 && std::fwrite(pbase(), 1, size, file_) != size) {
+            return -1;
+        }
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+        return std::fflush(file_) == 0 ? 0 : -1;
+    }
+
+private:
+    std::FILE* file_;
+    std::vector<char> buffer_;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if(argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [<commands>]\n";
+        return 2;
+    }
+    std::ios::sync_with_stdio(false);
+
+    std::ifstream file;
+    if(argc == 2) {
+        file.open(argv[1]);
+        if(!file) {
+            std::cerr << "Cannot open " << argv[1] << '\n';
+            return 2;
+        }
+    }
+    std::istream& input = argc == 2 ? static_cast<std::istream&>(file) : std::cin;
+
+    BufferedWriter writer(stdout);
+    std::ostream output(&writer);
+    Sheet sheet;
+    BatchProcessor processor(sheet, output);
+    processor.Run(input);
+    output.flush();
+
+    const BatchStats& stats = processor.GetStats();
+    const double seconds = std::chrono::duration<double>(stats.duration).count();
+    std::cerr << std::fixed << std::setprecision(3)
+              << stats.commands << " commands (" << stats.sets << " sets in " << stats.batches
+              << " batches) in " << seconds << " s, "
+              << std::setprecision(0) << (seconds > 0 ? stats.commands / seconds : 0) << " commands/s, "
+              << stats.errors << " errors\n";
+    return stats.errors == 0 && output ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+#include "batch_processor.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+// больше set в пачке не копится, чтобы не держать в памяти весь поток
+constexpr size_t MAX_BATCH_SIZE = 64 * 1024;
+
+// отделяет первое слово command; остаток начинается после одного пробела
+std::string_view NextWord(std::string_view& command) {
+    const size_t end = command.find(' ');
+    std::string_view word = command.substr(0, end);
+    command = end == std::string_view::npos ? std::string_view() : command.substr(end + 1);
+    return word;
+}
+
+Position ParsePosition(std::string_view str) {
+    Position pos = Position::FromString(str);
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position " + std::string(str));
+    }
+    return pos;
+}
+}  // namespace
+
+BatchProcessor::BatchProcessor(Sheet& sheet, std::ostream& output)
+    : sheet_(sheet)
+    , output_(output) {
+}
+
+void BatchProcessor::Run(std::istream& input) {
+    const auto begin = std::chrono::steady_clock::now();
+    RunStream(input, {});
+    stats_.duration += std::chrono::steady_clock::now() - begin;
+}
+
+const BatchStats& BatchProcessor::GetStats() const {
+    return stats_;
+}
+
+void BatchProcessor::RunStream(std::istream& input, std::string source) {
+    std::swap(source_, source);
+    std::string command;
+    for(size_t line = 1; std::getline(input, command); line++) {
+        if(!command.empty() && command.back() == '\r') {
+            command.pop_back();
+        }
+        if(command.empty() || command[0] == '#') {
+            continue;
+        }
+        stats_.commands++;
+        try {
+            Execute(line, command);
+        } catch (const std::exception& e) {
+            ReportError(line, e.what());
+        }
+    }
+    Flush();
+    std::swap(source_, source);
+}
+
+void BatchProcessor::Execute(size_t line, std::string_view command) {
+    const std::string_view name = NextWord(command);
+    if(name == "set") {
+        const Position pos = ParsePosition(NextWord(command));
+        pending_.push_back({line, pos, std::string(command)});
+        stats_.sets++;
+        if(pending_.size() >= MAX_BATCH_SIZE) {
+            Flush();
+        }
+        return;
+    }
+
+    // остальные команды видят все предыдущие set
+    Flush();
+    if(name == "clear") {
+        sheet_.ClearCell(ParsePosition(command));
+    } else if(name == "get") {
+        Get(ParsePosition(command));
+    } else if(name == "print") {
+        if(command == "values") {
+            sheet_.PrintValuesParallel(output_);
+        } else if(command == "texts") {
+            sheet_.PrintTexts(output_);
+        } else {
+            throw std::invalid_argument("Unknown print mode " + std::string(command));
+        }
+    } else if(name == "load") {
+        Load(std::string(command));
+    } else if(name == "save") {
+        Save(std::string(command));
+    } else {
+        throw std::invalid_argument("Unknown command " + std::string(name));
+    }
+}
+
+void BatchProcessor::Flush() {
+    if(pending_.empty()) {
+        return;
+    }
+    std::vector<PendingSet> pending;
+    pending.swap(pending_);
+    stats_.batches++;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(pending.size());
+    for(const PendingSet& set: pending) {
+        cells.emplace_back(set.pos, set.text);
+    }
+    try {
+        sheet_.SetCells(std::move(cells));
+        return;
+    } catch (const std::exception&) {
+    }
+    // пачка не изменила таблицу: находим команды с ошибками
+    for(PendingSet& set: pending) {
+        try {
+            sheet_.SetCell(set.pos, std::move(set.text));
+        } catch (const std::exception& e) {
+            ReportError(set.line, e.what());
+        }
+    }
+}
+
+void BatchProcessor::Get(Position pos) {
+    output_ << pos.ToString() << '\t';
+    sheet_.PrintValue(pos, output_);
+    output_ << '\n';
+}
+
+void BatchProcessor::Load(const std::string& path) {
+    std::ifstream input(path);
+    if(!input) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    // файл, открытый по другому пути, узнаётся по каноническому пути
+    std::filesystem::path file = std::filesystem::weakly_canonical(path);
+    if(std::find(loading_.begin(), loading_.end(), file) != loading_.end()) {
+        throw std::runtime_error("Recursive load of " + path);
+    }
+    if(loading_.size() >= MAX_LOAD_DEPTH) {
+        throw std::runtime_error("Too deeply nested load of " + path);
+    }
+    loading_.push_back(std::move(file));
+    try {
+        RunStream(input, path);
+    } catch (...) {
+        loading_.pop_back();
+        throw;
+    }
+    loading_.pop_back();
+}
+
+void BatchProcessor::Save(const std::string& path) const {
+    std::ofstream file(path);
+    if(!file) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    const Size size = sheet_.GetPrintableSize();
+    for(int row = 0; row < size.rows; row++) {
+        for(int col = 0; col < size.cols; col++) {
+            const Position pos{row, col};
+            // числа из колонок не переносятся в обычное хранилище
+            bool present = sheet_.GetStoredNumber(pos).has_value();
+            if(!present) {
+                const Cell* cell = sheet_.GetConcreteCell(pos);
+                present = cell != nullptr && !cell->IsEmpty();
+            }
+            if(present) {
+                file << "set " << pos.ToString() << ' ';
+                sheet_.PrintText(pos, file);
+                file << '\n';
+            }
+        }
+    }
+    if(!file.flush()) {
+        throw std::runtime_error("Cannot write " + path);
+    }
+}
+
+void BatchProcessor::ReportError(size_t line, std::string_view message) {
+    stats_.errors++;
+    output_ << "error ";
+    if(!source_.empty()) {
+        output_ << source_ << ':';
+    }
+    output_ << line << ": " << message << '\n';
+}
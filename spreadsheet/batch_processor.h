@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Sheet;
+
+// Статистика выполненного потока команд
+struct BatchStats {
+    size_t commands = 0;
+    size_t sets = 0;
+    // сколько раз накопленные set применялись одним SetCells
+    size_t batches = 0;
+    size_t errors = 0;
+    std::chrono::nanoseconds duration{0};
+};
+
+// Выполняет над таблицей поток команд, по одной в строке:
+//   set <ячейка> <текст>   текст - остаток строки после одного пробела
+//   clear <ячейка>
+//   get <ячейка>           выводит "<ячейка>\t<значение>"
+//   print values|texts
+//   load <файл>            выполняет команды из файла; ошибки в нём
+//                          выводятся с именем файла. Файл не может
+//                          загружать сам себя, даже через другие файлы,
+//                          вложенность load не больше MAX_LOAD_DEPTH
+//   save <файл>            записывает set для всех непустых ячеек
+// Пустые строки и строки, начинающиеся с '#', пропускаются.
+//
+// Идущие подряд set копятся и применяются одним SetCells, то есть как одно
+// изменение: формулы разбираются параллельно, а циклы проверяются для
+// итогового содержимого пачки. Если пачка не принимается, её команды
+// выполняются по одной, чтобы сообщить об ошибке каждой. Ошибка команды
+// выводится строкой "error <номер строки>: <описание>" и не прерывает
+// выполнение.
+class BatchProcessor {
+public:
+    static constexpr size_t MAX_LOAD_DEPTH = 16;
+
+    BatchProcessor(Sheet& sheet, std::ostream& output);
+
+    // Выполняет все команды input; номера строк в сообщениях об ошибках
+    // отсчитываются от начала input
+    void Run(std::istream& input);
+
+    const BatchStats& GetStats() const;
+
+private:
+    struct PendingSet {
+        size_t line;
+        Position pos;
+        std::string text;
+    };
+
+    // source - имя файла для сообщений об ошибках, пустое для Run
+    void RunStream(std::istream& input, std::string source);
+    void Execute(size_t line, std::string_view command);
+    // Применяет накопленные set
+    void Flush();
+    void Get(Position pos);
+    void Load(const std::string& path);
+    void Save(const std::string& path) const;
+    void ReportError(size_t line, std::string_view message);
+
+    Sheet& sheet_;
+    std::ostream& output_;
+    std::vector<PendingSet> pending_;
+    // файл, команды которого выполняются
+    std::string source_;
+    // файлы, которые сейчас выполняются, от внешнего к вложенному
+    std::vector<std::filesystem::path> loading_;
+    BatchStats stats_;
+};
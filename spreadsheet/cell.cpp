@@ -1,52 +1,159 @@
 #include "cell.h"
 
+#include "sheet.h"
+
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
 #include <queue>
 
+namespace {
+// Память, выделенная строкой в куче. Короткие строки хранятся внутри
+// самого объекта и дополнительной памяти не занимают.
+size_t GetHeapUsage(const std::string& str) {
+    static const size_t inline_capacity = std::string().capacity();
+    return str.capacity() > inline_capacity ? str.capacity() + 1 : 0;
+}
+}  // namespace
+
+size_t MemoryUsage::Total() const {
+    return storage + texts + formulas + dependencies + caches;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other) {
+    storage += other.storage;
+    texts += other.texts;
+    formulas += other.formulas;
+    dependencies += other.dependencies;
+    caches += other.caches;
+    return *this;
+}
+
 // Реализуйте следующие методы
-Cell::Cell(std::string value, const SheetInterface& sheet){
+Cell::Cell(std::string value, Sheet& sheet){
     Set(value, sheet);
 }
 
+Cell::Cell(std::unique_ptr<FormulaInterface> formula, Sheet& sheet)
+    : impl_(std::make_unique<FormulaImpl>(std::move(formula), sheet, *this)) {
+}
+
 Cell::~Cell() {}
 
-void Cell::Set(std::string text, const SheetInterface& sheet) {
-    if(text[0] == '=' && text.size() != 1) {
-        impl_ = std::make_unique<FormulaImpl>(text.substr(1), sheet);
+void Cell::Set(std::string text, Sheet& sheet) {
+    if(text.empty()) {
+        impl_ = std::make_unique<EmptyImpl>();
+    } else if(IsFormulaText(text)) {
+        impl_ = std::make_unique<FormulaImpl>(sheet.IsDeferredParsing()
+                                                  ? ParseFormulaDeferred(text.substr(1))
+                                                  : ParseFormula(text.substr(1)),
+                                              sheet, *this);
     } else {
-        impl_ = std::make_unique<TextImpl>(text);
+        impl_ = std::make_unique<TextImpl>(text, sheet.GetStringPool());
     }
 }
 
+bool Cell::IsFormulaText(std::string_view text) {
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
+}
+
 void Cell::Clear() {
     impl_ = std::make_unique<EmptyImpl>();
 }
 
 Cell::Value Cell::GetValue() const {
+    // значение текстовой ячейки не кешируем, чтобы не хранить копию текста
+    if(!impl_->IsFormula()) {
+        return impl_->GetValue();
+    }
     if(!cache_.has_value()) {
         cache_ = impl_->GetValue();
     }
     return cache_.value();
 }
+Cell::ValueView Cell::GetValueView() const {
+    if(!impl_->IsFormula()) {
+        return impl_->GetTextValue();
+    }
+    if(!cache_.has_value()) {
+        cache_ = impl_->GetValue();
+    }
+    return std::visit([](const auto& value) -> ValueView {
+        return value;
+    }, *cache_);
+}
+
 std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
+void Cell::Recalculate() const {
+    cache_ = static_cast<const FormulaImpl&>(*impl_).Evaluate();
+}
+
 void Cell::InvalidateCache() {
     cache_.reset();
 }
 
+bool Cell::HasCache() const {
+    return cache_.has_value();
+}
+
+bool Cell::UsesCell(Position pos) const {
+    return impl_->UsesCell(pos);
+}
+
 void Cell::AddReferedCell(Position p) {
     refered_cells_.push_back(p);
 }
 
+void Cell::RemoveReferedCell(Position p) {
+    refered_cells_.erase(std::remove(refered_cells_.begin(), refered_cells_.end(), p),
+                         refered_cells_.end());
+}
+
+void Cell::SetReferedCells(std::vector<Position> cells) {
+    refered_cells_ = std::move(cells);
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 };
 
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
+bool Cell::IsFormula() const {
+    return impl_->IsFormula();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+void Cell::Validate() const {
+    impl_->Validate();
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+MemoryUsage Cell::GetMemoryUsage() const {
+    MemoryUsage usage;
+    usage.storage = sizeof(*this) - sizeof(cache_) - sizeof(refered_cells_);
+    usage.caches = sizeof(cache_);
+    if(cache_.has_value() && std::holds_alternative<std::string>(*cache_)) {
+        usage.caches += GetHeapUsage(std::get<std::string>(*cache_));
+    }
+    usage.dependencies = sizeof(refered_cells_) + refered_cells_.capacity() * sizeof(Position);
+    impl_->AddMemoryUsage(usage);
+    return usage;
+}
+
 void Cell::EmptyImpl::Set(std::string text) {};
 
 Cell::Value Cell::EmptyImpl::GetValue() const {
@@ -57,34 +164,72 @@ std::string Cell::EmptyImpl::GetText() const {
     return "";
 }
 
-Cell::TextImpl::TextImpl(std::string text) {
-    _value = text;
+void Cell::EmptyImpl::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.storage += sizeof(*this);
+}
+
+Cell::TextImpl::TextImpl(std::string_view text, StringPool& strings)
+    : strings_(strings)
+    , handle_(strings.Add(text)) {
+}
+
+Cell::TextImpl::~TextImpl() {
+    strings_.Release(handle_);
 }
 
 Cell::Value Cell::TextImpl::GetValue() const {
-    if(_value[0] == '\'') {
-        return _value.substr(1);
-    } 
-    return _value;
+    return std::string(GetTextValue());
 }
 
 std::string Cell::TextImpl::GetText() const {
-    return _value;
+    return std::string(strings_.Get(handle_));
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string text, const SheetInterface& sheet) {
-    text_ = text;
-    formula_ = ParseFormula(text);
-    auto v = formula_->Evaluate(sheet);
-    if(std::holds_alternative<double>(v)) {
-        value_ = std::get<double>(v);
-    } else {
-        value_ = std::get<FormulaError>(v);
+std::string_view Cell::TextImpl::GetTextValue() const {
+    std::string_view value = strings_.Get(handle_);
+    if(!value.empty() && value[0] == ESCAPE_SIGN) {
+        value.remove_prefix(1);
     }
+    return value;
+}
+
+bool Cell::TextImpl::IsEmpty() const {
+    return strings_.Get(handle_).empty();
+}
+
+void Cell::TextImpl::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.storage += sizeof(*this);
+    usage.texts += strings_.GetSharedMemoryUsage(handle_);
 }
 
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet,
+                               const Cell& cell)
+    : sheet_(sheet)
+    , cell_(cell)
+    , formula_(std::move(formula)) {
+}
+
+// Формулу вычисляет таблица вместе с формулами без значения в кеше, которые
+// она читает, и кладёт значение в кеш ячейки
 Cell::Value Cell::FormulaImpl::GetValue() const {
-    return value_;
+    sheet_.EvaluateFormula(cell_);
+    return *cell_.cache_;
+}
+
+Cell::Value Cell::FormulaImpl::Evaluate() const {
+    FormulaInterface::Value value;
+    if(formula_->HasBranches()) {
+        value = formula_->Evaluate(sheet_.GetEvaluationSheet(), used_cells_);
+        // ячейки областей не попадают в used_cells_, поэтому таблица сама
+        // запоминает, что значение зависит от областей
+        sheet_.MarkRangesRead(formula_->GetReferencedRanges());
+    } else {
+        value = formula_->Evaluate(sheet_.GetEvaluationSheet());
+    }
+    if(std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return std::get<FormulaError>(value);
 }
 
 std::string Cell::FormulaImpl::GetText() const {
@@ -96,6 +241,39 @@ std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
     return formula_->GetReferencedCells();
 };
 
+std::vector<Range> Cell::FormulaImpl::GetReferencedRanges() const {
+    return formula_->GetReferencedRanges();
+}
+
+bool Cell::FormulaImpl::IsFormula() const {
+    return true;
+}
+
+const FormulaInterface* Cell::FormulaImpl::GetFormula() const {
+    return formula_.get();
+}
+
+void Cell::FormulaImpl::Validate() const {
+    formula_->Validate();
+}
+
+bool Cell::FormulaImpl::IsEmpty() const {
+    return false;
+}
+
+bool Cell::FormulaImpl::UsesCell(Position pos) const {
+    if(!formula_->HasBranches()) {
+        return true;
+    }
+    return std::binary_search(used_cells_.begin(), used_cells_.end(), pos);
+}
+
+void Cell::FormulaImpl::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.storage += sizeof(*this);
+    usage.formulas += formula_->GetMemoryUsage();
+    usage.dependencies += used_cells_.capacity() * sizeof(Position);
+}
+
 
 const std::vector<Position>& Cell::GetReferedCells() const {
     return refered_cells_;
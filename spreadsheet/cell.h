@@ -2,27 +2,70 @@
 
 #include "common.h"
 #include "formula.h"
+#include "string_pool.h"
 
 #include <unordered_set>
 #include <optional>
 
+class Sheet;
+
+// Приблизительный объём памяти (в байтах) по подсистемам таблицы
+struct MemoryUsage {
+    size_t storage = 0;       // объекты ячеек и узлы хранилища
+    size_t texts = 0;         // тексты ячеек
+    size_t formulas = 0;      // разобранные формулы (AST и списки ячеек)
+    size_t dependencies = 0;  // списки зависимых ячеек
+    size_t caches = 0;        // кешированные значения
+
+    size_t Total() const;
+    MemoryUsage& operator+=(const MemoryUsage& other);
+};
+
 class Cell : public CellInterface {
 public:
-    Cell(std::string text, const SheetInterface& sheet);
+    // Значение ячейки без копирования строк. Строка ссылается на данные
+    // ячейки и действительна, пока ячейка не изменена.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    Cell(std::string text, Sheet& sheet);
+    // Создаёт формульную ячейку из заранее разобранной формулы
+    Cell(std::unique_ptr<FormulaInterface> formula, Sheet& sheet);
     ~Cell();
 
-    void Set(std::string text, const SheetInterface& sheet);
+    void Set(std::string text, Sheet& sheet);
+    // Текст, который задаёт формулу, а не текстовое значение
+    static bool IsFormulaText(std::string_view text);
     void Clear();
 
     Value GetValue() const override;
+    ValueView GetValueView() const;
     std::string GetText() const override;
 
     void AddReferedCell(Position p);
+    void RemoveReferedCell(Position p);
+    void SetReferedCells(std::vector<Position> cells);
     const std::vector<Position>& GetReferedCells() const;
+    // Вычисляет формулу и кеширует значение. Формулы, которые она читает,
+    // должны быть уже вычислены: планировщик таблицы (Sheet::EvaluateFormula)
+    // вычисляет их раньше.
+    void Recalculate() const;
     void InvalidateCache();
+    bool HasCache() const;
+    // Закешированное значение вычислено с чтением ячейки pos. Для формул с
+    // ветвлениями учитываются только ячейки из выбранных ветвей.
+    bool UsesCell(Position pos) const;
     
     
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const;
+
+    bool IsFormula() const;
+    // Разобранная формула или nullptr, если ячейка не формульная
+    const FormulaInterface* GetFormula() const;
+    // Бросает FormulaException, если отложенная формула некорректна
+    void Validate() const;
+    bool IsEmpty() const;
+    MemoryUsage GetMemoryUsage() const;
 
 private:
     
@@ -37,11 +80,33 @@ private:
     class Impl {
     public:
         using Value = std::variant<std::string, double, FormulaError>;
+        virtual ~Impl() = default;
         virtual Value GetValue() const = 0;
         virtual std::string GetText() const = 0;
         virtual std::vector<Position> GetReferencedCells() const {
             return {};
         }
+        virtual std::vector<Range> GetReferencedRanges() const {
+            return {};
+        }
+        virtual std::string_view GetTextValue() const {
+            return {};
+        }
+        virtual bool IsFormula() const {
+            return false;
+        }
+        virtual const FormulaInterface* GetFormula() const {
+            return nullptr;
+        }
+        virtual bool IsEmpty() const {
+            return GetText().empty();
+        }
+        virtual bool UsesCell(Position pos) const {
+            return true;
+        }
+        virtual void Validate() const {
+        }
+        virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
     };
 
     class EmptyImpl: public Impl {
@@ -49,31 +114,55 @@ private:
         virtual void Set(std::string text);
         virtual Value GetValue() const;
         virtual std::string GetText() const;
+        virtual void AddMemoryUsage(MemoryUsage& usage) const override;
     };
 
+    // Текст хранится в пуле строк таблицы, одинаковые тексты разных ячеек
+    // занимают память один раз
     class TextImpl: public Impl {
     public:
-        TextImpl(std::string text);
+        TextImpl(std::string_view text, StringPool& strings);
+        TextImpl(const TextImpl&) = delete;
+        TextImpl& operator=(const TextImpl&) = delete;
+        ~TextImpl();
 
         virtual Value GetValue() const;
         virtual std::string GetText() const;
+        virtual std::string_view GetTextValue() const override;
+        virtual bool IsEmpty() const override;
+        virtual void AddMemoryUsage(MemoryUsage& usage) const override;
     private:
-        std::string _value;
+        StringPool& strings_;
+        StringPool::Handle handle_;
     };
 
     class FormulaImpl: public Impl {
     public:
-        FormulaImpl(std::string text, const SheetInterface& sheet);
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet, const Cell& cell);
 
         virtual Value GetValue() const;
 
         virtual std::string GetText() const;
         
         virtual std::vector<Position> GetReferencedCells() const override;
+        virtual std::vector<Range> GetReferencedRanges() const override;
+        virtual bool IsFormula() const override;
+        virtual const FormulaInterface* GetFormula() const override;
+        virtual bool IsEmpty() const override;
+        virtual bool UsesCell(Position pos) const override;
+        virtual void Validate() const override;
+        virtual void AddMemoryUsage(MemoryUsage& usage) const override;
+        Value Evaluate() const;
     private:
-        Value value_;
-        std::string text_;
+
+        const Sheet& sheet_;
+        // ячейка, которой принадлежит формула; по ней профилировщик
+        // различает формулы
+        const Cell& cell_;
         std::unique_ptr<FormulaInterface> formula_;
+        // ячейки, прочитанные при последнем вычислении; заполняется только
+        // для формул с ветвлениями
+        mutable std::vector<Position> used_cells_;
     };
 
 };
\ No newline at end of file
@@ -37,6 +37,21 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек, обе границы включаются в область
+struct Range {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+    // Запись вида "A1:B3"
+    std::string ToString() const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -44,6 +59,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // некорректная арифметическая операция
+        NotAvailable,  // функция поиска не нашла значение
     };
 
     FormulaError(Category category);
@@ -103,6 +119,9 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+class LookupInterface;
+class AggregateInterface;
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -147,6 +166,18 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Индексы для функций поиска по областям (VLOOKUP, MATCH, XLOOKUP).
+    // Если таблица их не поддерживает, возвращает nullptr, и формулы
+    // просматривают область целиком.
+    virtual const LookupInterface* GetLookup() const {
+        return nullptr;
+    }
+    // Агрегаты областей для функций SUM, COUNT, MIN, MAX. Если таблица их не
+    // поддерживает, возвращает nullptr, и формулы читают каждую ячейку.
+    virtual const AggregateInterface* GetAggregates() const {
+        return nullptr;
+    }
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,90 @@
+#include "durable_sheet.h"
+
+DurableSheet::DurableSheet(const std::filesystem::path& directory, WalOptions options)
+    : log_(directory, options) {
+    WriteAheadLog::CellTexts recovered = log_.TakeRecoveredCells();
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(recovered.size());
+    for(auto& [pos, text]: recovered) {
+        cells.emplace_back(pos, std::move(text));
+    }
+    // в журнал попадают только принятые таблицей изменения, поэтому
+    // восстановленное содержимое корректно
+    sheet_.SetCells(std::move(cells));
+}
+
+void DurableSheet::SetCell(Position pos, std::string text) {
+    std::string old_text = GetText(pos);
+    sheet_.SetCell(pos, text);
+    try {
+        log_.AppendSetCell(pos, text);
+    } catch (...) {
+        Restore(pos, std::move(old_text));
+        throw;
+    }
+}
+
+const CellInterface* DurableSheet::GetCell(Position pos) const {
+    return sheet_.GetCell(pos);
+}
+
+CellInterface* DurableSheet::GetCell(Position pos) {
+    return sheet_.GetCell(pos);
+}
+
+void DurableSheet::ClearCell(Position pos) {
+    std::string old_text = GetText(pos);
+    sheet_.ClearCell(pos);
+    try {
+        log_.AppendClearCell(pos);
+    } catch (...) {
+        Restore(pos, std::move(old_text));
+        throw;
+    }
+}
+
+Size DurableSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void DurableSheet::PrintValues(std::ostream& output) const {
+    sheet_.PrintValues(output);
+}
+
+void DurableSheet::PrintTexts(std::ostream& output) const {
+    sheet_.PrintTexts(output);
+}
+
+const LookupInterface* DurableSheet::GetLookup() const {
+    return sheet_.GetLookup();
+}
+
+const AggregateInterface* DurableSheet::GetAggregates() const {
+    return sheet_.GetAggregates();
+}
+
+void DurableSheet::Flush() {
+    log_.Flush();
+}
+
+void DurableSheet::Checkpoint() {
+    log_.Checkpoint();
+}
+
+const Sheet& DurableSheet::GetSheet() const {
+    return sheet_;
+}
+
+std::string DurableSheet::GetText(Position pos) const {
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell != nullptr ? cell->GetText() : std::string();
+}
+
+void DurableSheet::Restore(Position pos, std::string text) {
+    // прежний текст уже был в таблице, поэтому таблица его примет
+    if(text.empty()) {
+        sheet_.ClearCell(pos);
+    } else {
+        sheet_.SetCell(pos, std::move(text));
+    }
+}
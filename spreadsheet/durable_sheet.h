@@ -0,0 +1,48 @@
+#pragma once
+
+#include "sheet.h"
+#include "write_ahead_log.h"
+
+#include <filesystem>
+
+// Таблица, изменения которой сохраняются в журнал в каталоге. При создании
+// содержимое восстанавливается из снимка и журнала этого каталога. Изменение
+// попадает в журнал после того, как таблица его приняла, и сохраняется на
+// диск фоновым потоком; Flush() дожидается сохранения всех изменений. Если
+// журнал не принял запись (например, после ошибки записи на диск), изменение
+// отменяется, и таблица не расходится с журналом.
+class DurableSheet : public SheetInterface {
+public:
+    explicit DurableSheet(const std::filesystem::path& directory, WalOptions options = {});
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const LookupInterface* GetLookup() const override;
+    const AggregateInterface* GetAggregates() const override;
+
+    // Бросает ошибку фоновой контрольной точки, как WriteAheadLog::Flush
+    void Flush();
+    // Переносит журнал в снимок, не дожидаясь порога размера сегмента
+    void Checkpoint();
+
+    const Sheet& GetSheet() const;
+
+private:
+    // текст ячейки pos; пустой, если ячейки нет
+    std::string GetText(Position pos) const;
+    // возвращает ячейке pos текст, который был до изменения
+    void Restore(Position pos, std::string text);
+
+    Sheet sheet_;
+    WriteAheadLog log_;
+};
@@ -0,0 +1,92 @@
+#include "evaluation_profiler.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace {
+// вычисление, которое сейчас измеряется в этом потоке
+thread_local EvaluationProfiler::Scope* current_scope = nullptr;
+// количество вычислений верхнего уровня в этом потоке
+thread_local uint64_t top_level_evaluations = 0;
+
+double ToMilliseconds(std::chrono::nanoseconds time) {
+    return std::chrono::duration<double, std::milli>(time).count();
+}
+}  // namespace
+
+void PrintProfileReport(std::ostream& output, const ProfileReport& report) {
+    output << "Hottest formulas:\n";
+    for(const auto& [pos, profile]: report.hottest) {
+        output << pos.ToString()
+               << "\tevaluations " << profile.evaluations
+               << "\tinvalidations " << profile.invalidations
+               << "\ttotal " << ToMilliseconds(profile.total_time) << " ms"
+               << "\tself " << ToMilliseconds(profile.self_time) << " ms\n";
+    }
+    output << "Longest chains:\n";
+    for(const auto& chain: report.longest_chains) {
+        output << chain.size() << ':';
+        for(size_t i = 0; i < chain.size(); i++) {
+            output << (i == 0 ? " " : " -> ") << chain[i].ToString();
+        }
+        output << '\n';
+    }
+}
+
+EvaluationProfiler::EvaluationProfiler(uint32_t sample_period)
+    : sample_period_(std::max<uint32_t>(1, sample_period)) {
+}
+
+EvaluationProfiler::Scope::Scope(EvaluationProfiler& profiler, const Cell* cell)
+    : profiler_(profiler)
+    , cell_(cell)
+    , parent_(current_scope) {
+    // вложенные вычисления измеряются вместе с вычислением верхнего уровня,
+    // иначе собственное время формул было бы неверным
+    sampled_ = parent_ != nullptr ? parent_->sampled_
+                                  : top_level_evaluations++ % profiler_.sample_period_ == 0;
+    if(sampled_) {
+        start_ = std::chrono::steady_clock::now();
+    }
+    current_scope = this;
+}
+
+EvaluationProfiler::Scope::~Scope() {
+    current_scope = parent_;
+    if(!sampled_) {
+        return;
+    }
+    const std::chrono::nanoseconds total = std::chrono::steady_clock::now() - start_;
+    if(parent_ != nullptr) {
+        parent_->children_time_ += total;
+    }
+    const uint32_t weight = profiler_.sample_period_;
+    std::lock_guard lock(profiler_.mutex_);
+    FormulaProfile& profile = profiler_.profiles_[cell_];
+    if(!aborted_) {
+        profile.evaluations += weight;
+    }
+    profile.total_time += total * weight;
+    profile.self_time += (total - children_time_) * weight;
+}
+
+void EvaluationProfiler::Scope::Abort() {
+    aborted_ = true;
+}
+
+void EvaluationProfiler::RecordInvalidations(const std::vector<const Cell*>& cells) {
+    std::lock_guard lock(mutex_);
+    for(const Cell* cell: cells) {
+        ++profiles_[cell].invalidations;
+    }
+}
+
+void EvaluationProfiler::Forget(const Cell* cell) {
+    std::lock_guard lock(mutex_);
+    profiles_.erase(cell);
+}
+
+std::unordered_map<const Cell*, FormulaProfile> EvaluationProfiler::GetProfiles() const {
+    std::lock_guard lock(mutex_);
+    return profiles_;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Статистика вычислений одной формулы
+struct FormulaProfile {
+    // количество вычислений и сбросов значения из кеша
+    uint64_t evaluations = 0;
+    uint64_t invalidations = 0;
+    // время вычислений вместе с вычислением формул, на которые она
+    // ссылается, и без него
+    std::chrono::nanoseconds total_time{0};
+    std::chrono::nanoseconds self_time{0};
+};
+
+// Профиль формульной ячейки в отчёте
+struct CellProfile {
+    Position pos;
+    FormulaProfile profile;
+};
+
+struct ProfileReport {
+    // формулы с наибольшим собственным временем вычисления по убыванию
+    std::vector<CellProfile> hottest;
+    // самые длинные цепочки формул, каждая от зависимой формулы к той, от
+    // которой зависит вся цепочка
+    std::vector<std::vector<Position>> longest_chains;
+};
+
+void PrintProfileReport(std::ostream& output, const ProfileReport& report);
+
+// Собирает статистику вычислений формул. Время измеряется для каждого
+// sample_period-го вычисления верхнего уровня вместе со всеми вложенными в
+// него вычислениями, а счётчики вычислений умножаются на sample_period,
+// поэтому остальные вычисления обходятся без обращения к часам и
+// блокировки. Можно использовать из нескольких потоков.
+class EvaluationProfiler {
+public:
+    explicit EvaluationProfiler(uint32_t sample_period = 1);
+
+    // Измеряет вычисление формулы ячейки cell на время своего существования
+    class Scope {
+    public:
+        Scope(EvaluationProfiler& profiler, const Cell* cell);
+        ~Scope();
+
+        // Вычисление прервано и будет повторено: время учитывается, а
+        // вычисление не считается
+        void Abort();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        EvaluationProfiler& profiler_;
+        const Cell* cell_;
+        bool sampled_;
+        bool aborted_ = false;
+        std::chrono::steady_clock::time_point start_;
+        // время вложенных вычислений
+        std::chrono::nanoseconds children_time_{0};
+        Scope* parent_;
+    };
+
+    // Значения формул cells сброшены из кеша одним изменением; блокировка
+    // берётся один раз на всё изменение
+    void RecordInvalidations(const std::vector<const Cell*>& cells);
+    // Ячейка удалена или заменена; её статистика больше не нужна
+    void Forget(const Cell* cell);
+
+    std::unordered_map<const Cell*, FormulaProfile> GetProfiles() const;
+
+private:
+    const uint32_t sample_period_;
+    mutable std::mutex mutex_;
+    std::unordered_map<const Cell*, FormulaProfile> profiles_;
+};
@@ -1,17 +1,17 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "lookup_index.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <sstream>
-#include <set>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
+    return output << fe.ToString();
 }
 
 FormulaError::FormulaError(Category category): category_(category) {}
@@ -32,6 +32,8 @@ std::string_view FormulaError::ToString() const {
             return "#VALUE!";
         case FormulaError::Category::Arithmetic:
             return "#ARITHM!";
+        case FormulaError::Category::NotAvailable:
+            return "#N/A";
     }
     return "";
 }
@@ -47,16 +49,33 @@ public:
         }
     Value Evaluate(const SheetInterface& sheet) const override {
         try {
-            return ast_.Execute([&](const Position& p) -> const CellInterface* {
+            return ast_.Execute(FormulaContext{[&](const Position& p) -> const CellInterface* {
                 auto cell = sheet.GetCell(p);
                 return cell;
-            });
+            }, sheet.GetLookup(), sheet.GetAggregates()});
         } catch (const FormulaError& e) {
             return e;
         } catch (const InvalidPositionException&) {
             return FormulaError(FormulaError::Category::Ref);
         }
     }
+    Value Evaluate(const SheetInterface& sheet, std::vector<Position>& used_cells) const override {
+        used_cells.clear();
+        Value value;
+        try {
+            value = ast_.Execute(FormulaContext{[&](const Position& p) -> const CellInterface* {
+                used_cells.push_back(p);
+                return sheet.GetCell(p);
+            }, sheet.GetLookup(), sheet.GetAggregates()});
+        } catch (const FormulaError& e) {
+            value = e;
+        } catch (const InvalidPositionException&) {
+            value = FormulaError(FormulaError::Category::Ref);
+        }
+        std::sort(used_cells.begin(), used_cells.end());
+        used_cells.erase(std::unique(used_cells.begin(), used_cells.end()), used_cells.end());
+        return value;
+    }
     std::string GetExpression() const override  {
         std::ostringstream formula; 
         ast_.PrintFormula(formula);
@@ -65,16 +84,227 @@ public:
     
     
     std::vector<Position> GetReferencedCells() const {
-        const auto list = ast_.GetCells();
-        std::set<Position> cells = {std::begin(list), std::end(list)};
-        return {std::begin(cells), std::end(cells)};
+        return ast_.GetCells();
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return ast_.GetRanges();
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) - sizeof(ast_) + ast_.GetMemoryUsage();
+    }
+
+    bool HasBranches() const override {
+        return ast_.HasBranches();
     }
 
 private:
     FormulaAST ast_;
 };
+
+// Ссылки формулы, найденные просмотром лексем без разбора выражения
+struct ScannedReferences {
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    bool has_branches = false;
+};
+
+bool IsUpper(char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Просматривает выражение по тем же правилам, что и лексер грамматики:
+// CELL - буквы и цифры, NAME - только буквы, числа могут содержать точку и
+// порядок с буквой E. Ячейки с некорректной позицией пропускаются: такая
+// формула всё равно не будет разобрана.
+ScannedReferences ScanReferences(std::string_view expression) {
+    ScannedReferences result;
+    size_t i = 0;
+    auto skip_spaces = [&] {
+        while(i < expression.size() && std::isspace(static_cast<unsigned char>(expression[i]))) {
+            i++;
+        }
+    };
+    auto skip_digits = [&] {
+        while(i < expression.size() && IsDigit(expression[i])) {
+            i++;
+        }
+    };
+    // читает лексему CELL или NAME; для NAME возвращает nullopt, для
+    // ячейки с некорректной позицией - Position::NONE
+    auto read_cell = [&]() -> std::optional<Position> {
+        const size_t begin = i;
+        int col = 0;
+        while(i < expression.size() && IsUpper(expression[i])) {
+            col = std::min(col * 26 + (expression[i] - 'A' + 1), Position::MAX_COLS + 1);
+            i++;
+        }
+        const size_t letters_end = i;
+        int row = 0;
+        while(i < expression.size() && IsDigit(expression[i])) {
+            row = std::min(row * 10 + (expression[i] - '0'), Position::MAX_ROWS + 1);
+            i++;
+        }
+        if(i == letters_end) {
+            return std::nullopt;
+        }
+        Position pos{row - 1, col - 1};
+        return letters_end - begin <= 3 && pos.IsValid() ? pos : Position::NONE;
+    };
+
+    while(i < expression.size()) {
+        const char c = expression[i];
+        if(IsDigit(c) || c == '.') {
+            skip_digits();
+            if(i + 1 < expression.size() && expression[i] == '.' && IsDigit(expression[i + 1])) {
+                i++;
+                skip_digits();
+            }
+            if(i + 1 < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                size_t digits = i + 1;
+                if(digits < expression.size() && (expression[digits] == '+' || expression[digits] == '-')) {
+                    digits++;
+                }
+                if(digits < expression.size() && IsDigit(expression[digits])) {
+                    i = digits;
+                    skip_digits();
+                }
+            }
+            if(i < expression.size() && expression[i] == '.') {
+                i++;
+            }
+            continue;
+        }
+        if(!IsUpper(c)) {
+            i++;
+            continue;
+        }
+
+        std::optional<Position> cell = read_cell();
+        if(!cell) {
+            // имя функции
+            skip_spaces();
+            if(i < expression.size() && expression[i] == '(') {
+                result.has_branches = true;
+            }
+            continue;
+        }
+        const size_t cell_end = i;
+        skip_spaces();
+        if(i < expression.size() && expression[i] == ':') {
+            i++;
+            skip_spaces();
+            std::optional<Position> last = i < expression.size() && IsUpper(expression[i])
+                ? read_cell() : std::nullopt;
+            if(last && cell->IsValid() && last->IsValid()) {
+                result.ranges.push_back({{std::min(cell->row, last->row), std::min(cell->col, last->col)},
+                                         {std::max(cell->row, last->row), std::max(cell->col, last->col)}});
+            }
+            continue;
+        }
+        i = cell_end;
+        if(cell->IsValid()) {
+            result.cells.push_back(*cell);
+        }
+    }
+
+    std::sort(result.cells.begin(), result.cells.end());
+    result.cells.erase(std::unique(result.cells.begin(), result.cells.end()), result.cells.end());
+    std::sort(result.ranges.begin(), result.ranges.end());
+    result.ranges.erase(std::unique(result.ranges.begin(), result.ranges.end()), result.ranges.end());
+    return result;
+}
+
+// Формула, которая хранит текст и ссылки из ScanReferences и разбирается
+// при первом вычислении или запросе выражения. Если текст некорректен,
+// значение формулы - ошибка #VALUE!, а выражение - исходный текст.
+class DeferredFormula : public FormulaInterface {
+public:
+    explicit DeferredFormula(std::string expression)
+        : expression_(std::move(expression))
+        , references_(ScanReferences(expression_)) {
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override {
+        const FormulaInterface* formula = GetFormula();
+        if(formula == nullptr) {
+            return FormulaError(FormulaError::Category::Value);
+        }
+        return formula->Evaluate(sheet);
+    }
+
+    Value Evaluate(const SheetInterface& sheet, std::vector<Position>& used_cells) const override {
+        const FormulaInterface* formula = GetFormula();
+        if(formula == nullptr) {
+            used_cells.clear();
+            return FormulaError(FormulaError::Category::Value);
+        }
+        return formula->Evaluate(sheet, used_cells);
+    }
+
+    bool HasBranches() const override {
+        return references_.has_branches;
+    }
+
+    std::string GetExpression() const override {
+        const FormulaInterface* formula = GetFormula();
+        return formula != nullptr ? formula->GetExpression() : expression_;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return references_.cells;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return references_.ranges;
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t size = sizeof(*this) + references_.cells.capacity() * sizeof(Position)
+            + references_.ranges.capacity() * sizeof(Range);
+        if(expression_.capacity() > std::string().capacity()) {
+            size += expression_.capacity() + 1;
+        }
+        if(formula_ != nullptr) {
+            size += formula_->GetMemoryUsage();
+        }
+        return size;
+    }
+
+    void Validate() const override {
+        if(GetFormula() == nullptr) {
+            throw FormulaException("Error parsing formula");
+        }
+    }
+
+private:
+    const FormulaInterface* GetFormula() const {
+        if(formula_ == nullptr && !failed_) {
+            try {
+                formula_ = ParseFormula(expression_);
+            } catch (const FormulaException&) {
+                failed_ = true;
+            }
+        }
+        return formula_.get();
+    }
+
+    std::string expression_;
+    ScannedReferences references_;
+    mutable std::unique_ptr<FormulaInterface> formula_;
+    mutable bool failed_ = false;
+};
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> ParseFormulaDeferred(std::string expression) {
+    return std::make_unique<DeferredFormula>(std::move(expression));
 }
\ No newline at end of file
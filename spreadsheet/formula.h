@@ -9,6 +9,14 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Сравнения =, <>, <, <=, >, >= (истина равна 1, ложь 0): A1>=B1
+// * Функции IF(условие, да[, нет]), AND(...), OR(...). Невыбранная ветвь IF и
+//   аргументы AND/OR после первого решающего не вычисляются.
+// * Функции поиска по областям VLOOKUP(ключ, A1:C10, столбец[, приближённо]),
+//   MATCH(ключ, A1:A10[, тип]), XLOOKUP(ключ, A1:A10, B1:B10[, если нет]).
+//   Если значение не найдено, результат - ошибка #N/A.
+// * Агрегаты SUM, COUNT, MIN, MAX от чисел и областей: SUM(A1:A100, 5).
+//   В областях учитываются только ячейки с числами.
 // Ячейки указанные в формуле могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -23,6 +31,13 @@ public:
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // То же, но дополнительно возвращает в used_cells отсортированный список
+    // ячеек, значения которых действительно были прочитаны при вычислении.
+    virtual Value Evaluate(const SheetInterface& sheet, std::vector<Position>& used_cells) const = 0;
+
+    // Формула содержит ветвления, и при вычислении могут быть прочитаны не все
+    // ячейки из GetReferencedCells().
+    virtual bool HasBranches() const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
@@ -32,8 +47,28 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает области, переданные функциям в качестве аргументов. Ячейки
+    // областей не входят в GetReferencedCells(). Список отсортирован и не
+    // содержит повторов.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Возвращает приблизительный объём памяти (в байтах), занимаемый
+    // разобранной формулой, включая сам объект.
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Бросает FormulaException, если формула синтаксически некорректна.
+    // Формулы из ParseFormula проверяются при разборе.
+    virtual void Validate() const {
+    }
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Создаёт формулу без разбора выражения: ссылки на ячейки и области
+// находятся просмотром лексем, а разбор выполняется при первом вычислении
+// или запросе выражения. Исключений не бросает; значение некорректной
+// формулы - ошибка #VALUE!, а ошибку разбора сообщает Validate().
+std::unique_ptr<FormulaInterface> ParseFormulaDeferred(std::string expression);
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "goal_seek.h"
+
+#include "lookup_index.h"
+#include "scenario_table.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+
+GoalSeekResult GoalSeek(const Sheet& sheet, Position input, Position target, double goal,
+                        GoalSeekOptions options) {
+    const ScenarioModel model(sheet, {input}, {target});
+    if(!model.DependsOnInputs(0)) {
+        throw std::invalid_argument("Goal seek target does not depend on the input");
+    }
+    ScenarioModel::Evaluator evaluator(model);
+
+    GoalSeekResult result;
+    double best_error = std::numeric_limits<double>::infinity();
+    // отклонение цели от искомого значения; nullopt, если цель - не число
+    auto evaluate = [&](double x) -> std::optional<double> {
+        ++result.iterations;
+        CellInterface::Value value;
+        evaluator.Evaluate(&x, &value);
+        if(!std::holds_alternative<double>(value)) {
+            return std::nullopt;
+        }
+        const double error = std::get<double>(value) - goal;
+        if(std::abs(error) < best_error) {
+            best_error = std::abs(error);
+            result.input = x;
+            result.target = std::get<double>(value);
+        }
+        return error;
+    };
+    auto done = [&] {
+        return best_error <= options.tolerance || result.iterations >= options.max_iterations;
+    };
+
+    const CellInterface* input_cell = sheet.GetCell(input);
+    double x0 = 0;
+    if(input_cell != nullptr) {
+        x0 = ToLookupKey(input_cell->GetValue()).value_or(0);
+    }
+    std::optional<double> f0 = evaluate(x0);
+    double x1 = x0 + std::max(std::abs(x0) * 0.01, 1.0);
+    std::optional<double> f1 = evaluate(x1);
+    if(!f0) {
+        // в начальной точке цель не вычисляется, начинаем со второй
+        std::swap(x0, x1);
+        std::swap(f0, f1);
+        if(!f0) {
+            return result;
+        }
+        x1 = x0 + (x0 - x1);
+        f1 = evaluate(x1);
+    }
+
+    // метод секущих, пока не найдётся смена знака
+    while(!done()) {
+        if(!f1) {
+            // шаг вышел туда, где цель не вычисляется: уменьшаем его
+            x1 = (x0 + x1) / 2;
+            f1 = evaluate(x1);
+            continue;
+        }
+        if(std::signbit(*f0) != std::signbit(*f1)) {
+            break;
+        }
+        // на горизонтальном участке шаг увеличивается
+        const double x2 = *f1 == *f0 ? x1 + 2 * (x1 - x0) : x1 - *f1 * (x1 - x0) / (*f1 - *f0);
+        if(!std::isfinite(x2) || x2 == x1) {
+            result.found = best_error <= options.tolerance;
+            return result;
+        }
+        x0 = x1;
+        f0 = f1;
+        x1 = x2;
+        f1 = evaluate(x1);
+    }
+
+    // Метод ложного положения на отрезке [a, b] со сменой знака. Если
+    // одна граница долго не сдвигается, значение на другой уменьшается
+    // вдвое (модификация Illinois), чтобы шаги не стали сколь угодно малыми.
+    double a = x0;
+    double b = x1;
+    double fa = f0.value_or(0);
+    double fb = f1.value_or(0);
+    int side = 0;
+    while(!done()) {
+        double c = (fa * b - fb * a) / (fa - fb);
+        if(!(c > std::min(a, b) && c < std::max(a, b))) {
+            c = (a + b) / 2;
+        }
+        std::optional<double> fc = evaluate(c);
+        if(!fc) {
+            c = (a + b) / 2;
+            fc = evaluate(c);
+            if(!fc) {
+                break;
+            }
+        }
+        if(std::signbit(*fc) == std::signbit(fb)) {
+            b = c;
+            fb = *fc;
+            if(side == -1) {
+                fa /= 2;
+            }
+            side = -1;
+        } else {
+            a = c;
+            fa = *fc;
+            if(side == 1) {
+                fb /= 2;
+            }
+            side = 1;
+        }
+        // отрезок сжался до соседних чисел: на нём разрыв, а не корень
+        if(std::nextafter(std::min(a, b), std::max(a, b)) >= std::max(a, b)) {
+            break;
+        }
+    }
+    result.found = best_error <= options.tolerance;
+    return result;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+
+class Sheet;
+
+struct GoalSeekOptions {
+    // решение найдено, когда значение цели отличается от искомого не больше
+    // чем на tolerance
+    double tolerance = 1e-9;
+    int max_iterations = 100;
+};
+
+struct GoalSeekResult {
+    bool found = false;
+    // значение входа и значение цели при нём; если решение не найдено -
+    // лучшее из испробованных
+    double input = 0;
+    double target = 0;
+    // количество вычислений цели
+    int iterations = 0;
+};
+
+// Подбирает число во входной ячейке input, при котором формула target
+// принимает значение goal. Поиск начинается с текущего значения входа:
+// сначала методом секущих, а когда найден отрезок со сменой знака - методом
+// ложного положения с защитой от медленной сходимости, переходя к делению
+// пополам, если шаг выходит за отрезок. На каждом шаге вычисляются только
+// формулы между входом и целью, найденные один раз. Таблица не меняется:
+// найденное значение задаётся через SetCell, если оно нужно. Бросает
+// std::invalid_argument, если цель не зависит от входа.
+GoalSeekResult GoalSeek(const Sheet& sheet, Position input, Position target, double goal,
+                        GoalSeekOptions options = {});
@@ -0,0 +1,135 @@
+#include "lookup_index.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <limits>
+
+ColumnIndex::ColumnIndex(std::vector<std::optional<double>> keys)
+    : keys_(std::move(keys)) {
+}
+
+std::optional<int> ColumnIndex::Find(double key, LookupInterface::Match match) const {
+    if(match == LookupInterface::Match::Exact) {
+        if(!has_first_rows_) {
+            for(int row = static_cast<int>(keys_.size()) - 1; row >= 0; row--) {
+                if(keys_[row].has_value()) {
+                    first_rows_[*keys_[row]] = row;
+                }
+            }
+            has_first_rows_ = true;
+        }
+        auto it = first_rows_.find(key);
+        if(it == first_rows_.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    if(!has_sorted_) {
+        for(int row = 0; row < static_cast<int>(keys_.size()); row++) {
+            if(keys_[row].has_value()) {
+                sorted_.emplace_back(*keys_[row], row);
+            }
+        }
+        std::sort(sorted_.begin(), sorted_.end());
+        has_sorted_ = true;
+    }
+    std::optional<double> found_key;
+    if(match == LookupInterface::Match::LessOrEqual) {
+        auto it = std::upper_bound(sorted_.begin(), sorted_.end(),
+                                   std::make_pair(key, std::numeric_limits<int>::max()));
+        if(it != sorted_.begin()) {
+            found_key = std::prev(it)->first;
+        }
+    } else {
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(),
+                                   std::make_pair(key, std::numeric_limits<int>::min()));
+        if(it != sorted_.end()) {
+            found_key = it->first;
+        }
+    }
+    if(!found_key.has_value()) {
+        return std::nullopt;
+    }
+    // среди равных значений выбираем первую строку
+    return std::lower_bound(sorted_.begin(), sorted_.end(),
+                            std::make_pair(*found_key, std::numeric_limits<int>::min()))->second;
+}
+
+size_t ColumnIndex::GetMemoryUsage() const {
+    // узел хеш-таблицы: пара ключ-значение, указатель на следующий узел и хеш
+    static constexpr size_t node_size = sizeof(std::pair<const double, int>)
+                                        + sizeof(void*) + sizeof(size_t);
+    return sizeof(*this)
+        + keys_.capacity() * sizeof(std::optional<double>)
+        + first_rows_.size() * node_size + first_rows_.bucket_count() * sizeof(void*)
+        + sorted_.capacity() * sizeof(std::pair<double, int>);
+}
+
+LookupIndexCache::LookupIndexCache(const Sheet& sheet)
+    : sheet_(sheet) {
+}
+
+std::optional<int> LookupIndexCache::Find(Range column, double key, Match match) const {
+    auto column_it = columns_.find(column.top_left.col);
+    if(column_it != columns_.end()) {
+        const std::vector<Entry>& entries = column_it->second;
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const Entry& entry) {
+            return entry.first_row == column.top_left.row && entry.last_row == column.bottom_right.row;
+        });
+        if(it != entries.end()) {
+            return it->index.Find(key, match);
+        }
+    }
+    // ключи собираются до изменения кеша: если ячейка столбца ещё не
+    // вычислена или её вычисление завершилось исключением, кеш не меняется
+    std::vector<std::optional<double>> keys(column.GetSize().rows);
+    for(int row = column.top_left.row; row <= column.bottom_right.row; row++) {
+        const Position pos{row, column.top_left.col};
+        if(std::optional<double> number = sheet_.GetStoredNumber(pos)) {
+            keys[row - column.top_left.row] = number;
+        } else if(const Cell* cell = sheet_.GetConcreteCell(pos)) {
+            keys[row - column.top_left.row] = ToLookupKey(cell->GetValueView());
+        }
+    }
+    // вычисление ячеек столбца могло построить другие индексы
+    std::vector<Entry>& entries = columns_[column.top_left.col];
+    entries.push_back({column.top_left.row, column.bottom_right.row, ColumnIndex(std::move(keys))});
+    return entries.back().index.Find(key, match);
+}
+
+void LookupIndexCache::Invalidate(Position pos) {
+    auto it = columns_.find(pos.col);
+    if(it == columns_.end()) {
+        return;
+    }
+    std::vector<Entry>& entries = it->second;
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry& entry) {
+        return entry.first_row <= pos.row && pos.row <= entry.last_row;
+    }), entries.end());
+    if(entries.empty()) {
+        columns_.erase(it);
+    }
+}
+
+size_t LookupIndexCache::GetSize() const {
+    size_t size = 0;
+    for(const auto& [col, entries]: columns_) {
+        size += entries.size();
+    }
+    return size;
+}
+
+size_t LookupIndexCache::GetMemoryUsage() const {
+    static constexpr size_t node_size = sizeof(std::pair<const int, std::vector<Entry>>)
+                                        + sizeof(void*) + sizeof(size_t);
+    size_t usage = sizeof(*this) + columns_.size() * node_size + columns_.bucket_count() * sizeof(void*);
+    for(const auto& [col, entries]: columns_) {
+        usage += (entries.capacity() - entries.size()) * sizeof(Entry);
+        for(const Entry& entry: entries) {
+            usage += sizeof(entry) - sizeof(entry.index) + entry.index.GetMemoryUsage();
+        }
+    }
+    return usage;
+}
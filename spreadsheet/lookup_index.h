@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+class Sheet;
+
+// Поиск числа в столбце области для функций VLOOKUP, MATCH и XLOOKUP
+class LookupInterface {
+public:
+    enum class Match {
+        Exact,           // равное значение
+        LessOrEqual,     // наибольшее значение, не превышающее искомое
+        GreaterOrEqual,  // наименьшее значение, не меньшее искомого
+    };
+
+    virtual ~LookupInterface() = default;
+
+    // Возвращает номер подходящей строки, считая от начала столбца column
+    // (область из одного столбца). Если подходят несколько строк с одинаковым
+    // значением, возвращается первая из них. Данные не обязаны быть
+    // отсортированы.
+    virtual std::optional<int> Find(Range column, double key, Match match) const = 0;
+};
+
+// Число, с которым сравнивается значение ячейки при поиске. Пустые ячейки,
+// ошибки и текст, который не является числом, не совпадают ни с каким ключом.
+template <typename Value>
+std::optional<double> ToLookupKey(const Value& value) {
+    return std::visit([](const auto& x) -> std::optional<double> {
+        using Type = std::decay_t<decltype(x)>;
+        if constexpr(std::is_same_v<Type, double>) {
+            return x;
+        } else if constexpr(std::is_same_v<Type, FormulaError>) {
+            return std::nullopt;
+        } else {
+            // текст преобразуется в число так же, как при вычислении формул
+            std::string text(x);
+            size_t converted = 0;
+            try {
+                double result = std::stod(text, &converted);
+                if(converted == text.size()) {
+                    return result;
+                }
+            } catch (const std::logic_error&) {
+            }
+            return std::nullopt;
+        }
+    }, value);
+}
+
+// Индекс значений одного столбца. Хеш-таблица для точного поиска и
+// отсортированный массив для приближённого строятся при первом запросе
+// соответствующего вида.
+class ColumnIndex {
+public:
+    // keys[i] - ключ i-й строки столбца
+    explicit ColumnIndex(std::vector<std::optional<double>> keys);
+
+    std::optional<int> Find(double key, LookupInterface::Match match) const;
+
+    // Объём памяти индекса вместе с построенными таблицами
+    size_t GetMemoryUsage() const;
+
+private:
+    std::vector<std::optional<double>> keys_;
+    mutable std::unordered_map<double, int> first_rows_;
+    mutable std::vector<std::pair<double, int>> sorted_;
+    mutable bool has_first_rows_ = false;
+    mutable bool has_sorted_ = false;
+};
+
+// Индексы столбцов таблицы, которые строятся при первом поиске в области и
+// удаляются, когда меняется значение ячейки внутри неё. Индексы других
+// областей и других столбцов при этом сохраняются.
+class LookupIndexCache : public LookupInterface {
+public:
+    explicit LookupIndexCache(const Sheet& sheet);
+
+    std::optional<int> Find(Range column, double key, Match match) const override;
+
+    // Значение ячейки pos изменилось
+    void Invalidate(Position pos);
+
+    size_t GetSize() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Entry {
+        int first_row;
+        int last_row;
+        ColumnIndex index;
+    };
+
+    const Sheet& sheet_;
+    // индексы по номеру столбца
+    mutable std::unordered_map<int, std::vector<Entry>> columns_;
+};
@@ -1,8 +1,33 @@
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <limits>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
 
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+#include "batch_processor.h"
 #include "common.h"
+#include "durable_sheet.h"
 #include "formula.h"
+#include "goal_seek.h"
+#include "mapped_sheet.h"
+#include "parallel.h"
+#include "recording_sheet.h"
+#include "scenario_table.h"
+#include "sharded_sheet.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "trace_events.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -346,6 +371,1617 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    const size_t empty_total = sheet.GetMemoryUsage().Total();
+    ASSERT(empty_total > 0);
+
+    sheet.SetCell("A1"_pos, std::string(1000, 'x'));
+    sheet.SetCell("B2"_pos, "=1+2");
+    sheet.SetCell("B3"_pos, "=A1+A2+A3+(1+2)*(3+4)");
+
+    MemoryUsage usage = sheet.GetMemoryUsage();
+    ASSERT(usage.texts >= 1000);
+    ASSERT(usage.formulas > 0);
+    ASSERT(usage.dependencies > 0);
+    ASSERT(usage.Total() > empty_total);
+
+    auto by_row = sheet.GetMemoryUsageByRow();
+    ASSERT(by_row.count(0) && by_row.count(1) && by_row.count(2));
+    ASSERT(by_row.at(0).texts >= 1000);
+    ASSERT_EQUAL(by_row.at(1).texts + by_row.at(2).texts,
+                 sheet.GetMemoryUsage("A2"_pos, {2, 2}).texts);
+
+    auto largest = sheet.GetLargestFormulas(1);
+    ASSERT_EQUAL(largest.size(), 1u);
+    ASSERT_EQUAL(largest[0].first, "B3"_pos);
+    ASSERT_EQUAL(sheet.GetLargestFormulas(10).size(), 2u);
+}
+
+// Память таблицы, которая не относится ни к одной из её ячеек
+MemoryUsage GetSheetOverhead(const Sheet& sheet) {
+    MemoryUsage overhead = sheet.GetMemoryUsage();
+    for (const auto& [row, usage] : sheet.GetMemoryUsageByRow()) {
+        overhead.storage -= usage.storage;
+        overhead.texts -= usage.texts;
+        overhead.formulas -= usage.formulas;
+        overhead.dependencies -= usage.dependencies;
+        overhead.caches -= usage.caches;
+    }
+    return overhead;
+}
+
+void TestSheetStructuresMemoryUsage() {
+    constexpr size_t tree_node = sizeof(std::pair<const int, int>) + 4 * sizeof(void*);
+    const MemoryUsage empty = GetSheetOverhead(Sheet());
+
+    // счётчики строк и столбцов и хеши блоков: каждая ячейка в своих строке,
+    // столбце и блоке
+    Sheet diagonal;
+    for (int i = 0; i < 100; ++i) {
+        diagonal.SetCell({i * TileHashes::TILE_SIZE, i * TileHashes::TILE_SIZE}, "x");
+    }
+    ASSERT(GetSheetOverhead(diagonal).storage >= empty.storage + 2 * 100 * tree_node);
+    ASSERT(GetSheetOverhead(diagonal).caches >= empty.caches + 100 * 2 * sizeof(uint64_t));
+
+    // строки формул по столбцам
+    Sheet constants;
+    for (int row = 0; row < 100; ++row) {
+        constants.SetCell({row, 0}, "=1");
+    }
+    ASSERT(GetSheetOverhead(constants).dependencies
+           >= empty.dependencies + 100 * (sizeof(int) + 4 * sizeof(void*)));
+
+    // формулы, зависящие от области, и покрытие столбцов областями
+    Sheet cells;
+    Sheet ranges;
+    for (int row = 0; row < 200; ++row) {
+        cells.SetCell({row, 2}, "=A1+A10");
+        ranges.SetCell({row, 2}, "=SUM(A1:A10)");
+    }
+    ASSERT(GetSheetOverhead(ranges).dependencies
+           >= GetSheetOverhead(cells).dependencies + 200 * sizeof(Position));
+    Sheet narrow;
+    Sheet wide;
+    narrow.SetCell("A2"_pos, "=SUM(A1:A1)");
+    wide.SetCell("A2"_pos, "=SUM(A1:CV1)");
+    ASSERT(GetSheetOverhead(wide).dependencies
+           >= GetSheetOverhead(narrow).dependencies + 99 * 3 * tree_node);
+
+    // прочитанные области
+    const size_t unread = GetSheetOverhead(ranges).dependencies;
+    ASSERT_EQUAL(ranges.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(GetSheetOverhead(ranges).dependencies > unread);
+
+    // деревья агрегатов и индексы поиска
+    Sheet lookups;
+    for (int row = 0; row < 1000; ++row) {
+        lookups.SetCell({row, 0}, std::to_string(row));
+    }
+    lookups.SetCell("B1"_pos, "=SUM(A1:A1000)+MATCH(500, A1:A1000, 0)");
+    const size_t unevaluated = GetSheetOverhead(lookups).caches;
+    ASSERT_EQUAL(lookups.GetCell("B1"_pos)->GetValue(), CellInterface::Value(500.0 * 999 + 501));
+    const auto& aggregates = dynamic_cast<const SheetAggregates&>(*lookups.GetAggregates());
+    const auto& indexes = dynamic_cast<const LookupIndexCache&>(*lookups.GetLookup());
+    ASSERT(aggregates.GetMemoryUsage() > sizeof(aggregates) + 1000 * sizeof(RangeAggregate));
+    ASSERT(indexes.GetMemoryUsage() > sizeof(indexes) + 1000 * sizeof(std::optional<double>));
+    ASSERT(GetSheetOverhead(lookups).caches >= aggregates.GetMemoryUsage() + indexes.GetMemoryUsage());
+    ASSERT(GetSheetOverhead(lookups).caches > unevaluated);
+}
+
+void TestReadRange() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("B1"_pos, "'=escaped");
+    sheet.SetCell("A2"_pos, "=1+2");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("D5"_pos, "outside");
+
+    std::map<Position, std::string> visited;
+    sheet.ReadRange("A1"_pos, {2, 3}, [&](Position pos, Cell::ValueView value) {
+        std::ostringstream out;
+        std::visit([&](const auto& x) { out << x; }, value);
+        visited[pos] = out.str();
+    });
+    ASSERT_EQUAL(visited.size(), 4u);
+    ASSERT_EQUAL(visited["A1"_pos], "text");
+    ASSERT_EQUAL(visited["B1"_pos], "=escaped");
+    ASSERT_EQUAL(visited["A2"_pos], "3");
+
+    RangeBuffer buffer;
+    sheet.ReadRange("A1"_pos, {2, 3}, buffer);
+    ASSERT_EQUAL(buffer.size, (Size{2, 3}));
+    ASSERT(buffer.types[0] == RangeBuffer::Type::Text);
+    ASSERT_EQUAL(buffer.texts[1], "=escaped");
+    ASSERT(buffer.types[2] == RangeBuffer::Type::Empty);
+    ASSERT(buffer.types[3] == RangeBuffer::Type::Number);
+    ASSERT_EQUAL(buffer.numbers[3], 3.0);
+    ASSERT(buffer.types[4] == RangeBuffer::Type::Error);
+    ASSERT_EQUAL(buffer.texts[4], "#ARITHM!");
+
+    sheet.ReadRange({Position::MAX_ROWS - 2, Position::MAX_COLS - 3}, {10, 10}, buffer);
+    ASSERT_EQUAL(buffer.size, (Size{2, 3}));
+}
+
+void TestPrintableSizeTracking() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=D10");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->SetCell("C3"_pos, "x");
+    sheet->SetCell("B5"_pos, "y");
+    sheet->SetCell("E2"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+    sheet->ClearCell("B5"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+    sheet->SetCell("C3"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+    sheet->SetCell("D10"_pos, "5");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{10, 4}));
+    sheet->ClearCell("D10"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+    ASSERT(sheet->GetCell("D10"_pos) != nullptr);
+    ASSERT_EQUAL(sheet->GetCell("D10"_pos)->GetText(), "");
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestWorkloadRecording() {
+    std::stringstream trace;
+    {
+        RecordingSheet sheet(CreateSheet(), trace);
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1*3");
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*3");
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+        sheet.ClearCell("B1"_pos);
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "2\n");
+    }
+
+    TraceReader reader(trace);
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (reader.Read(record)) {
+        records.push_back(record);
+    }
+    ASSERT_EQUAL(records.size(), 7u);
+    ASSERT(records[1].op == TraceOp::SetCell);
+    ASSERT_EQUAL(records[1].pos, "B1"_pos);
+    ASSERT_EQUAL(records[1].text, "=A1*3");
+    ASSERT(!records[1].failed);
+    ASSERT(records[2].failed);
+    ASSERT(records[3].op == TraceOp::GetValue);
+    ASSERT(records[4].op == TraceOp::GetText);
+    ASSERT(records[5].op == TraceOp::ClearCell);
+    ASSERT(records[6].op == TraceOp::PrintValues);
+    for (size_t i = 1; i < records.size(); ++i) {
+        ASSERT(records[i - 1].timestamp <= records[i].timestamp);
+    }
+}
+
+void TestInternedTexts() {
+    Sheet sheet;
+    const std::string label(100, 'x');
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, label);
+        sheet.SetCell({row, 1}, "'=label");
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+    ASSERT(sheet.GetMemoryUsage().texts < 100 * label.size());
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A50"_pos)->GetValue()), label);
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), "'=label");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("B7"_pos)->GetValue()), "=label");
+
+    for (int row = 0; row < 100; ++row) {
+        sheet.ClearCell({row, 1});
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 1u);
+    sheet.SetCell("A1"_pos, "other");
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "other");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), label);
+
+    Sheet errors;
+    errors.SetCell("B1"_pos, "text");
+    errors.SetCell("A1"_pos, "=B1");
+    errors.SetCell("C1"_pos, "=1/0");
+    std::ostringstream values;
+    errors.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "#VALUE!\ttext\t#ARITHM!\n");
+}
+
+void TestDependentCellsRecalculated() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1*2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("B1"_pos, "=C1+1");
+    sheet->SetCell("C1"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet->ClearCell("C1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestThreadPool() {
+    ThreadPool pool(3);
+    ASSERT_EQUAL(pool.GetConcurrency(), 4u);
+    // задачи всех вызовов выполняют одни и те же потоки
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    std::vector<int> counts(64);
+    for(int call = 0; call < 20; call++) {
+        pool.Run(counts.size(), [&](size_t i) {
+            counts[i]++;
+            std::lock_guard lock(mutex);
+            threads.insert(std::this_thread::get_id());
+        });
+    }
+    ASSERT(std::all_of(counts.begin(), counts.end(), [](int count) { return count == 20; }));
+    ASSERT(threads.size() <= pool.GetConcurrency());
+
+    // вложенный вызов не ждёт занятые потоки пула
+    std::atomic<int> nested{0};
+    pool.Run(8, [&](size_t) {
+        pool.Run(8, [&](size_t) {
+            nested++;
+        });
+    });
+    ASSERT_EQUAL(nested.load(), 64);
+
+    // исключение бросается после завершения всех задач
+    std::atomic<int> finished{0};
+    try {
+        pool.Run(16, [&](size_t i) {
+            if(i == 3) {
+                throw std::runtime_error("task");
+            }
+            finished++;
+        });
+        ASSERT(false);
+    } catch (const std::runtime_error&) {
+    }
+    ASSERT_EQUAL(finished.load(), 15);
+
+    std::vector<int> values(1000);
+    ParallelFor(values.size(), 10, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            values[i] = static_cast<int>(i);
+        }
+    });
+    for(size_t i = 0; i < values.size(); i++) {
+        ASSERT_EQUAL(values[i], static_cast<int>(i));
+    }
+}
+
+void TestSetCells() {
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 1000; ++row) {
+        cells.emplace_back(Position{row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+    }
+    cells.emplace_back("A1"_pos, "7");
+    sheet.SetCells(std::move(cells));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 2}));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1998.0));
+
+    // допустимо только как одно изменение: по отдельности B1=A1 дал бы цикл
+    sheet.SetCells({{"A1"_pos, "=C1"}, {"B1"_pos, "5"}, {"C1"_pos, "=B1+1"}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetReferencedCells(), std::vector{"C1"_pos});
+
+    bool caught = false;
+    try {
+        sheet.SetCells({{"D1"_pos, "x"}, {"B1"_pos, "=A1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "5");
+
+    caught = false;
+    try {
+        sheet.SetCells({{"D1"_pos, "x"}, {"E1"_pos, "=1+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+}
+void TestConditionalFormulas() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return ParseFormula(std::move(expr))->Evaluate(*sheet);
+    };
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(std::get<double>(evaluate("1+1=2")), 1);
+    ASSERT_EQUAL(std::get<double>(evaluate("2<>2")), 0);
+    ASSERT_EQUAL(std::get<double>(evaluate("1<2*3")), 1);
+    ASSERT_EQUAL(std::get<double>(evaluate("IF(1>=2, 10, 20)")), 20);
+    ASSERT_EQUAL(std::get<double>(evaluate("IF(0, 10)")), 0);
+    ASSERT_EQUAL(std::get<double>(evaluate("AND(1, 2>1) + OR(0, 0)")), 1);
+    // невыбранная ветвь и аргументы после решающего не вычисляются
+    ASSERT_EQUAL(std::get<double>(evaluate("IF(1, 5, 1/0)")), 5);
+    ASSERT_EQUAL(std::get<double>(evaluate("OR(1, 1/0)")), 1);
+    ASSERT_EQUAL(std::get<double>(evaluate("AND(0, 1/0)")), 0);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("IF(0, 5, 1/0)")),
+                 FormulaError(FormulaError::Category::Arithmetic));
+
+    ASSERT_EQUAL(reformat("IF( (A1 < 2), B1 + 1, (C1) )"), "IF(A1<2,B1+1,C1)");
+    ASSERT_EQUAL(reformat("(1 = 2) + 3"), "(1=2)+3");
+    ASSERT_EQUAL(reformat("1 < (2 < 3)"), "1<(2<3)");
+    ASSERT_EQUAL(reformat("(1 < 2) < 3"), "1<2<3");
+    ASSERT_EQUAL(ParseFormula("IF(A1, B1, C1)")->GetReferencedCells(),
+                 (std::vector{"A1"_pos, "B1"_pos, "C1"_pos}));
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(isIncorrect("SUMM(1)"));
+    ASSERT(isIncorrect("IF(1)"));
+    ASSERT(isIncorrect("IF(1, 2, 3, 4)"));
+    ASSERT(isIncorrect("AND()"));
+    ASSERT(isIncorrect("1 <"));
+}
+
+void TestConditionalDependencies() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "10");
+    sheet.SetCell("C1"_pos, "20");
+    sheet.SetCell("D1"_pos, "=IF(A1>0, B1, C1)");
+    sheet.SetCell("E1"_pos, "=D1*2");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    // C1 не читалась при вычислении D1, поэтому значения D1 и E1 остаются в кеше
+    sheet.SetCell("C1"_pos, "30");
+    ASSERT(sheet.GetConcreteCell("D1"_pos)->HasCache());
+    ASSERT(sheet.GetConcreteCell("E1"_pos)->HasCache());
+
+    sheet.SetCell("B1"_pos, "11");
+    ASSERT(!sheet.GetConcreteCell("E1"_pos)->HasCache());
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(22.0));
+
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(60.0));
+    sheet.SetCell("C1"_pos, "40");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(80.0));
+    sheet.SetCell("B1"_pos, "12");
+    ASSERT(sheet.GetConcreteCell("E1"_pos)->HasCache());
+
+    // ссылки из обеих ветвей участвуют в проверке циклов
+    bool caught = false;
+    try {
+        sheet.SetCell("B1"_pos, "=E1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+void TestLookupFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "30");
+    sheet.SetCell("B1"_pos, "300");
+    sheet.SetCell("A2"_pos, "10");
+    sheet.SetCell("B2"_pos, "100");
+    sheet.SetCell("A3"_pos, "20");
+    sheet.SetCell("B3"_pos, "=A3*10");
+    sheet.SetCell("A4"_pos, "text");
+    sheet.SetCell("B4"_pos, "400");
+
+    auto value = [&](std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    const CellInterface::Value not_found = FormulaError(FormulaError::Category::NotAvailable);
+
+    sheet.SetCell("D1"_pos, "=VLOOKUP(20, A1:B4, 2, 0)");
+    sheet.SetCell("D2"_pos, "=VLOOKUP(25, A1:B4, 2)");
+    sheet.SetCell("D3"_pos, "=MATCH(10, A1:A4, 0)");
+    sheet.SetCell("D4"_pos, "=MATCH(15, A4:A1, -1)");
+    sheet.SetCell("D5"_pos, "=XLOOKUP(30, A1:A4, B1:B4)");
+    sheet.SetCell("D6"_pos, "=XLOOKUP(99, A1:A4, B1:B4, -1)");
+    sheet.SetCell("D7"_pos, "=MATCH(99, A1:A6, 0)");
+    sheet.SetCell("D8"_pos, "=VLOOKUP(10, A1:B4, 3, 0)");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(200.0));
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(200.0));
+    ASSERT_EQUAL(value("D3"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("D4"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("D5"), CellInterface::Value(300.0));
+    ASSERT_EQUAL(value("D6"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value("D7"), not_found);
+    ASSERT_EQUAL(value("D8"), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=MATCH(15,A1:A4,-1)");
+    ASSERT(sheet.GetCell("D1"_pos)->GetReferencedCells().empty());
+
+    // изменения внутри областей, в том числе значения формулы и пустой ячейки
+    sheet.SetCell("A3"_pos, "21");
+    ASSERT_EQUAL(value("D1"), not_found);
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(210.0));
+    sheet.SetCell("A6"_pos, "99");
+    ASSERT_EQUAL(value("D7"), CellInterface::Value(6.0));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(value("D3"), not_found);
+    // ячейка вне областей не сбрасывает значения
+    ASSERT_EQUAL(value("D5"), CellInterface::Value(300.0));
+    sheet.SetCell("C1"_pos, "1");
+    ASSERT(sheet.GetConcreteCell("D5"_pos)->HasCache());
+
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=D3");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(isIncorrect("A1:A2"));
+    ASSERT(isIncorrect("MATCH(1, A1:B4)"));
+    ASSERT(isIncorrect("XLOOKUP(1, A1:A4, B1:B3)"));
+    ASSERT(isIncorrect("VLOOKUP(1, 2, 3)"));
+    ASSERT(isIncorrect("IF(A1:A2, 1, 2)"));
+}
+
+void TestLookupIndexes() {
+    Sheet sheet;
+    const int rows = Position::MAX_ROWS;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string((rows - row) * 2));
+        cells.emplace_back(Position{row, 1}, std::to_string(row));
+        cells.emplace_back(Position{row, 2}, "=VLOOKUP(" + std::to_string(row * 2) + ", A1:B"
+                                                 + std::to_string(rows) + ", 2, 0)");
+    }
+    sheet.SetCells(std::move(cells));
+
+    // каждый поиск использует один и тот же индекс столбца A
+    double sum = 0;
+    for (int row = 1; row < rows; ++row) {
+        sum += std::get<double>(sheet.GetCell({row, 2})->GetValue());
+    }
+    ASSERT_EQUAL(sum, static_cast<double>(rows) * (rows - 1) / 2);
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // столбец из ещё не вычисленных формул: индекс попадает в кеш только
+    // после того, как вычислены все ключи
+    Sheet formulas;
+    for (int row = 0; row < 100; ++row) {
+        formulas.SetCell({row, 0}, "=" + std::to_string(row) + "*2");
+    }
+    formulas.SetCell("B1"_pos, "=MATCH(50, A1:A100, 0)");
+    const auto& cache = dynamic_cast<const LookupIndexCache&>(*formulas.GetLookup());
+    const size_t empty_usage = cache.GetMemoryUsage();
+    ASSERT_EQUAL(formulas.GetCell("B1"_pos)->GetValue(), CellInterface::Value(26.0));
+    ASSERT_EQUAL(cache.GetSize(), 1u);
+    ASSERT(cache.GetMemoryUsage() >= empty_usage + 100 * sizeof(std::optional<double>));
+    formulas.SetCell("A7"_pos, "1");
+    ASSERT_EQUAL(cache.GetSize(), 0u);
+}
+
+void TestAggregateFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "=A1*4");
+    sheet.SetCell("B1"_pos, "-2");
+    sheet.SetCell("B3"_pos, "3.5");
+
+    auto value = [&sheet](Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    sheet.SetCell("C1"_pos, "=SUM(A1:B3, 10)");
+    ASSERT_EQUAL(value("C1"_pos), 16.5);
+    sheet.SetCell("C2"_pos, "=COUNT(A1:B3)");
+    ASSERT_EQUAL(value("C2"_pos), 4.0);
+    sheet.SetCell("C3"_pos, "=MIN(A1:B3)+MAX(A1:A3,B3)");
+    ASSERT_EQUAL(value("C3"_pos), 2.0);
+    sheet.SetCell("C4"_pos, "=MAX(D1:D10)");
+    ASSERT_EQUAL(value("C4"_pos), 0.0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1:B3,10)");
+
+    // изменение ячейки области пересчитывает агрегаты
+    sheet.SetCell("B2"_pos, "-100");
+    ASSERT_EQUAL(value("C1"_pos), -83.5);
+    ASSERT_EQUAL(value("C3"_pos), -96.0);
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(value("C1"_pos), -78.5);
+
+    sheet.SetCell("D5"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    try {
+        sheet.SetCell("E1"_pos, "=SUM(A1:E1)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("E1"_pos, "=SUM()");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestRangeAggregates() {
+    Sheet sheet;
+    const int rows = Position::MAX_ROWS;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        // нарастающий итог столбца A
+        cells.emplace_back(Position{row, 1}, "=SUM(A1:A" + std::to_string(row + 1) + ")");
+    }
+    sheet.SetCells(std::move(cells));
+
+    auto total = [&sheet, rows]() {
+        return std::get<double>(sheet.GetCell({rows - 1, 1})->GetValue());
+    };
+    ASSERT_EQUAL(total(), static_cast<double>(rows) * (rows - 1) / 2);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({rows / 2, 1})->GetValue()),
+                 static_cast<double>(rows / 2) * (rows / 2 + 1) / 2);
+
+    // каждое изменение обновляет дерево столбца, а не суммирует его заново
+    for (int row = 0; row < rows; row += 64) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+        ASSERT_EQUAL(total(), static_cast<double>(rows) * (rows - 1) / 2 + row / 64 + 1);
+    }
+    sheet.ClearCell({rows - 1, 0});
+    ASSERT_EQUAL(total(), static_cast<double>(rows) * (rows - 1) / 2 + rows / 64 - (rows - 1));
+}
+void TestWriteAheadLog() {
+    namespace fs = std::filesystem;
+    const fs::path directory = fs::temp_directory_path()
+        / ("spreadsheet_wal_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    WalOptions options;
+    options.checkpoint_bytes = 4096;
+    {
+        DurableSheet sheet(directory, options);
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1*3");
+        sheet.SetCell("C1"_pos, "text");
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+        }
+        sheet.ClearCell("C1"_pos);
+        sheet.Flush();
+    }
+    {
+        DurableSheet sheet(directory, options);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+        // журнал несколько раз переходит через порог и переносится в снимок
+        for (int row = 0; row < 1000; ++row) {
+            sheet.SetCell({row, 3}, std::to_string(row));
+        }
+        sheet.Checkpoint();
+    }
+
+    std::vector<fs::path> segments;
+    for (const auto& entry : fs::directory_iterator(directory)) {
+        if (entry.path().filename().string().rfind("wal.", 0) == 0) {
+            segments.push_back(entry.path());
+        }
+    }
+    ASSERT_EQUAL(segments.size(), 1u);
+    ASSERT(fs::exists(directory / "snapshot"));
+    {
+        // запись, оборванная при сбое
+        std::ofstream segment(segments.front(), std::ios::binary | std::ios::app);
+        segment << '\0' << '\x05';
+    }
+    for (int i = 0; i < 2; ++i) {
+        DurableSheet sheet(directory, options);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*3");
+        ASSERT_EQUAL(sheet.GetCell({999, 3})->GetText(), "999");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 4}));
+    }
+
+    // каталог на месте временного файла снимка не даёт записать снимок
+    fs::create_directories(directory / "snapshot.tmp" / "busy");
+    {
+        DurableSheet sheet(directory, options);
+        for (int row = 0; row < 1000; ++row) {
+            sheet.SetCell({row, 4}, std::to_string(row));
+        }
+        // ошибка фоновой контрольной точки сообщается один раз
+        bool reported = false;
+        for (int attempt = 0; attempt < 1000 && !reported; ++attempt) {
+            try {
+                sheet.Flush();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            } catch (const std::runtime_error&) {
+                reported = true;
+            }
+        }
+        ASSERT(reported);
+        fs::remove_all(directory / "snapshot.tmp");
+        sheet.Checkpoint();
+        sheet.Flush();
+    }
+    {
+        DurableSheet sheet(directory, options);
+        ASSERT_EQUAL(sheet.GetCell({999, 4})->GetText(), "999");
+    }
+    fs::remove_all(directory);
+
+#ifndef _WIN32
+    // после ошибки записи журнал не принимает записи, и изменения отменяются
+    {
+        DurableSheet sheet(directory, options);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.Flush();
+        fs::path segment;
+        for (const auto& entry : fs::directory_iterator(directory)) {
+            if (entry.path().filename().string().rfind("wal.", 0) == 0) {
+                segment = entry.path();
+            }
+        }
+        // сегмент не может вырасти: запись в него завершается ошибкой EFBIG
+        rlimit old_limit{};
+        getrlimit(RLIMIT_FSIZE, &old_limit);
+        auto old_handler = std::signal(SIGXFSZ, SIG_IGN);
+        rlimit limit = old_limit;
+        limit.rlim_cur = fs::file_size(segment);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        sheet.SetCell("C1"_pos, "3");
+        bool failed = false;
+        try {
+            sheet.Flush();
+        } catch (const std::exception&) {
+            failed = true;
+        }
+        setrlimit(RLIMIT_FSIZE, &old_limit);
+        std::signal(SIGXFSZ, old_handler);
+        ASSERT(failed);
+
+        for (auto change : std::vector<std::function<void()>>{
+                 [&] { sheet.SetCell("A1"_pos, "5"); },
+                 [&] { sheet.SetCell("D1"_pos, "=A1*2"); },
+                 [&] { sheet.ClearCell("A1"_pos); }}) {
+            try {
+                change();
+                ASSERT(false);
+            } catch (const std::system_error&) {
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    }
+    fs::remove_all(directory);
+#endif
+}
+void TestMappedSheet() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path()
+        / ("spreadsheet_mapped_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*3+C2");
+    sheet.SetCell("C1"_pos, "'=text");
+    sheet.SetCell("A2"_pos, "=1/0");
+    sheet.SetCell("D3"_pos, "=SUM(A1:B1)");
+    WriteMappedSheet(sheet, path);
+
+    {
+        MappedSheet mapped(path);
+        ASSERT_EQUAL(mapped.GetPrintableSize(), sheet.GetPrintableSize());
+        std::ostringstream expected_values, values, expected_texts, texts;
+        sheet.PrintValues(expected_values);
+        mapped.PrintValues(values);
+        sheet.PrintTexts(expected_texts);
+        mapped.PrintTexts(texts);
+        ASSERT_EQUAL(values.str(), expected_values.str());
+        ASSERT_EQUAL(texts.str(), expected_texts.str());
+
+        ASSERT_EQUAL(mapped.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(mapped.GetCell("B1"_pos)->GetText(), "=A1*3+C2");
+        ASSERT_EQUAL(mapped.GetCell("B1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "C2"_pos}));
+        ASSERT_EQUAL(mapped.GetCell("C1"_pos)->GetValue(), CellInterface::Value("=text"));
+        ASSERT_EQUAL(mapped.GetCell("A2"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT_EQUAL(mapped.GetCell("D3"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT(mapped.GetCell("B3"_pos) == nullptr);
+        // повторный запрос возвращает тот же объект ячейки
+        ASSERT(mapped.GetCell("B1"_pos) == mapped.GetCell("B1"_pos));
+        try {
+            mapped.SetCell("A1"_pos, "1");
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+    }
+
+    // ячейки нескольких блоков читаются из нескольких потоков
+    constexpr int rows = 3000;
+    Sheet large;
+    for(int row = 0; row < rows; row++) {
+        large.SetCell({row, 0}, std::to_string(row));
+    }
+    WriteMappedSheet(large, path);
+    {
+        MappedSheet mapped(path);
+        std::vector<std::vector<const CellInterface*>> cells(4);
+        std::vector<std::thread> readers;
+        for(size_t i = 0; i < cells.size(); i++) {
+            readers.emplace_back([&, i] {
+                for(int row = 0; row < rows; row++) {
+                    const CellInterface* cell = mapped.GetCell({(row + int(i) * 700) % rows, 0});
+                    cells[i].push_back(cell);
+                }
+            });
+        }
+        for(auto& reader: readers) {
+            reader.join();
+        }
+        for(int row = 0; row < rows; row++) {
+            const CellInterface* cell = mapped.GetCell({row, 0});
+            ASSERT_EQUAL(cell->GetText(), std::to_string(row));
+            for(size_t i = 0; i < cells.size(); i++) {
+                ASSERT(cells[i][(row - int(i) * 700 % rows + rows) % rows] == cell);
+            }
+        }
+    }
+    fs::remove(path);
+}
+void TestDeferredParsing() {
+    // просмотр лексем находит те же ссылки, что и разбор
+    for (std::string expression : {"A1+B2*(C3-A1)", "1E5+E5*2.5E-3/.5", "IF(A1>2,SUM(B1:A3,C3),ZZ9)",
+                                   "VLOOKUP(A1, C1 : D10, 2)", "-(XFD16384)", "1"}) {
+        auto parsed = ParseFormula(expression);
+        auto deferred = ParseFormulaDeferred(expression);
+        ASSERT_EQUAL(deferred->GetReferencedCells(), parsed->GetReferencedCells());
+        ASSERT(deferred->GetReferencedRanges() == parsed->GetReferencedRanges());
+        ASSERT_EQUAL(deferred->HasBranches(), parsed->HasBranches());
+        ASSERT_EQUAL(deferred->GetExpression(), parsed->GetExpression());
+    }
+
+    Sheet sheet;
+    sheet.SetDeferredParsing(true);
+    sheet.SetCells({{"A1"_pos, "=B1*2"}, {"B1"_pos, "3"}, {"C1"_pos, "=A1+"}, {"D1"_pos, "=SUM(A1:B1)"}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(9.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1+");
+    sheet.SetCell("E1"_pos, "=(1");
+    ASSERT_EQUAL(sheet.ValidateFormulas(), (std::vector{"C1"_pos, "E1"_pos}));
+
+    // циклы обнаруживаются без разбора
+    try {
+        sheet.SetCell("B1"_pos, "=D1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    sheet.SetDeferredParsing(false);
+    try {
+        sheet.SetCell("F1"_pos, "=A1+");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+}
+
+void TestEvaluationProfiler() {
+    Sheet sheet;
+    sheet.SetCells({{"A1"_pos, "1"}, {"A2"_pos, "=A1+1"}, {"A3"_pos, "=A2*2"},
+                    {"B1"_pos, "=SUM(A1:A3)"}, {"C1"_pos, "=B1"}});
+    ASSERT(sheet.GetProfiler() == nullptr);
+    sheet.EnableProfiling();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(7.0));
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    ProfileReport report = sheet.GetProfileReport(10);
+    ASSERT_EQUAL(report.hottest.size(), 4u);
+    for (const auto& [pos, profile] : report.hottest) {
+        ASSERT_EQUAL(profile.evaluations, 2u);
+        ASSERT_EQUAL(profile.invalidations, 1u);
+        ASSERT(profile.self_time <= profile.total_time);
+    }
+    // C1 -> B1 через область -> A3 -> A2
+    ASSERT_EQUAL(report.longest_chains.size(), 4u);
+    ASSERT_EQUAL(report.longest_chains[0], (std::vector{"C1"_pos, "B1"_pos, "A3"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sheet.GetProfileReport(1).longest_chains.size(), 1u);
+
+    // заменённая формула начинает статистику заново
+    sheet.SetCell("C1"_pos, "=B1+1");
+    report = sheet.GetProfileReport(10);
+    ASSERT_EQUAL(report.hottest.size(), 3u);
+    std::ostringstream output;
+    PrintProfileReport(output, report);
+    ASSERT(output.str().find("4: C1 -> B1 -> A3 -> A2\n") != std::string::npos);
+
+    // при выборке время измеряется для каждого второго вычисления
+    sheet.EnableProfiling(2);
+    for (int i = 0; i < 4; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        sheet.GetCell("A2"_pos)->GetValue();
+    }
+    report = sheet.GetProfileReport(1);
+    ASSERT_EQUAL(report.hottest.size(), 1u);
+    ASSERT_EQUAL(report.hottest[0].pos, "A2"_pos);
+    ASSERT_EQUAL(report.hottest[0].profile.evaluations, 4u);
+}
+
+void TestTraceEvents() {
+    auto count = [](const std::string& trace, const std::string& name) {
+        size_t result = 0;
+        for (size_t pos = trace.find(name); pos != std::string::npos; pos = trace.find(name, pos + 1)) {
+            ++result;
+        }
+        return result;
+    };
+
+    Sheet sheet;
+    {
+        TraceScope before("BeforeStart");
+    }
+    StartTracing();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([] {
+            for (int j = 0; j < 100; ++j) {
+                TraceScope scope("Worker");
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    sheet.SetCell("A1"_pos, "=1+2");
+    sheet.GetCell("A1"_pos)->GetValue();
+    StopTracing();
+    {
+        TraceScope after("AfterStop");
+    }
+
+    std::ostringstream output;
+    WriteChromeTrace(output);
+    const std::string trace = output.str();
+    ASSERT(trace.rfind("{\"traceEvents\":[", 0) == 0);
+    ASSERT_EQUAL(count(trace, "\"Worker\""), 400u);
+    ASSERT_EQUAL(count(trace, "BeforeStart"), 0u);
+    ASSERT_EQUAL(count(trace, "AfterStop"), 0u);
+#ifdef SPREADSHEET_TRACING
+    for (std::string phase : {"SetCell", "Parse", "CheckCycles", "Link", "Invalidate", "Evaluate"}) {
+        ASSERT_EQUAL(count(trace, "\"" + phase + "\""), 1u);
+    }
+#endif
+}
+
+void TestSheetDiff() {
+    Sheet from;
+    Sheet to;
+    for (int row = 0; row < 200; ++row) {
+        from.SetCell({row, 0}, std::to_string(row));
+        to.SetCell({row, 0}, std::to_string(row));
+    }
+    from.SetCell("B1"_pos, "=A1+A2");
+    to.SetCell("B1"_pos, "=A1 + A2");
+    ASSERT(DiffSheets(from, to).empty());
+
+    to.SetCell("A5"_pos, "text");
+    to.SetCell("B150"_pos, "=SUM(A1:A3)");
+    to.ClearCell("A100"_pos);
+    from.SetCell("CV500"_pos, "far");
+    SheetPatch patch = DiffSheets(from, to);
+    // сравнение не вычисляет формулы
+    ASSERT(!to.GetConcreteCell("B150"_pos)->HasCache());
+    ASSERT_EQUAL(patch.size(), 4u);
+    ASSERT_EQUAL(patch[0].first, "A5"_pos);
+    ASSERT_EQUAL(patch[0].second, "text");
+    ASSERT_EQUAL(patch[1].first, "A100"_pos);
+    ASSERT_EQUAL(patch[1].second, "");
+    ASSERT_EQUAL(patch[2].first, "B150"_pos);
+    ASSERT_EQUAL(patch[3].first, "CV500"_pos);
+    ASSERT_EQUAL(patch[3].second, "");
+
+    ApplyPatch(from, patch);
+    ASSERT(DiffSheets(from, to).empty());
+    ASSERT(DiffSheets(to, from).empty());
+    ASSERT_EQUAL(from.GetCell("B150"_pos)->GetValue(), CellInterface::Value(3.0));
+    std::ostringstream from_texts;
+    std::ostringstream to_texts;
+    from.PrintTexts(from_texts);
+    to.PrintTexts(to_texts);
+    ASSERT_EQUAL(from_texts.str(), to_texts.str());
+
+    // некорректное изменение не применяется частично
+    try {
+        ApplyPatch(from, {{"C1"_pos, "1"}, {"A1"_pos, "=B1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(from.GetCell("C1"_pos) == nullptr);
+}
+
+void TestSheetFork() {
+    Sheet sheet;
+    sheet.SetCells({{"A1"_pos, "10"}, {"A2"_pos, "=A1*2"}, {"A3"_pos, "=A2+1"},
+                    {"B1"_pos, "5"}, {"B2"_pos, "=B1*B1"}, {"C1"_pos, "=SUM(A1:A3)"}, {"D1"_pos, "'=text"}});
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(51.0));
+
+    SheetFork fork = sheet.Fork();
+    ASSERT(fork.GetCell("B2"_pos) == sheet.GetCell("B2"_pos));
+    fork.SetCell("A1"_pos, "20");
+    ASSERT_EQUAL(fork.GetCell("A3"_pos)->GetValue(), CellInterface::Value(41.0));
+    ASSERT_EQUAL(fork.GetCell("C1"_pos)->GetValue(), CellInterface::Value(101.0));
+    ASSERT_EQUAL(fork.GetCell("A2"_pos)->GetText(), "=A1*2");
+    // пересчитываются только формулы, зависящие от изменённой ячейки
+    ASSERT_EQUAL(fork.GetRecalculatedCount(), 3u);
+    ASSERT(fork.GetCell("B2"_pos) == sheet.GetCell("B2"_pos));
+    // исходная таблица не меняется
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(51.0));
+
+    // формула копии зависит от формул исходной таблицы, и наоборот
+    fork.SetCell("B1"_pos, "=A3-1");
+    ASSERT_EQUAL(fork.GetCell("B2"_pos)->GetValue(), CellInterface::Value(1600.0));
+    fork.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(fork.GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+    try {
+        fork.SetCell("A1"_pos, "=B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        fork.SetCell("A1"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        fork.SetCell("A1"_pos, "=SUM(A1:A2)");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(fork.GetCell("A1"_pos)->GetText(), "1");
+
+    fork.ClearCell("D1"_pos);
+    fork.SetCell("E3"_pos, "new");
+    std::ostringstream texts;
+    fork.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "1\t=A3-1\t=SUM(A1:A3)\t\t\n=A1*2\t=B1*B1\t\t\t\n=A2+1\t\t\t\tnew\n");
+    fork.ClearCell("E3"_pos);
+    ASSERT_EQUAL(fork.GetPrintableSize(), (Size{3, 3}));
+    std::ostringstream values;
+    fork.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "1\t2\t6\n2\t4\t\n3\t\t\n");
+
+    // независимые копии одной таблицы
+    SheetFork other = sheet.Fork();
+    other.SetCell("B1"_pos, "6");
+    ASSERT_EQUAL(other.GetCell("B2"_pos)->GetValue(), CellInterface::Value(36.0));
+    ASSERT_EQUAL(other.GetCell("A3"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(25.0));
+
+    // поиск и агрегаты копии совпадают с таблицей, в которой сделаны те же
+    // изменения
+    Sheet numbers;
+    Sheet expected;
+    for(Sheet* target: {&numbers, &expected}) {
+        for(int row = 0; row < 100; row++) {
+            target->SetCell({row, 0}, std::to_string(row));
+        }
+        target->SetCell("B1"_pos, "=SUM(A1:A100)");
+        target->SetCell("B2"_pos, "=MATCH(50, A1:A100, 0)");
+        target->SetCell("B3"_pos, "=MAX(A1:A50)+MIN(A60:A100)");
+        target->SetCell("B4"_pos, "=XLOOKUP(60, A1:A100, A1:A100)");
+    }
+    for(int row = 1; row <= 4; row++) {
+        numbers.GetCell({row - 1, 1})->GetValue();
+    }
+    SheetFork scenario = numbers.Fork();
+    ASSERT(scenario.GetLookup() != nullptr && scenario.GetAggregates() != nullptr);
+    auto check = [&] {
+        for(int row = 0; row < 4; row++) {
+            ASSERT_EQUAL(scenario.GetCell({row, 1})->GetValue(), expected.GetCell({row, 1})->GetValue());
+        }
+    };
+    for(const char* text: {"1000", "50", "=A1-1", "text"}) {
+        scenario.SetCell("A51"_pos, text);
+        expected.SetCell("A51"_pos, text);
+        check();
+    }
+    // формула, область которой не менялась, берётся из исходной таблицы
+    ASSERT(scenario.GetCell("B3"_pos) == numbers.GetCell("B3"_pos));
+    scenario.SetCell("A52"_pos, "=1/0");
+    expected.SetCell("A52"_pos, "=1/0");
+    check();
+
+    // индекс копии строится по ещё не вычисленным формулам копии
+    for(int row = 0; row < 10; row++) {
+        scenario.SetCell({row, 3}, "=A" + std::to_string(row + 1) + "*3");
+    }
+    scenario.SetCell("E1"_pos, "=MATCH(9, D1:D10, 0)+SUM(D1:D10)");
+    ASSERT_EQUAL(scenario.GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0 + 135));
+}
+
+void TestScenarioTable() {
+    Sheet sheet;
+    sheet.SetCells({{"A1"_pos, "100"}, {"A2"_pos, "0.05"}, {"A3"_pos, "=A1*(1+A2)"},
+                    {"B1"_pos, "=IF(A3>110,A3-110,0)"}, {"B2"_pos, "=SUM(A1:A3)/C1"}, {"C1"_pos, "=2*2"},
+                    {"D1"_pos, "text"}, {"D2"_pos, "=C1+1"}});
+    const std::vector<Position> inputs = {"A1"_pos, "A2"_pos};
+    const std::vector<Position> outputs = {"B1"_pos, "B2"_pos, "A2"_pos, "D1"_pos, "D2"_pos};
+    std::vector<std::vector<double>> values;
+    for (int i = 0; i < 500; ++i) {
+        values.push_back({100.0 + i, i % 7 == 0 ? -1.0 : 0.01 * (i % 10)});
+    }
+
+    ScenarioTable table = EvaluateScenarios(sheet, inputs, outputs, values);
+    ASSERT_EQUAL(table.scenarios, 500u);
+    ASSERT_EQUAL(table.outputs, 5u);
+    // таблица не меняется
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(105.0));
+
+    Sheet serial;
+    serial.SetCells({{"A3"_pos, "=A1*(1+A2)"}, {"B1"_pos, "=IF(A3>110,A3-110,0)"},
+                     {"B2"_pos, "=SUM(A1:A3)/C1"}, {"C1"_pos, "=2*2"}, {"D1"_pos, "text"}, {"D2"_pos, "=C1+1"}});
+    for (size_t i = 0; i < values.size(); ++i) {
+        serial.SetCell("A1"_pos, std::to_string(values[i][0]));
+        serial.SetCell("A2"_pos, std::to_string(values[i][1]));
+        // входы в сценарии - числа, а не текст
+        ASSERT_EQUAL(table.Get(i, 2), CellInterface::Value(values[i][1]));
+        for (size_t j : {0, 1, 3, 4}) {
+            ASSERT_EQUAL(table.Get(i, j), serial.GetCell(outputs[j])->GetValue());
+        }
+    }
+
+    try {
+        EvaluateScenarios(sheet, inputs, outputs, {{1.0}});
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+
+    // области из чисел в колонках, внутри которых есть вход и формулы модели
+    auto fill = [](Sheet& target) {
+        for(int row = 0; row < 40; row++) {
+            target.SetCell({row, 0}, std::to_string(row * 2));
+            target.SetCell({row, 1}, std::to_string(row * 10));
+        }
+        target.SetCells({{"E1"_pos, "=SUM(A1:A40)+F1"}, {"E2"_pos, "=VLOOKUP(F1,A1:B40,2)"},
+                         {"E3"_pos, "=MATCH(F1,A1:A40,0)"}, {"E4"_pos, "=MAX(A1:A40)*COUNT(B1:B40)"},
+                         {"E5"_pos, "=SUM(E1:E2)+MIN(A3:A40)"}});
+    };
+    Sheet ranges;
+    fill(ranges);
+    ASSERT(ranges.GetStoredNumber("A20"_pos).has_value());
+    ASSERT(ranges.GetStoredNumber("B20"_pos).has_value());
+    const std::vector<Position> range_inputs = {"A5"_pos, "F1"_pos};
+    const std::vector<Position> range_outputs = {"E1"_pos, "E2"_pos, "E3"_pos, "E4"_pos, "E5"_pos};
+    std::vector<std::vector<double>> range_values;
+    for(int i = 0; i < 200; i++) {
+        range_values.push_back({i % 3 == 0 ? 100.0 + i : 8.0, static_cast<double>(i % 50)});
+    }
+    ScenarioTable range_table = EvaluateScenarios(ranges, range_inputs, range_outputs, range_values);
+    Sheet range_serial;
+    fill(range_serial);
+    for(size_t i = 0; i < range_values.size(); i++) {
+        range_serial.SetCell("A5"_pos, std::to_string(range_values[i][0]));
+        range_serial.SetCell("F1"_pos, std::to_string(range_values[i][1]));
+        for(size_t j = 0; j < range_outputs.size(); j++) {
+            ASSERT_EQUAL(range_table.Get(i, j), range_serial.GetCell(range_outputs[j])->GetValue());
+        }
+    }
+}
+
+void TestGoalSeek() {
+    Sheet sheet;
+    sheet.SetCells({{"A1"_pos, "1"}, {"B1"_pos, "=A1*A1"}, {"C1"_pos, "=B1-2"}, {"D1"_pos, "=C1*1000"},
+                    {"A2"_pos, "=1/(A1-1)"}});
+    // между входом и целью только B1 и C1
+    ASSERT_EQUAL(ScenarioModel(sheet, {"A1"_pos}, {"C1"_pos}).GetConeSize(), 2u);
+
+    GoalSeekResult result = GoalSeek(sheet, "A1"_pos, "C1"_pos, 0);
+    ASSERT(result.found);
+    ASSERT(std::abs(result.input - std::sqrt(2.0)) < 1e-9);
+    ASSERT(std::abs(result.target) <= 1e-9);
+    ASSERT(result.iterations < 20);
+    // таблица не меняется
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-1.0));
+
+    // в начальной точке цель - ошибка #ARITHM
+    result = GoalSeek(sheet, "A1"_pos, "A2"_pos, 0.25);
+    ASSERT(result.found);
+    ASSERT(std::abs(result.input - 5) < 1e-6);
+
+    // недостижимое значение
+    result = GoalSeek(sheet, "A1"_pos, "B1"_pos, -1, {1e-9, 50});
+    ASSERT(!result.found);
+    ASSERT_EQUAL(result.iterations, 50);
+    ASSERT(std::abs(result.target) < 1e-3);
+
+    // цель не зависит от входа: подбирать нечего
+    try {
+        GoalSeek(sheet, "B1"_pos, "A2"_pos, 0);
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+}
+
+void TestShardedSheet() {
+    // по 8 строк в полосе, четыре части
+    ShardedSheet sheet(4, 8);
+    Sheet expected;
+    ASSERT_EQUAL(sheet.GetShardIndex("A9"_pos), 1u);
+    ASSERT_EQUAL(sheet.GetShardIndex("A33"_pos), 0u);
+
+    // каждый поток пишет в свою часть
+    std::vector<std::thread> writers;
+    for(int shard = 0; shard < 4; shard++) {
+        writers.emplace_back([&sheet, shard] {
+            for(int row = shard * 8; row < shard * 8 + 8; row++) {
+                for(int col = 0; col < 4; col++) {
+                    sheet.SetCell({row, col}, std::to_string(row * 4 + col));
+                }
+            }
+        });
+    }
+    for(auto& writer: writers) {
+        writer.join();
+    }
+    for(int row = 0; row < 32; row++) {
+        for(int col = 0; col < 4; col++) {
+            expected.SetCell({row, col}, std::to_string(row * 4 + col));
+        }
+    }
+
+    // формулы ссылаются на ячейки и области других частей
+    for(SheetInterface* target: {static_cast<SheetInterface*>(&sheet), static_cast<SheetInterface*>(&expected)}) {
+        target->SetCell("E1"_pos, "=SUM(A1:A32)");
+        target->SetCell("E9"_pos, "=E1+A1");
+        target->SetCell("E17"_pos, "=E9*2");
+    }
+    ASSERT_EQUAL(sheet.GetCell("E17"_pos)->GetValue(), CellInterface::Value(3968.0));
+
+    // изменения в разных частях сбрасывают формулы по всей цепочке
+    writers.clear();
+    for(int shard = 0; shard < 4; shard++) {
+        writers.emplace_back([&sheet, shard] {
+            sheet.SetCell({shard * 8, 0}, "1000");
+        });
+    }
+    for(auto& writer: writers) {
+        writer.join();
+    }
+    for(int shard = 0; shard < 4; shard++) {
+        expected.SetCell({shard * 8, 0}, "1000");
+    }
+    ASSERT_EQUAL(sheet.GetCell("E17"_pos)->GetValue(), expected.GetCell("E17"_pos)->GetValue());
+    sheet.ClearCell("A1"_pos);
+    expected.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("E17"_pos)->GetValue(), expected.GetCell("E17"_pos)->GetValue());
+
+    // цикл через три части
+    try {
+        sheet.SetCell("A2"_pos, "=E17");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "4");
+
+    ASSERT_EQUAL(sheet.GetPrintableSize(), expected.GetPrintableSize());
+    std::ostringstream values;
+    std::ostringstream expected_values;
+    sheet.PrintValues(values);
+    expected.PrintValues(expected_values);
+    ASSERT_EQUAL(values.str(), expected_values.str());
+    std::ostringstream texts;
+    std::ostringstream expected_texts;
+    sheet.PrintTexts(texts);
+    expected.PrintTexts(expected_texts);
+    ASSERT_EQUAL(texts.str(), expected_texts.str());
+}
+
+void TestShardedSheetLinks() {
+    ShardedSheet sheet(4, 8);
+
+    // формулы внутри своих полос задаются параллельно
+    std::vector<std::thread> writers;
+    for(int shard = 0; shard < 4; shard++) {
+        writers.emplace_back([&sheet, shard] {
+            const int first_row = shard * 8;
+            sheet.SetCell({first_row, 0}, std::to_string(shard));
+            for(int row = first_row + 1; row < first_row + 8; row++) {
+                sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+            }
+            sheet.SetCell({first_row, 1}, "=SUM(A" + std::to_string(first_row + 1) + ":A"
+                                              + std::to_string(first_row + 8) + ")");
+        });
+    }
+    for(auto& writer: writers) {
+        writer.join();
+    }
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B9"_pos)->GetValue(), CellInterface::Value(36.0));
+    ASSERT_EQUAL(sheet.GetCell("A32"_pos)->GetValue(), CellInterface::Value(10.0));
+    try {
+        sheet.SetCell("A9"_pos, "=A16");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // цикл, который проходит через другую часть, найден полной проверкой
+    sheet.SetCell("C9"_pos, "=C1");
+    sheet.SetCell("C1"_pos, "=C10");
+    try {
+        sheet.SetCell("C10"_pos, "=C9");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 2u);
+
+    // замена и удаление формулы удаляют её связи между частями
+    sheet.SetCell("C9"_pos, "=C10*2");
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 1u);
+    sheet.SetCell("D1"_pos, "=C10+A9");
+    sheet.SetCell("D2"_pos, "=C10");
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 4u);
+    sheet.SetCell("D1"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 2u);
+    sheet.ClearCell("C1"_pos);
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 1u);
+
+    // оставшаяся ссылка по-прежнему сбрасывает значение
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet.SetCell("C10"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.ClearCell("D2"_pos);
+    ASSERT_EQUAL(sheet.GetCrossReferenceCount(), 0u);
+
+    // ячейки чужих позиций не создаются в таблице, которая на них ссылается
+    Sheet part;
+    part.SetOwnedCells([](Position pos) {
+        return pos.row < 8;
+    });
+    part.SetCell("A1"_pos, "=A9+A2");
+    ASSERT(part.GetConcreteCell("A9"_pos) == nullptr);
+    ASSERT(part.GetConcreteCell("A2"_pos) != nullptr);
+    ASSERT_EQUAL(part.GetDependentCells("A9"_pos), std::vector<Position>{"A1"_pos});
+    part.ClearCell("A1"_pos);
+    ASSERT(part.GetDependentCells("A9"_pos).empty());
+}
+
+void TestBatchProcessor() {
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / "spreadsheet_batch_test.txt";
+    Sheet sheet;
+    std::ostringstream output;
+    BatchProcessor processor(sheet, output);
+    std::istringstream input(
+        "# комментарий\n"
+        "set A1 2\n"
+        "set B1 =A1*3\n"
+        "set C1 =B1+\n"
+        "set A2 =A3\n"
+        "set A3 =A2\n"
+        "get B1\n"
+        "get A2\n"
+        "clear B1\n"
+        "set C1 'text\n"
+        "print texts\n"
+        "save " + path.string() + "\n"
+        "frobnicate A1\n"
+        "get ZZZZ1\n");
+    processor.Run(input);
+    ASSERT_EQUAL(output.str(),
+                 "error 4: Error parsing formula\n"
+                 "error 6: Circular dependency exception\n"
+                 "B1\t6\n"
+                 "A2\t0\n"
+                 "2\t\t'text\n"
+                 "=A3\t\t\n"
+                 "error 13: Unknown command frobnicate\n"
+                 "error 14: Invalid position ZZZZ1\n");
+    const BatchStats& stats = processor.GetStats();
+    ASSERT_EQUAL(stats.commands, 13u);
+    ASSERT_EQUAL(stats.sets, 6u);
+    ASSERT_EQUAL(stats.batches, 2u);
+    ASSERT_EQUAL(stats.errors, 4u);
+
+    // сохранённые команды воспроизводят таблицу
+    Sheet loaded;
+    std::ostringstream loaded_output;
+    BatchProcessor loader(loaded, loaded_output);
+    std::istringstream load("load " + path.string() + "\nprint values\n");
+    loader.Run(load);
+    std::ostringstream expected;
+    sheet.PrintValues(expected);
+    ASSERT_EQUAL(loaded_output.str(), expected.str());
+    std::filesystem::remove(path);
+
+    // файлы загружают друг друга: цикл обрывается с ошибкой
+    const std::filesystem::path first = std::filesystem::temp_directory_path() / "spreadsheet_batch_first.txt";
+    const std::filesystem::path second = std::filesystem::temp_directory_path() / "spreadsheet_batch_second.txt";
+    std::ofstream(first) << "set A1 1\nload " << second.string() << "\n";
+    std::ofstream(second) << "set B1 2\nload " << first.string() << "\nget A1\n";
+    Sheet cyclic;
+    std::ostringstream cyclic_output;
+    BatchProcessor cyclic_loader(cyclic, cyclic_output);
+    std::istringstream load_first("load " + first.string() + "\nget B1\n");
+    cyclic_loader.Run(load_first);
+    ASSERT_EQUAL(cyclic_output.str(),
+                 "error " + second.string() + ":2: Recursive load of " + first.string() + "\n"
+                 "A1\t1\n"
+                 "B1\t2\n");
+    ASSERT_EQUAL(cyclic_loader.GetStats().errors, 1u);
+    std::filesystem::remove(first);
+    std::filesystem::remove(second);
+}
+
+void TestNumericColumns() {
+    Sheet sheet;
+    for(int row = 0; row < 100; row++) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    sheet.SetCell("A101"_pos, "1e5");
+    sheet.SetCell("A102"_pos, "007");
+    // после нескольких записей блок переводится в колонки целиком
+    ASSERT(sheet.GetStoredNumber("A1"_pos) == 1.0);
+    ASSERT(sheet.GetStoredNumber("A100"_pos) == 100.0);
+    ASSERT(!sheet.GetStoredNumber("A101"_pos).has_value());
+    ASSERT(!sheet.GetStoredNumber("A102"_pos).has_value());
+
+    Sheet texts;
+    for(int row = 0; row < 100; row++) {
+        texts.SetCell({row, 0}, "x" + std::to_string(row + 1));
+    }
+    // без счётчиков непустых строк и столбцов, которые не зависят от
+    // способа хранения ячеек
+    constexpr size_t counter_size = sizeof(std::pair<const int, int>) + 4 * sizeof(void*);
+    const size_t empty_storage = Sheet().GetMemoryUsage().storage;
+    ASSERT((sheet.GetMemoryUsage().storage - empty_storage - 103 * counter_size) * 4
+           < texts.GetMemoryUsage().storage - empty_storage - 101 * counter_size);
+
+    // счётчики чисел в блоках без колонок удаляются вместе с числами
+    Sheet sparse;
+    auto fill_and_clear = [&sparse](int first_block) {
+        for(int block = first_block; block < first_block + 100; block++) {
+            for(int row = 0; row < 5; row++) {
+                sparse.SetCell({block * NumericColumns::SEGMENT_ROWS + row, 0}, "1");
+            }
+        }
+        for(int block = first_block; block < first_block + 100; block++) {
+            for(int row = 0; row < 5; row++) {
+                sparse.ClearCell({block * NumericColumns::SEGMENT_ROWS + row, 0});
+            }
+        }
+        return sparse.GetMemoryUsage().storage;
+    };
+    const size_t after_first = fill_and_clear(0);
+    ASSERT_EQUAL(fill_and_clear(100), after_first);
+
+    // области и ссылки формул
+    sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    sheet.SetCell("B2"_pos, "=A10*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5050.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT(!sheet.GetStoredNumber("A10"_pos).has_value());
+    sheet.SetCell("A5"_pos, "1000");
+    sheet.SetCell("A10"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5050.0 + 995 - 3));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    // чтение ячейки не меняет хранилище: число остаётся в колонках
+    ASSERT_EQUAL(sheet.GetCell("A20"_pos)->GetText(), "20");
+    ASSERT_EQUAL(sheet.GetCell("A20"_pos)->GetValue(), CellInterface::Value("20"));
+    ASSERT(sheet.GetCell("A20"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet.GetConcreteCell("A20"_pos) == nullptr);
+    ASSERT(sheet.GetStoredNumber("A20"_pos) == 20.0);
+    sheet.ClearCell("A30"_pos);
+    ASSERT(sheet.GetCell("A30"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{102, 2}));
+
+    std::map<Position, double> numbers;
+    sheet.ReadRange("A1"_pos, {3, 1}, [&](Position pos, Cell::ValueView value) {
+        numbers[pos] = std::get<double>(value);
+    });
+    ASSERT_EQUAL(numbers.size(), 3u);
+    ASSERT_EQUAL(numbers["A3"_pos], 3.0);
+
+    // та же таблица без колонок: пока на ячейку ссылается формула, число
+    // записывается в обычное хранилище, и после удаления ссылок блок не
+    // переводится в колонки. Содержимое и хеши блоков совпадают.
+    Sheet expected;
+    for(int row = 0; row < 102; row++) {
+        expected.SetCell({row, 2}, "=" + Position{row, 0}.ToString());
+    }
+    for(int row = 0; row < 102; row++) {
+        for(int col = 0; col < 2; col++) {
+            if(const CellInterface* cell = sheet.GetCell({row, col})) {
+                expected.SetCell({row, col}, cell->GetText());
+            }
+        }
+    }
+    for(int row = 0; row < 102; row++) {
+        expected.ClearCell({row, 2});
+    }
+    for(int row = 0; row < 100; row++) {
+        ASSERT(!expected.GetStoredNumber({row, 0}).has_value());
+    }
+    ASSERT(DiffSheets(sheet, expected).empty());
+    ASSERT(DiffSheets(expected, sheet).empty());
+    std::ostringstream values;
+    std::ostringstream expected_values;
+    sheet.PrintValues(values);
+    expected.PrintValues(expected_values);
+    ASSERT_EQUAL(values.str(), expected_values.str());
+    std::ostringstream texts_output;
+    std::ostringstream expected_texts;
+    sheet.PrintTexts(texts_output);
+    expected.PrintTexts(expected_texts);
+    ASSERT_EQUAL(texts_output.str(), expected_texts.str());
+
+    // сценарии читают числа из колонок одновременно из нескольких потоков
+    Sheet model;
+    for(int row = 0; row < 100; row++) {
+        model.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    model.SetCell("C1"_pos, "=B1+SUM(A1:A100)");
+    model.SetCell("C2"_pos, "=VLOOKUP(B1,A1:A100,1)*MAX(A1:A50)");
+    ASSERT(model.GetStoredNumber("A64"_pos).has_value());
+    std::vector<std::vector<double>> inputs;
+    for(int i = 0; i < 1000; i++) {
+        inputs.push_back({1.0 + i % 100});
+    }
+    ScenarioTable table = EvaluateScenarios(model, {"B1"_pos}, {"C1"_pos, "C2"_pos}, inputs);
+    for(size_t i = 0; i < inputs.size(); i++) {
+        ASSERT_EQUAL(table.Get(i, 0), CellInterface::Value(inputs[i][0] + 5050));
+        ASSERT_EQUAL(table.Get(i, 1), CellInterface::Value(inputs[i][0] * 50));
+    }
+    ASSERT(model.GetStoredNumber("A64"_pos).has_value());
+}
+
+void TestDeepChain() {
+    // цепочка длиннее столбца, каждая формула ссылается на предыдущую
+    constexpr int length = 100000;
+    auto position = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    sheet.SetCell(position(0), "1");
+    for(int i = 1; i < length; i++) {
+        sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+    }
+    const Position last = position(length - 1);
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(length)));
+    sheet.SetCell(position(0), "2");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(length + 1)));
+    
+    // замыкание цепочки обнаруживается, таблица не меняется
+    try {
+        sheet.SetCell(position(0), "=" + last.ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell(position(0))->GetText(), "2");
+    sheet.SetCell(position(length / 2), "=" + position(length / 2 - 1).ToString() + "+2");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(length + 2)));
+    
+    // цепочка формул с функциями вычисляется повторами без рекурсии
+    Sheet branches;
+    branches.SetCell(position(0), "1");
+    for(int i = 1; i < length; i++) {
+        branches.SetCell(position(i), "=IF(1, " + position(i - 1).ToString() + ", 0)+1");
+    }
+    ASSERT_EQUAL(branches.GetCell(last)->GetValue(), CellInterface::Value(double(length)));
+
+    // копия пересчитывает цепочки исходной таблицы тоже без рекурсии
+    // в sheet первое число - 2, а одна из формул прибавляет 2
+    for(auto [parent, expected]: {std::pair{&sheet, length + 10}, std::pair{&branches, length + 9}}) {
+        SheetFork fork = parent->Fork();
+        fork.SetCell(position(0), "10");
+        ASSERT_EQUAL(fork.GetRecalculatedCount(), static_cast<size_t>(length - 1));
+        ASSERT_EQUAL(fork.GetCell(last)->GetValue(), CellInterface::Value(double(expected)));
+    }
+}
+
+void TestLazyEvaluation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=IF(A1, 10, C1)");
+    sheet.SetCell("C1"_pos, "=C2+1");
+    sheet.SetCell("C2"_pos, "=C3*2");
+    sheet.SetCell("C3"_pos, "3");
+    sheet.SetCell("D1"_pos, "=AND(0, C2)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+    // невыбранная ветвь не вычисляется
+    ASSERT(!sheet.GetConcreteCell("C1"_pos)->HasCache());
+    ASSERT(!sheet.GetConcreteCell("C2"_pos)->HasCache());
+    
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT(sheet.GetConcreteCell("C2"_pos)->HasCache());
+    
+    // области, на которые больше никто не ссылается, не мешают изменениям
+    sheet.SetCell("E1"_pos, "=SUM(F1:F10)");
+    sheet.SetCell("E2"_pos, "=SUM(F5:F20)");
+    try {
+        sheet.SetCell("F15"_pos, "=E2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.ClearCell("E2"_pos);
+    sheet.SetCell("F15"_pos, "=E1");
+    try {
+        sheet.SetCell("F7"_pos, "=E1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.ClearCell("E1"_pos);
+    sheet.SetCell("F7"_pos, "=F15+1");
+    ASSERT(sheet.GetDependentCells("F7"_pos).empty());
+    ASSERT_EQUAL(sheet.GetCell("F7"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestPrintValuesParallel() {
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for(int row = 0; row < 3000; row++) {
+        for(int col = 0; col < 12; col++) {
+            std::string text;
+            switch((row + col) % 5) {
+            case 0: text = std::to_string(row * 0.37 + col); break;
+            case 1: text = "text " + std::to_string(row); break;
+            case 2: text = col > 0 ? "=" + Position{row, col - 1}.ToString() + "/3" : "-1.5"; break;
+            case 3: text = row % 7 == 0 || col == 0 ? "=1/0" : "=SUM(A1:A" + std::to_string(row + 1) + ")"; break;
+            default: break;
+            }
+            if(!text.empty()) {
+                cells.emplace_back(Position{row, col}, std::move(text));
+            }
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    // формат потока переносится в буферы частей
+    std::ostringstream parallel;
+    parallel << std::setprecision(4);
+    sheet.PrintValuesParallel(parallel);
+    std::ostringstream serial;
+    serial << std::setprecision(4);
+    sheet.PrintValues(serial);
+    ASSERT(serial.str().size() > 100000);
+    ASSERT(parallel.str() == serial.str());
+
+    Sheet small;
+    small.SetCell("B2"_pos, "=1+2");
+    std::ostringstream small_output;
+    small.PrintValuesParallel(small_output);
+    ASSERT_EQUAL(small_output.str(), "\t\n\t3\n");
+}
 }  // namespace
 
 int main() {
@@ -369,4 +2005,35 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestSheetStructuresMemoryUsage);
+    RUN_TEST(tr, TestReadRange);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestWorkloadRecording);
+    RUN_TEST(tr, TestInternedTexts);
+    RUN_TEST(tr, TestDependentCellsRecalculated);
+    RUN_TEST(tr, TestThreadPool);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestConditionalFormulas);
+    RUN_TEST(tr, TestConditionalDependencies);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestLookupIndexes);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestWriteAheadLog);
+    RUN_TEST(tr, TestMappedSheet);
+    RUN_TEST(tr, TestDeferredParsing);
+    RUN_TEST(tr, TestEvaluationProfiler);
+    RUN_TEST(tr, TestTraceEvents);
+    RUN_TEST(tr, TestSheetDiff);
+    RUN_TEST(tr, TestSheetFork);
+    RUN_TEST(tr, TestScenarioTable);
+    RUN_TEST(tr, TestGoalSeek);
+    RUN_TEST(tr, TestShardedSheet);
+    RUN_TEST(tr, TestShardedSheetLinks);
+    RUN_TEST(tr, TestBatchProcessor);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestLazyEvaluation);
+    RUN_TEST(tr, TestPrintValuesParallel);
 }
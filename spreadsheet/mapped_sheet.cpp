@@ -0,0 +1,321 @@
+#include "mapped_sheet.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr char MAPPED_MAGIC[8] = {'S', 'P', 'R', 'M', 'A', 'P', 'P', 'D'};
+constexpr uint32_t MAPPED_VERSION = 1;
+
+static_assert(std::is_trivially_copyable_v<MappedSheet::Entry> && sizeof(MappedSheet::Entry) == 48);
+static_assert(std::is_trivially_copyable_v<MappedSheet::Header> && sizeof(MappedSheet::Header) == 64);
+static_assert(std::is_trivially_copyable_v<Position> && sizeof(Position) == 8);
+
+bool EntryLess(const MappedSheet::Entry& entry, Position pos) {
+    return entry.row < pos.row || (entry.row == pos.row && entry.col < pos.col);
+}
+
+uint32_t CheckedSize(size_t size) {
+    if(size > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Sheet is too large for a mapped file");
+    }
+    return static_cast<uint32_t>(size);
+}
+
+template <typename T>
+void WriteArray(std::ostream& output, const std::vector<T>& items) {
+    output.write(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(T));
+}
+}  // namespace
+
+void WriteMappedSheet(const Sheet& sheet, const std::filesystem::path& path) {
+    const Size size = sheet.GetPrintableSize();
+    std::vector<Position> positions;
+    sheet.ForEachPosition({0, 0}, size, [&](Position pos) {
+        positions.push_back(pos);
+    });
+    std::sort(positions.begin(), positions.end());
+
+    std::vector<MappedSheet::Entry> entries;
+    entries.reserve(positions.size());
+    std::vector<Position> refs;
+    std::string strings;
+    for(Position pos: positions) {
+        // числа из колонок читаются без создания объектов ячеек
+        const std::optional<double> number = sheet.GetStoredNumber(pos);
+        const CellInterface* cell = number.has_value() ? nullptr : sheet.GetCell(pos);
+        MappedSheet::Entry entry{};
+        entry.row = pos.row;
+        entry.col = pos.col;
+
+        const std::string text = number.has_value() ? NumericColumns::FormatLiteral(*number) : cell->GetText();
+        entry.text_offset = CheckedSize(strings.size());
+        entry.text_size = CheckedSize(text.size());
+        strings += text;
+
+        const CellInterface::Value value = number.has_value() ? CellInterface::Value(text) : cell->GetValue();
+        if(std::holds_alternative<double>(value)) {
+            entry.type = MappedSheet::Entry::Type::Number;
+            entry.number = std::get<double>(value);
+        } else if(std::holds_alternative<FormulaError>(value)) {
+            entry.type = MappedSheet::Entry::Type::Error;
+            entry.error = static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory());
+        } else {
+            // значение текста - его конец без экранирующего символа
+            const std::string& text_value = std::get<std::string>(value);
+            entry.type = MappedSheet::Entry::Type::Text;
+            entry.value_size = CheckedSize(text_value.size());
+            if(text.size() >= text_value.size()
+              && text.compare(text.size() - text_value.size(), text_value.size(), text_value) == 0) {
+                entry.value_offset = CheckedSize(entry.text_offset + text.size() - text_value.size());
+            } else {
+                entry.value_offset = CheckedSize(strings.size());
+                strings += text_value;
+            }
+        }
+
+        const std::vector<Position> cell_refs = number.has_value() ? std::vector<Position>()
+                                                                   : cell->GetReferencedCells();
+        entry.refs_offset = CheckedSize(refs.size());
+        entry.refs_count = CheckedSize(cell_refs.size());
+        refs.insert(refs.end(), cell_refs.begin(), cell_refs.end());
+        entries.push_back(entry);
+    }
+
+    MappedSheet::Header header{};
+    std::memcpy(header.magic, MAPPED_MAGIC, sizeof(header.magic));
+    header.version = MAPPED_VERSION;
+    header.cell_count = CheckedSize(entries.size());
+    header.rows = size.rows;
+    header.cols = size.cols;
+    header.entries_offset = sizeof(header);
+    header.refs_offset = header.entries_offset + entries.size() * sizeof(MappedSheet::Entry);
+    header.refs_count = refs.size();
+    header.strings_offset = header.refs_offset + refs.size() * sizeof(Position);
+    header.strings_size = strings.size();
+
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WriteArray(output, entries);
+    WriteArray(output, refs);
+    output.write(strings.data(), strings.size());
+    if(!output) {
+        throw std::runtime_error("Cannot write " + path.string());
+    }
+}
+
+MappedSheet::MappedSheet(const std::filesystem::path& path) {
+#ifdef _WIN32
+    // без отображения файл читается в память целиком
+    std::ifstream input(path, std::ios::binary);
+    if(!input) {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    void* data = size_ > 0 ? mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    // отображение сохраняется после закрытия файла
+    close(fd);
+    if(data == MAP_FAILED) {
+        throw std::runtime_error("Cannot map " + path.string());
+    }
+    // ячейки ищутся двоичным поиском, упреждающее чтение ему не помогает
+    madvise(data, size_, MADV_RANDOM);
+    data_ = static_cast<const char*>(data);
+#endif
+
+    header_ = reinterpret_cast<const Header*>(data_);
+    const bool valid = size_ >= sizeof(Header)
+        && std::memcmp(header_->magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) == 0
+        && header_->version == MAPPED_VERSION
+        && header_->entries_offset == sizeof(Header)
+        && header_->refs_offset == header_->entries_offset + uint64_t{header_->cell_count} * sizeof(Entry)
+        && header_->refs_count <= size_ / sizeof(Position)
+        && header_->strings_offset == header_->refs_offset + header_->refs_count * sizeof(Position)
+        && header_->strings_offset + header_->strings_size == size_;
+    if(!valid) {
+#ifndef _WIN32
+        munmap(const_cast<char*>(data_), size_);
+#endif
+        throw std::runtime_error("Not a mapped sheet: " + path.string());
+    }
+    entries_ = reinterpret_cast<const Entry*>(data_ + header_->entries_offset);
+    refs_ = reinterpret_cast<const Position*>(data_ + header_->refs_offset);
+    strings_ = data_ + header_->strings_offset;
+    const size_t blocks = (header_->cell_count + CELL_BLOCK_SIZE - 1) / CELL_BLOCK_SIZE;
+    cell_blocks_ = std::make_unique<std::atomic<const CellBlock*>[]>(blocks);
+}
+
+MappedSheet::~MappedSheet() {
+    const size_t blocks = (header_->cell_count + CELL_BLOCK_SIZE - 1) / CELL_BLOCK_SIZE;
+    for(size_t i = 0; i < blocks; i++) {
+        delete cell_blocks_[i].load(std::memory_order_relaxed);
+    }
+#ifndef _WIN32
+    if(data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+    }
+#endif
+}
+
+void MappedSheet::SetCell(Position /* pos */, std::string /* text */) {
+    throw std::logic_error("Mapped sheet is read-only");
+}
+
+const CellInterface* MappedSheet::GetCell(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    const Entry* entry = FindEntry(pos);
+    if(entry == nullptr) {
+        return nullptr;
+    }
+    return &GetMappedCell(*entry);
+}
+
+CellInterface* MappedSheet::GetCell(Position pos) {
+    return const_cast<CellInterface*>(static_cast<const MappedSheet&>(*this).GetCell(pos));
+}
+
+void MappedSheet::ClearCell(Position /* pos */) {
+    throw std::logic_error("Mapped sheet is read-only");
+}
+
+Size MappedSheet::GetPrintableSize() const {
+    return {header_->rows, header_->cols};
+}
+
+template <typename Print>
+void MappedSheet::PrintCells(std::ostream& output, Print print) const {
+    // записи отсортированы так же, как печатаются ячейки
+    const Entry* entry = entries_;
+    const Entry* end = entries_ + header_->cell_count;
+    for(int row_n = 0; row_n < header_->rows; row_n++) {
+        for(int col_n = 0; col_n < header_->cols; col_n++) {
+            if(entry != end && entry->row == row_n && entry->col == col_n) {
+                print(*entry);
+                ++entry;
+            }
+            if(col_n == header_->cols - 1) {
+                output << '\n';
+            } else {
+                output << '\t';
+            }
+        }
+    }
+}
+
+void MappedSheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&](const Entry& entry) {
+        switch(entry.type) {
+            case Entry::Type::Text:
+                output << GetString(entry.value_offset, entry.value_size);
+                break;
+            case Entry::Type::Number:
+                output << entry.number;
+                break;
+            case Entry::Type::Error:
+                output << FormulaError(static_cast<FormulaError::Category>(entry.error));
+                break;
+        }
+    });
+}
+
+void MappedSheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&](const Entry& entry) {
+        output << GetString(entry.text_offset, entry.text_size);
+    });
+}
+
+const MappedSheet::Entry* MappedSheet::FindEntry(Position pos) const {
+    const Entry* end = entries_ + header_->cell_count;
+    const Entry* entry = std::lower_bound(entries_, end, pos, EntryLess);
+    if(entry == end || entry->row != pos.row || entry->col != pos.col) {
+        return nullptr;
+    }
+    return entry;
+}
+
+const MappedSheet::MappedCell& MappedSheet::GetMappedCell(const Entry& entry) const {
+    const size_t index = &entry - entries_;
+    std::atomic<const CellBlock*>& slot = cell_blocks_[index / CELL_BLOCK_SIZE];
+    const CellBlock* block = slot.load(std::memory_order_acquire);
+    if(block == nullptr) {
+        // блок могут создать несколько потоков, сохраняется первый
+        const size_t begin = index - index % CELL_BLOCK_SIZE;
+        const size_t end = std::min<size_t>(begin + CELL_BLOCK_SIZE, header_->cell_count);
+        auto created = std::make_unique<CellBlock>();
+        created->reserve(end - begin);
+        for(size_t i = begin; i < end; i++) {
+            created->emplace_back(*this, entries_[i]);
+        }
+        if(slot.compare_exchange_strong(block, created.get(), std::memory_order_acq_rel)) {
+            block = created.release();
+        }
+    }
+    return (*block)[index % CELL_BLOCK_SIZE];
+}
+
+std::string_view MappedSheet::GetString(uint32_t offset, uint32_t size) const {
+    if(uint64_t{offset} + size > header_->strings_size) {
+        throw std::runtime_error("Corrupted mapped sheet");
+    }
+    return {strings_ + offset, size};
+}
+
+MappedSheet::MappedCell::MappedCell(const MappedSheet& sheet, const Entry& entry)
+    : sheet_(sheet)
+    , entry_(entry) {
+}
+
+CellInterface::Value MappedSheet::MappedCell::GetValue() const {
+    switch(entry_.type) {
+        case Entry::Type::Number:
+            return entry_.number;
+        case Entry::Type::Error:
+            return FormulaError(static_cast<FormulaError::Category>(entry_.error));
+        default:
+            return std::string(sheet_.GetString(entry_.value_offset, entry_.value_size));
+    }
+}
+
+std::string MappedSheet::MappedCell::GetText() const {
+    return std::string(sheet_.GetString(entry_.text_offset, entry_.text_size));
+}
+
+std::vector<Position> MappedSheet::MappedCell::GetReferencedCells() const {
+    if(uint64_t{entry_.refs_offset} + entry_.refs_count > sheet_.header_->refs_count) {
+        throw std::runtime_error("Corrupted mapped sheet");
+    }
+    const Position* refs = sheet_.refs_ + entry_.refs_offset;
+    return {refs, refs + entry_.refs_count};
+}
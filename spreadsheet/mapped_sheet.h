@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Sheet;
+
+// Сохраняет тексты и значения всех ячеек таблицы в файл для MappedSheet.
+// Формулы вычисляются при записи.
+void WriteMappedSheet(const Sheet& sheet, const std::filesystem::path& path);
+
+// Таблица только для чтения, которая отвечает на запросы прямо из
+// отображённого в память файла WriteMappedSheet. Файл не разбирается при
+// открытии: страницы читаются с диска при первом обращении, а процессы,
+// открывшие один файл, делят его страницы в кеше ОС. Ячейка находится
+// двоичным поиском среди отсортированных записей, значения формул хранятся
+// готовыми. Файл читается в формате той платформы, на которой записан.
+// Чтение безопасно из нескольких потоков. Изменение ячеек бросает
+// std::logic_error.
+class MappedSheet : public SheetInterface {
+public:
+    // Бросает std::runtime_error, если файл нельзя открыть или это не файл
+    // таблицы
+    explicit MappedSheet(const std::filesystem::path& path);
+    ~MappedSheet();
+
+    MappedSheet(const MappedSheet&) = delete;
+    MappedSheet& operator=(const MappedSheet&) = delete;
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Запись ячейки в файле
+    struct Entry {
+        enum class Type : uint8_t { Text, Number, Error };
+
+        int32_t row;
+        int32_t col;
+        // текст ячейки и значение-текст в общей области строк
+        uint32_t text_offset;
+        uint32_t text_size;
+        uint32_t value_offset;
+        uint32_t value_size;
+        // ячейки, на которые ссылается формула, в общей области позиций
+        uint32_t refs_offset;
+        uint32_t refs_count;
+        double number;
+        Type type;
+        // FormulaError::Category для ошибки
+        uint8_t error;
+        uint8_t padding[6];
+    };
+
+    // Заголовок файла
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t cell_count;
+        int32_t rows;
+        int32_t cols;
+        uint64_t entries_offset;
+        uint64_t refs_offset;
+        uint64_t refs_count;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+    };
+
+private:
+    // Ячейка-представление записи файла без собственных данных
+    class MappedCell : public CellInterface {
+    public:
+        MappedCell(const MappedSheet& sheet, const Entry& entry);
+
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+        const MappedSheet& sheet_;
+        const Entry& entry_;
+    };
+
+    // представления ячеек создаются блоками по CELL_BLOCK_SIZE записей
+    static constexpr size_t CELL_BLOCK_SIZE = 1024;
+    using CellBlock = std::vector<MappedCell>;
+
+    const Entry* FindEntry(Position pos) const;
+    const MappedCell& GetMappedCell(const Entry& entry) const;
+    std::string_view GetString(uint32_t offset, uint32_t size) const;
+    template <typename Print>
+    void PrintCells(std::ostream& output, Print print) const;
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    // содержимое файла, если отображение в память недоступно
+    std::string buffer_;
+    const Header* header_ = nullptr;
+    const Entry* entries_ = nullptr;
+    const Position* refs_ = nullptr;
+    const char* strings_ = nullptr;
+    // блоки представлений ячеек, которые уже запрашивались; блок создаётся
+    // один раз и не меняется, поэтому читается без блокировок, а указатели
+    // на ячейки действуют, пока открыта таблица
+    mutable std::unique_ptr<std::atomic<const CellBlock*>[]> cell_blocks_;
+};
@@ -0,0 +1,193 @@
+#include "numeric_columns.h"
+
+#include <bitset>
+#include <charconv>
+#include <cmath>
+#include <memory>
+
+std::optional<double> NumericColumns::ParseLiteral(std::string_view text) {
+    // кратчайшая запись double не длиннее 24 символов
+    if(text.empty() || text.size() > 24) {
+        return std::nullopt;
+    }
+    const char first = text[0];
+    if(!(first == '-' || first == '.' || (first >= '0' && first <= '9'))) {
+        return std::nullopt;
+    }
+    double value = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if(error != std::errc() || end != text.data() + text.size() || !std::isfinite(value)) {
+        return std::nullopt;
+    }
+    char buffer[32];
+    auto [formatted_end, format_error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    if(format_error != std::errc() || std::string_view(buffer, formatted_end - buffer) != text) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::string NumericColumns::FormatLiteral(double value) {
+    char buffer[32];
+    auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string(buffer, end);
+}
+
+CellInterface::Value NumericColumns::NumberCell::GetValue() const {
+    return FormatLiteral(GetNumber());
+}
+
+std::string NumericColumns::NumberCell::GetText() const {
+    return FormatLiteral(GetNumber());
+}
+
+std::vector<Position> NumericColumns::NumberCell::GetReferencedCells() const {
+    return {};
+}
+
+double NumericColumns::NumberCell::GetNumber() const {
+    return segment_->values[segment_->GetIndex(row_)];
+}
+
+NumericColumns::Segment::~Segment() {
+    delete[] cells.load(std::memory_order_relaxed);
+}
+
+int NumericColumns::Segment::GetIndex(int row) const {
+    // занятые строки выше row
+    return static_cast<int>(std::bitset<SEGMENT_ROWS>(present & ((uint64_t{1} << row) - 1)).count());
+}
+
+uint32_t NumericColumns::GetKey(Position pos) {
+    return static_cast<uint32_t>(pos.col) * SEGMENTS_PER_COLUMN + pos.row / SEGMENT_ROWS;
+}
+
+std::optional<double> NumericColumns::Find(Position pos) const {
+    if(segments_.empty()) {
+        return std::nullopt;
+    }
+    auto it = segments_.find(GetKey(pos));
+    if(it == segments_.end()) {
+        return std::nullopt;
+    }
+    const int row = pos.row % SEGMENT_ROWS;
+    if(!(it->second.present >> row & 1)) {
+        return std::nullopt;
+    }
+    return it->second.values[it->second.GetIndex(row)];
+}
+
+const NumericColumns::NumberCell* NumericColumns::FindCell(Position pos) const {
+    if(segments_.empty()) {
+        return nullptr;
+    }
+    auto it = segments_.find(GetKey(pos));
+    if(it == segments_.end() || !(it->second.present >> pos.row % SEGMENT_ROWS & 1)) {
+        return nullptr;
+    }
+    const Segment& segment = it->second;
+    const NumberCell* cells = segment.cells.load(std::memory_order_acquire);
+    if(cells == nullptr) {
+        // ячейки блока могут создать несколько потоков, сохраняются первые
+        auto created = std::make_unique<NumberCell[]>(SEGMENT_ROWS);
+        for(int row = 0; row < SEGMENT_ROWS; row++) {
+            created[row].segment_ = &segment;
+            created[row].row_ = row;
+        }
+        if(segment.cells.compare_exchange_strong(cells, created.get(), std::memory_order_acq_rel)) {
+            cells = created.release();
+        }
+    }
+    return &cells[pos.row % SEGMENT_ROWS];
+}
+
+bool NumericColumns::HasSegment(Position pos) const {
+    return segments_.count(GetKey(pos)) != 0;
+}
+
+bool NumericColumns::CountLiteralCell(Position pos) {
+    auto it = literal_cells_.try_emplace(GetKey(pos), 0).first;
+    if(++it->second < PROMOTE_WRITES) {
+        return false;
+    }
+    literal_cells_.erase(it);
+    return true;
+}
+
+void NumericColumns::UncountLiteralCell(Position pos) {
+    auto it = literal_cells_.find(GetKey(pos));
+    if(it != literal_cells_.end() && --it->second == 0) {
+        literal_cells_.erase(it);
+    }
+}
+
+void NumericColumns::Set(Position pos, double value) {
+    const uint32_t key = GetKey(pos);
+    auto [it, inserted] = segments_.try_emplace(key);
+    if(inserted) {
+        literal_cells_.erase(key);
+    }
+    Segment& segment = it->second;
+    const int row = pos.row % SEGMENT_ROWS;
+    const uint64_t bit = uint64_t{1} << row;
+    const int index = segment.GetIndex(row);
+    if(!(segment.present & bit)) {
+        segment.present |= bit;
+        segment.values.insert(segment.values.begin() + index, value);
+        count_++;
+    } else {
+        segment.values[index] = value;
+    }
+}
+
+std::optional<double> NumericColumns::Erase(Position pos) {
+    if(segments_.empty()) {
+        return std::nullopt;
+    }
+    auto it = segments_.find(GetKey(pos));
+    if(it == segments_.end()) {
+        return std::nullopt;
+    }
+    Segment& segment = it->second;
+    const int row = pos.row % SEGMENT_ROWS;
+    const uint64_t bit = uint64_t{1} << row;
+    if(!(segment.present & bit)) {
+        return std::nullopt;
+    }
+    const int index = segment.GetIndex(row);
+    const double value = segment.values[index];
+    segment.values.erase(segment.values.begin() + index);
+    // поредевший блок не держит память удалённых чисел
+    if(segment.values.size() * 4 <= segment.values.capacity()) {
+        segment.values.shrink_to_fit();
+    }
+    segment.present &= ~bit;
+    count_--;
+    if(segment.present == 0) {
+        segments_.erase(it);
+    }
+    return value;
+}
+
+size_t NumericColumns::GetCount() const {
+    return count_;
+}
+
+size_t NumericColumns::GetMemoryUsage() const {
+    // узел unordered_map: пара ключ-значение, указатель на следующий узел
+    // и закешированный хеш
+    static constexpr size_t node_size = sizeof(std::pair<const uint32_t, Segment>)
+                                        + sizeof(void*) + sizeof(size_t);
+    static constexpr size_t count_node_size = sizeof(std::pair<const uint32_t, int>)
+                                              + sizeof(void*) + sizeof(size_t);
+    size_t usage = sizeof(*this)
+                   + segments_.size() * node_size + segments_.bucket_count() * sizeof(void*)
+                   + literal_cells_.size() * count_node_size + literal_cells_.bucket_count() * sizeof(void*);
+    for(const auto& [key, segment]: segments_) {
+        usage += segment.values.capacity() * sizeof(double);
+        if(segment.cells.load(std::memory_order_relaxed) != nullptr) {
+            usage += SEGMENT_ROWS * sizeof(NumberCell);
+        }
+    }
+    return usage;
+}
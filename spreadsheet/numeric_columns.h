@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Числа-литералы таблицы по столбцам. Столбец делится на блоки по
+// SEGMENT_ROWS строк; блок хранит битовую карту занятых строк и числа только
+// занятых строк подряд, поэтому число занимает 8 байт и в плотном, и в
+// разреженном блоке, а чтение области идёт по непрерывной памяти. Блок
+// заводится, когда в его строках таблица хранит PROMOTE_WRITES ячеек-чисел,
+// и освобождается, когда в нём не остаётся чисел. Хранятся только числа,
+// текст которых однозначно восстанавливается по значению (см.
+// ParseLiteral); остальные ячейки хранит таблица.
+class NumericColumns {
+public:
+    static constexpr int SEGMENT_ROWS = 64;
+    static constexpr int PROMOTE_WRITES = 16;
+
+private:
+    struct Segment;
+
+public:
+    // Ячейка-число из колонок. Только читается: текст и значение (текст, как
+    // у обычной текстовой ячейки) восстанавливаются по числу из блока.
+    // Создаются для всего блока при первом запросе ячейки.
+    class NumberCell : public CellInterface {
+    public:
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        double GetNumber() const;
+
+    private:
+        friend class NumericColumns;
+        const Segment* segment_ = nullptr;
+        int row_ = 0;
+    };
+
+    // Число, если text - его кратчайшая десятичная запись, как её выводит
+    // FormatLiteral
+    static std::optional<double> ParseLiteral(std::string_view text);
+    static std::string FormatLiteral(double value);
+
+    std::optional<double> Find(Position pos) const;
+    // Ячейка-число pos или nullptr; действительна, пока блок не освобождён.
+    // Можно вызывать из нескольких потоков.
+    const NumberCell* FindCell(Position pos) const;
+    // У блока ячейки pos есть хранилище
+    bool HasSegment(Position pos) const;
+    // Учитывает ячейку-число, которую таблица хранит в блоке без хранилища;
+    // true, когда блок пора перевести в колонки
+    bool CountLiteralCell(Position pos);
+    // Ячейка-число, учтённая CountLiteralCell, удалена или заменена
+    void UncountLiteralCell(Position pos);
+
+    void Set(Position pos, double value);
+    // Удаляет число и возвращает его или nullopt, если числа не было
+    std::optional<double> Erase(Position pos);
+
+    // Передаёт visitor(Position, double) все числа прямоугольной области.
+    // Порядок обхода не определён.
+    template <typename Visitor>
+    void ForEach(Position top_left, Size size, Visitor&& visitor) const;
+
+    size_t GetCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Segment {
+        Segment() = default;
+        Segment(const Segment&) = delete;
+        Segment& operator=(const Segment&) = delete;
+        ~Segment();
+
+        // Номер числа строки row в values
+        int GetIndex(int row) const;
+
+        // строка row блока занята, если установлен бит row
+        uint64_t present = 0;
+        // числа занятых строк по возрастанию строк
+        std::vector<double> values;
+        // ячейки строк блока; создаются один раз и не меняются
+        mutable std::atomic<const NumberCell*> cells{nullptr};
+    };
+
+    static constexpr int SEGMENTS_PER_COLUMN = Position::MAX_ROWS / SEGMENT_ROWS;
+
+    static uint32_t GetKey(Position pos);
+    template <typename Visitor>
+    static void VisitSegment(const Segment& segment, int col, int first_row, int last_row,
+                             int segment_index, Visitor& visitor);
+
+    std::unordered_map<uint32_t, Segment> segments_;
+    // ячейки-числа таблицы в блоках без хранилища; блоков без таких ячеек
+    // здесь нет
+    std::unordered_map<uint32_t, int> literal_cells_;
+    size_t count_ = 0;
+};
+
+template <typename Visitor>
+void NumericColumns::VisitSegment(const Segment& segment, int col, int first_row, int last_row,
+                                  int segment_index, Visitor& visitor) {
+    const int base = segment_index * SEGMENT_ROWS;
+    const int first = std::max(first_row, base) - base;
+    const int last = std::min(last_row, base + SEGMENT_ROWS - 1) - base;
+    int index = segment.GetIndex(first);
+    for(int row = first; row <= last; row++) {
+        if(segment.present >> row & 1) {
+            visitor(Position{base + row, col}, segment.values[index++]);
+        }
+    }
+}
+
+template <typename Visitor>
+void NumericColumns::ForEach(Position top_left, Size size, Visitor&& visitor) const {
+    if(segments_.empty() || size.rows <= 0 || size.cols <= 0 || !top_left.IsValid()) {
+        return;
+    }
+    const int last_row = std::min(top_left.row + size.rows, int{Position::MAX_ROWS}) - 1;
+    const int end_col = std::min(top_left.col + size.cols, int{Position::MAX_COLS});
+    const int first_segment = top_left.row / SEGMENT_ROWS;
+    const int last_segment = last_row / SEGMENT_ROWS;
+    // как и для ячеек таблицы: небольшую область дешевле просмотреть по
+    // блокам, большую - одним проходом по всем блокам
+    const size_t area = static_cast<size_t>(last_segment - first_segment + 1) * (end_col - top_left.col);
+    if(area < segments_.size()) {
+        for(int col = top_left.col; col < end_col; col++) {
+            for(int index = first_segment; index <= last_segment; index++) {
+                auto it = segments_.find(static_cast<uint32_t>(col) * SEGMENTS_PER_COLUMN + index);
+                if(it != segments_.end()) {
+                    VisitSegment(it->second, col, top_left.row, last_row, index, visitor);
+                }
+            }
+        }
+        return;
+    }
+    for(const auto& [key, segment]: segments_) {
+        const int col = static_cast<int>(key / SEGMENTS_PER_COLUMN);
+        const int index = static_cast<int>(key % SEGMENTS_PER_COLUMN);
+        if(col >= top_left.col && col < end_col
+          && index >= first_segment && index <= last_segment) {
+            VisitSegment(segment, col, top_left.row, last_row, index, visitor);
+        }
+    }
+}
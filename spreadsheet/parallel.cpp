@@ -0,0 +1,111 @@
+#include "parallel.h"
+
+#include <system_error>
+
+ThreadPool& ThreadPool::GetInstance() {
+    static ThreadPool pool([] {
+        const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+        return max_threads - 1;
+    }());
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads_.reserve(threads);
+    try {
+        for(size_t i = 0; i < threads; i++) {
+            threads_.emplace_back([this] {
+                WorkerLoop();
+            });
+        }
+    } catch (const std::system_error&) {
+        // задачи выполнят уже запущенные потоки и вызывающий поток
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for(auto& thread: threads_) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::GetConcurrency() const {
+    return threads_.size() + 1;
+}
+
+void ThreadPool::Run(size_t tasks, const std::function<void(size_t)>& run) {
+    if(tasks == 0) {
+        return;
+    }
+    auto job = std::make_shared<Job>();
+    job->run = &run;
+    job->tasks = tasks;
+    const bool shared = tasks > 1 && !threads_.empty();
+    if(shared) {
+        std::lock_guard lock(mutex_);
+        jobs_.push_back(job);
+    }
+    if(shared) {
+        wake_.notify_all();
+    }
+    Work(*job);
+    if(shared) {
+        // все задачи выданы; задание могло остаться в очереди, если потоки
+        // пула были заняты
+        std::lock_guard lock(mutex_);
+        auto it = std::find(jobs_.begin(), jobs_.end(), job);
+        if(it != jobs_.end()) {
+            jobs_.erase(it);
+        }
+    }
+    std::unique_lock lock(job->mutex);
+    job->done.wait(lock, [&] {
+        return job->completed == job->tasks;
+    });
+    if(job->error) {
+        std::rethrow_exception(job->error);
+    }
+}
+
+void ThreadPool::Work(Job& job) {
+    for(size_t i = job.next++; i < job.tasks; i = job.next++) {
+        std::exception_ptr error;
+        try {
+            (*job.run)(i);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard lock(job.mutex);
+        if(error && !job.error) {
+            job.error = error;
+        }
+        if(++job.completed == job.tasks) {
+            job.done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::WorkerLoop() {
+    std::unique_lock lock(mutex_);
+    while(true) {
+        wake_.wait(lock, [this] {
+            return stop_ || !jobs_.empty();
+        });
+        if(jobs_.empty()) {
+            return;
+        }
+        // задание удерживается, пока поток выполняет его задачи
+        std::shared_ptr<Job> job = jobs_.front();
+        lock.unlock();
+        Work(*job);
+        lock.lock();
+        if(!jobs_.empty() && jobs_.front() == job) {
+            jobs_.pop_front();
+        }
+    }
+}
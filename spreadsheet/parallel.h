@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Постоянные потоки для параллельных частей вычислений. Потоки создаются
+// один раз и живут вместе с пулом, поэтому вызовы не платят за их запуск, а
+// состояние потоков (thread_local разборщики формул) переиспользуется.
+class ThreadPool {
+public:
+    // Общий пул процесса: потоков на один меньше, чем аппаратных, потому
+    // что вызывающий поток тоже выполняет задачи
+    static ThreadPool& GetInstance();
+
+    // Если поток не удаётся запустить, пул работает с уже запущенными
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Количество потоков, которые выполняют задачи, вместе с вызывающим
+    size_t GetConcurrency() const;
+
+    // Вызывает run(i) для каждого i из [0, tasks) в потоках пула и в текущем
+    // потоке и дожидается всех вызовов. Первое исключение, выброшенное run,
+    // повторно бросается после завершения всех задач. Можно вызывать из
+    // задачи пула: задачи, которые не взяли занятые потоки, выполняет
+    // вызывающий поток.
+    void Run(size_t tasks, const std::function<void(size_t)>& run);
+
+private:
+    struct Job {
+        const std::function<void(size_t)>* run;
+        size_t tasks;
+        // следующая невыданная задача
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t completed = 0;
+        std::exception_ptr error;
+    };
+
+    // Выполняет задачи job, пока они не кончатся
+    static void Work(Job& job);
+    void WorkerLoop();
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    // задания, в которых остались невыданные задачи
+    std::deque<std::shared_ptr<Job>> jobs_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Делит диапазон [0, count) на непрерывные части и вызывает
+// func(begin, end) для каждой части в потоках общего пула. Частей не
+// больше, чем потоков пула вместе с вызывающим, и в каждой не меньше
+// min_chunk элементов; если такая часть одна, func вызывается в текущем
+// потоке. Первое исключение, выброшенное func, повторно бросается после
+// завершения всех частей.
+template <typename Func>
+void ParallelFor(size_t count, size_t min_chunk, Func func) {
+    ThreadPool& pool = ThreadPool::GetInstance();
+    const size_t chunks = std::min(pool.GetConcurrency(), std::max<size_t>(1, count / std::max<size_t>(1, min_chunk)));
+    if(chunks <= 1) {
+        func(size_t{0}, count);
+        return;
+    }
+    const size_t chunk = (count + chunks - 1) / chunks;
+    pool.Run(chunks, [&](size_t i) {
+        const size_t begin = std::min(count, i * chunk);
+        const size_t end = std::min(count, begin + chunk);
+        func(begin, end);
+    });
+}
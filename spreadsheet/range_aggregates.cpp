@@ -0,0 +1,178 @@
+#include "range_aggregates.h"
+
+#include "lookup_index.h"
+#include "sheet.h"
+
+#include <algorithm>
+
+namespace {
+// в невысоких областях дешевле прочитать ячейки, чем строить деревья
+constexpr int MIN_TREE_ROWS = 64;
+}  // namespace
+
+void RangeAggregate::Add(double value) {
+    sum += value;
+    count++;
+    min = std::min(min, value);
+    max = std::max(max, value);
+}
+
+void RangeAggregate::Merge(const RangeAggregate& other) {
+    sum += other.sum;
+    count += other.count;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+void AggregateTree::Set(int row, std::optional<double> value) {
+    if(row >= capacity_) {
+        if(!value.has_value()) {
+            return;
+        }
+        Grow(row + 1);
+    }
+    size_t node = capacity_ + row;
+    nodes_[node] = {};
+    if(value.has_value()) {
+        nodes_[node].Add(*value);
+    }
+    for(node /= 2; node >= 1; node /= 2) {
+        nodes_[node] = nodes_[2 * node];
+        nodes_[node].Merge(nodes_[2 * node + 1]);
+    }
+}
+
+RangeAggregate AggregateTree::Query(int first_row, int last_row) const {
+    RangeAggregate result;
+    last_row = std::min(last_row, capacity_ - 1);
+    if(first_row > last_row) {
+        return result;
+    }
+    // полуинтервал [left, right) листьев, обход снизу вверх
+    for(size_t left = capacity_ + first_row, right = capacity_ + last_row + 1; left < right;
+        left /= 2, right /= 2) {
+        if(left & 1) {
+            result.Merge(nodes_[left++]);
+        }
+        if(right & 1) {
+            result.Merge(nodes_[--right]);
+        }
+    }
+    return result;
+}
+
+size_t AggregateTree::GetMemoryUsage() const {
+    return sizeof(*this) + nodes_.capacity() * sizeof(RangeAggregate);
+}
+
+void AggregateTree::Grow(int rows) {
+    int capacity = std::max(capacity_, 1);
+    while(capacity < rows) {
+        capacity *= 2;
+    }
+    std::vector<RangeAggregate> nodes(2 * capacity);
+    for(int row = 0; row < capacity_; row++) {
+        nodes[capacity + row] = nodes_[capacity_ + row];
+    }
+    for(int node = capacity - 1; node >= 1; node--) {
+        nodes[node] = nodes[2 * node];
+        nodes[node].Merge(nodes[2 * node + 1]);
+    }
+    nodes_ = std::move(nodes);
+    capacity_ = capacity;
+}
+
+SheetAggregates::SheetAggregates(const Sheet& sheet)
+    : sheet_(sheet) {
+}
+
+RangeAggregate SheetAggregates::Aggregate(Range range) const {
+    RangeAggregate result;
+    if(range.GetSize().rows < MIN_TREE_ROWS) {
+        for(int row = range.top_left.row; row <= range.bottom_right.row; row++) {
+            for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+                if(std::optional<double> number = sheet_.GetStoredNumber({row, col})) {
+                    result.Add(*number);
+                    continue;
+                }
+                const Cell* cell = sheet_.GetConcreteCell({row, col});
+                if(cell == nullptr) {
+                    continue;
+                }
+                if(cell->IsFormula()) {
+                    AddFormulaValue(result, *cell);
+                } else if(auto value = ToLookupKey(cell->GetValueView())) {
+                    result.Add(*value);
+                }
+            }
+        }
+        return result;
+    }
+
+    for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+        result.Merge(GetTree(col).Query(range.top_left.row, range.bottom_right.row));
+        const std::set<int>* formula_rows = sheet_.GetFormulaRows(col);
+        if(formula_rows == nullptr) {
+            continue;
+        }
+        for(auto row = formula_rows->lower_bound(range.top_left.row);
+            row != formula_rows->end() && *row <= range.bottom_right.row; ++row) {
+            AddFormulaValue(result, *sheet_.GetConcreteCell({*row, col}));
+        }
+    }
+    return result;
+}
+
+void SheetAggregates::Update(Position pos) {
+    auto it = columns_.find(pos.col);
+    if(it != columns_.end()) {
+        it->second.Set(pos.row, GetLiteralValue(pos));
+    }
+}
+
+size_t SheetAggregates::GetMemoryUsage() const {
+    // узел unordered_map: пара ключ-значение, указатель на следующий узел
+    // и закешированный хеш
+    static constexpr size_t node_size = sizeof(std::pair<const int, AggregateTree>)
+                                        + sizeof(void*) + sizeof(size_t);
+    size_t size = sizeof(*this) + columns_.size() * node_size + columns_.bucket_count() * sizeof(void*);
+    for(const auto& [col, tree]: columns_) {
+        size += tree.GetMemoryUsage() - sizeof(tree);
+    }
+    return size;
+}
+
+const AggregateTree& SheetAggregates::GetTree(int col) const {
+    auto it = columns_.find(col);
+    if(it != columns_.end()) {
+        return it->second;
+    }
+    AggregateTree& tree = columns_[col];
+    // непустые ячейки лежат внутри печатаемой области
+    const int rows = sheet_.GetPrintableSize().rows;
+    for(int row = 0; row < rows; row++) {
+        tree.Set(row, GetLiteralValue({row, col}));
+    }
+    return tree;
+}
+
+std::optional<double> SheetAggregates::GetLiteralValue(Position pos) const {
+    if(std::optional<double> number = sheet_.GetStoredNumber(pos)) {
+        return number;
+    }
+    const Cell* cell = sheet_.GetConcreteCell(pos);
+    if(cell == nullptr || cell->IsFormula()) {
+        return std::nullopt;
+    }
+    return ToLookupKey(cell->GetValueView());
+}
+
+void SheetAggregates::AddFormulaValue(RangeAggregate& aggregate, const Cell& cell) {
+    Cell::ValueView value = cell.GetValueView();
+    if(std::holds_alternative<FormulaError>(value)) {
+        throw std::get<FormulaError>(value);
+    }
+    if(std::holds_alternative<double>(value)) {
+        aggregate.Add(std::get<double>(value));
+    }
+}
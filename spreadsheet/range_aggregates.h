@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Сумма, количество, минимум и максимум чисел области
+struct RangeAggregate {
+    double sum = 0;
+    uint32_t count = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    void Add(double value);
+    void Merge(const RangeAggregate& other);
+};
+
+// Агрегаты областей для функций SUM, COUNT, MIN и MAX
+class AggregateInterface {
+public:
+    virtual ~AggregateInterface() = default;
+
+    // Учитывает числа и текст, который является числом; пустые ячейки и
+    // прочий текст пропускаются. Если в области есть ячейка с ошибкой,
+    // бросает эту ошибку.
+    virtual RangeAggregate Aggregate(Range range) const = 0;
+};
+
+// Дерево отрезков по строкам одного столбца. Каждый узел хранит агрегат
+// своего отрезка, поэтому изменение строки и запрос занимают O(log n), а
+// сумма пересчитывается из значений строк без накопления погрешности.
+class AggregateTree {
+public:
+    void Set(int row, std::optional<double> value);
+    RangeAggregate Query(int first_row, int last_row) const;
+    size_t GetMemoryUsage() const;
+
+private:
+    void Grow(int rows);
+
+    // nodes_[1] - корень, листья занимают [capacity_, 2 * capacity_)
+    std::vector<RangeAggregate> nodes_;
+    int capacity_ = 0;
+};
+
+// Агрегаты таблицы. Деревья строятся для столбца при первом запросе к
+// высокой области и дальше обновляются при каждом изменении ячейки столбца.
+// В деревьях хранятся только значения ячеек с числами; значения формул
+// внутри области читаются напрямую из их кешей.
+class SheetAggregates : public AggregateInterface {
+public:
+    explicit SheetAggregates(const Sheet& sheet);
+
+    RangeAggregate Aggregate(Range range) const override;
+
+    // Содержимое ячейки pos изменилось
+    void Update(Position pos);
+
+    size_t GetMemoryUsage() const;
+
+private:
+    const AggregateTree& GetTree(int col) const;
+    // число ячейки pos, если это не формула
+    std::optional<double> GetLiteralValue(Position pos) const;
+    // добавляет значение формулы; ошибка бросается
+    static void AddFormulaValue(RangeAggregate& aggregate, const Cell& cell);
+
+    const Sheet& sheet_;
+    mutable std::unordered_map<int, AggregateTree> columns_;
+};
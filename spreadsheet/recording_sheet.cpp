@@ -0,0 +1,120 @@
+#include "recording_sheet.h"
+
+#include <ostream>
+
+RecordingSheet::RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream& trace_output)
+    : sheet_(std::move(sheet))
+    , writer_(trace_output)
+    , start_(std::chrono::steady_clock::now()) {
+}
+
+template <typename Action>
+auto RecordingSheet::Record(TraceOp op, Position pos, std::string_view text, Action action) const {
+    TraceRecord record;
+    record.op = op;
+    record.pos = pos;
+    record.text = text;
+    auto begin = std::chrono::steady_clock::now();
+    record.timestamp = begin - start_;
+    try {
+        if constexpr(std::is_void_v<decltype(action())>) {
+            action();
+            record.duration = std::chrono::steady_clock::now() - begin;
+            writer_.Write(record);
+        } else {
+            auto result = action();
+            record.duration = std::chrono::steady_clock::now() - begin;
+            writer_.Write(record);
+            return result;
+        }
+    } catch (...) {
+        record.duration = std::chrono::steady_clock::now() - begin;
+        record.failed = true;
+        writer_.Write(record);
+        throw;
+    }
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    Record(TraceOp::SetCell, pos, text, [&] {
+        sheet_->SetCell(pos, text);
+    });
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    if(sheet_->GetCell(pos) == nullptr) {
+        return nullptr;
+    }
+    return &cells_.try_emplace(pos, *this, pos).first->second;
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    if(sheet_->GetCell(pos) == nullptr) {
+        return nullptr;
+    }
+    return &cells_.try_emplace(pos, *this, pos).first->second;
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    Record(TraceOp::ClearCell, pos, {}, [&] {
+        sheet_->ClearCell(pos);
+    });
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    return Record(TraceOp::GetPrintableSize, Position::NONE, {}, [&] {
+        return sheet_->GetPrintableSize();
+    });
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    Record(TraceOp::PrintValues, Position::NONE, {}, [&] {
+        sheet_->PrintValues(output);
+    });
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    Record(TraceOp::PrintTexts, Position::NONE, {}, [&] {
+        sheet_->PrintTexts(output);
+    });
+}
+
+const LookupInterface* RecordingSheet::GetLookup() const {
+    return sheet_->GetLookup();
+}
+
+const AggregateInterface* RecordingSheet::GetAggregates() const {
+    return sheet_->GetAggregates();
+}
+
+const SheetInterface& RecordingSheet::GetSheet() const {
+    return *sheet_;
+}
+
+RecordingSheet::RecordingCell::RecordingCell(const RecordingSheet& sheet, Position pos)
+    : sheet_(sheet)
+    , pos_(pos) {
+}
+
+const CellInterface* RecordingSheet::RecordingCell::GetInnerCell() const {
+    return sheet_.sheet_->GetCell(pos_);
+}
+
+CellInterface::Value RecordingSheet::RecordingCell::GetValue() const {
+    return sheet_.Record(TraceOp::GetValue, pos_, {}, [&]() -> Value {
+        const CellInterface* cell = GetInnerCell();
+        return cell != nullptr ? cell->GetValue() : Value();
+    });
+}
+
+std::string RecordingSheet::RecordingCell::GetText() const {
+    return sheet_.Record(TraceOp::GetText, pos_, {}, [&]() -> std::string {
+        const CellInterface* cell = GetInnerCell();
+        return cell != nullptr ? cell->GetText() : std::string();
+    });
+}
+
+std::vector<Position> RecordingSheet::RecordingCell::GetReferencedCells() const {
+    const CellInterface* cell = GetInnerCell();
+    return cell != nullptr ? cell->GetReferencedCells() : std::vector<Position>();
+}
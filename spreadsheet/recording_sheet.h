@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "workload_trace.h"
+
+#include <chrono>
+#include <unordered_map>
+
+// Таблица-обёртка, которая передаёт все операции вложенной таблице и
+// записывает их в трассу нагрузки вместе со временем выполнения. Значения
+// ячеек записываются, когда вызываются методы объектов, полученных через
+// GetCell().
+class RecordingSheet : public SheetInterface {
+public:
+    RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream& trace_output);
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const LookupInterface* GetLookup() const override;
+    const AggregateInterface* GetAggregates() const override;
+
+    const SheetInterface& GetSheet() const;
+
+private:
+    // Ячейка-посредник: каждый вызов обращается к текущей ячейке вложенной
+    // таблицы, поэтому объект остаётся корректным после изменения ячейки.
+    class RecordingCell : public CellInterface {
+    public:
+        RecordingCell(const RecordingSheet& sheet, Position pos);
+
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+        const CellInterface* GetInnerCell() const;
+
+        const RecordingSheet& sheet_;
+        Position pos_;
+    };
+
+    template <typename Action>
+    auto Record(TraceOp op, Position pos, std::string_view text, Action action) const;
+
+    std::unique_ptr<SheetInterface> sheet_;
+    mutable TraceWriter writer_;
+    std::chrono::steady_clock::time_point start_;
+    mutable std::unordered_map<Position, RecordingCell, Position::HashFunc> cells_;
+};
@@ -0,0 +1,223 @@
+// Воспроизводит трассу нагрузки, записанную RecordingSheet, на новой таблице
+// и выводит статистику времени выполнения по типам операций. Если текущая
+// сборка выполняет операцию заметно медленнее, чем при записи трассы, это
+// отмечается как регрессия.
+//
+// Использование: spreadsheet_replay <trace> [--threshold <ratio>] [--top <n>]
+//
+// Код возврата: 0 - регрессий нет, 1 - трассу не удалось прочитать,
+// 2 - неверные аргументы, 3 - найдены регрессии.
+
+#include "common.h"
+#include "workload_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <streambuf>
+#include <vector>
+
+namespace {
+
+// Поток, который форматирует вывод, но никуда его не записывает
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char_type*, std::streamsize count) override {
+        return count;
+    }
+};
+
+struct ReplayedOperation {
+    TraceRecord record;
+    std::chrono::nanoseconds duration{0};
+    bool failed = false;
+};
+
+struct OperationStats {
+    std::vector<std::chrono::nanoseconds> recorded;
+    std::vector<std::chrono::nanoseconds> replayed;
+    size_t outcome_mismatches = 0;
+};
+
+volatile size_t sink = 0;
+
+ReplayedOperation Replay(SheetInterface& sheet, const TraceRecord& record, std::ostream& null_stream) {
+    ReplayedOperation result{record};
+    auto begin = std::chrono::steady_clock::now();
+    try {
+        switch(record.op) {
+            case TraceOp::SetCell:
+                sheet.SetCell(record.pos, record.text);
+                break;
+            case TraceOp::ClearCell:
+                sheet.ClearCell(record.pos);
+                break;
+            case TraceOp::GetValue:
+                if(const CellInterface* cell = sheet.GetCell(record.pos)) {
+                    sink = sink + cell->GetValue().index();
+                }
+                break;
+            case TraceOp::GetText:
+                if(const CellInterface* cell = sheet.GetCell(record.pos)) {
+                    sink = sink + cell->GetText().size();
+                }
+                break;
+            case TraceOp::GetPrintableSize:
+                sink = sink + sheet.GetPrintableSize().rows;
+                break;
+            case TraceOp::PrintValues:
+                sheet.PrintValues(null_stream);
+                break;
+            case TraceOp::PrintTexts:
+                sheet.PrintTexts(null_stream);
+                break;
+        }
+    } catch (const std::exception&) {
+        result.failed = true;
+    }
+    result.duration = std::chrono::steady_clock::now() - begin;
+    return result;
+}
+
+double ToMicroseconds(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+std::chrono::nanoseconds Percentile(std::vector<std::chrono::nanoseconds>& values, double p) {
+    if(values.empty()) {
+        return {};
+    }
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+std::chrono::nanoseconds Sum(const std::vector<std::chrono::nanoseconds>& values) {
+    std::chrono::nanoseconds sum{0};
+    for(auto value: values) {
+        sum += value;
+    }
+    return sum;
+}
+
+// Возвращает true, если найдены регрессии
+bool PrintReport(std::map<TraceOp, OperationStats>& stats,
+                 std::vector<ReplayedOperation>& operations,
+                 double threshold, size_t top) {
+    std::cout << std::left << std::setw(18) << "operation" << std::right
+              << std::setw(10) << "count"
+              << std::setw(14) << "total ms"
+              << std::setw(12) << "mean us"
+              << std::setw(12) << "p50 us"
+              << std::setw(12) << "p99 us"
+              << std::setw(12) << "max us"
+              << std::setw(14) << "recorded us"
+              << std::setw(10) << "ratio" << '\n';
+    std::cout << std::fixed << std::setprecision(2);
+
+    bool regressed = false;
+    for(auto& [op, op_stats]: stats) {
+        const size_t count = op_stats.replayed.size();
+        const auto total = Sum(op_stats.replayed);
+        const auto recorded_total = Sum(op_stats.recorded);
+        const double ratio = recorded_total.count() > 0
+            ? static_cast<double>(total.count()) / recorded_total.count() : 0;
+        const auto max = *std::max_element(op_stats.replayed.begin(), op_stats.replayed.end());
+
+        std::cout << std::left << std::setw(18) << ToString(op) << std::right
+                  << std::setw(10) << count
+                  << std::setw(14) << ToMicroseconds(total) / 1000
+                  << std::setw(12) << ToMicroseconds(total) / count
+                  << std::setw(12) << ToMicroseconds(Percentile(op_stats.replayed, 0.5))
+                  << std::setw(12) << ToMicroseconds(Percentile(op_stats.replayed, 0.99))
+                  << std::setw(12) << ToMicroseconds(max)
+                  << std::setw(14) << ToMicroseconds(recorded_total) / count
+                  << std::setw(10) << ratio;
+        if(ratio > threshold) {
+            std::cout << "  REGRESSION";
+            regressed = true;
+        }
+        if(op_stats.outcome_mismatches > 0) {
+            std::cout << "  " << op_stats.outcome_mismatches << " outcome mismatches";
+        }
+        std::cout << '\n';
+    }
+
+    top = std::min(top, operations.size());
+    std::partial_sort(operations.begin(), operations.begin() + top, operations.end(),
+                      [](const ReplayedOperation& lhs, const ReplayedOperation& rhs) {
+        return lhs.duration - lhs.record.duration > rhs.duration - rhs.record.duration;
+    });
+    std::cout << "\nlargest slowdowns against the recording:\n";
+    for(size_t i = 0; i < top; i++) {
+        const ReplayedOperation& operation = operations[i];
+        std::cout << "  #" << i + 1 << ' ' << ToString(operation.record.op);
+        if(HasPosition(operation.record.op)) {
+            std::cout << ' ' << operation.record.pos.ToString();
+        }
+        std::cout << ": " << ToMicroseconds(operation.duration) << " us (recorded "
+                  << ToMicroseconds(operation.record.duration) << " us)\n";
+    }
+    std::cout << (regressed ? "\nregressions found\n" : "\nno regressions\n");
+    return regressed;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace> [--threshold <ratio>] [--top <n>]\n";
+        return 2;
+    }
+    double threshold = 1.2;
+    size_t top = 10;
+    for(int i = 2; i + 1 < argc; i += 2) {
+        std::string_view option = argv[i];
+        if(option == "--threshold") {
+            threshold = std::atof(argv[i + 1]);
+        } else if(option == "--top") {
+            top = std::strtoul(argv[i + 1], nullptr, 10);
+        } else {
+            std::cerr << "Unknown option " << option << '\n';
+            return 2;
+        }
+    }
+
+    std::ifstream input(argv[1], std::ios::binary);
+    if(!input) {
+        std::cerr << "Cannot open " << argv[1] << '\n';
+        return 2;
+    }
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+    std::map<TraceOp, OperationStats> stats;
+    std::vector<ReplayedOperation> operations;
+    try {
+        TraceReader reader(input);
+        auto sheet = CreateSheet();
+        TraceRecord record;
+        while(reader.Read(record)) {
+            ReplayedOperation operation = Replay(*sheet, record, null_stream);
+            OperationStats& op_stats = stats[record.op];
+            op_stats.recorded.push_back(record.duration);
+            op_stats.replayed.push_back(operation.duration);
+            if(operation.failed != record.failed) {
+                op_stats.outcome_mismatches++;
+            }
+            operations.push_back(std::move(operation));
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << argv[1] << ": " << e.what() << '\n';
+        return 1;
+    }
+
+    return PrintReport(stats, operations, threshold, top) ? 3 : 0;
+}
@@ -0,0 +1,329 @@
+#include "scenario_table.h"
+
+#include "parallel.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace {
+// меньше сценариев на поток не окупают запуск потока
+constexpr size_t MIN_SCENARIOS_PER_THREAD = 16;
+
+// значение ячейки таблицы; заодно заполняет кеш формулы
+CellInterface::Value ReadValue(const Sheet& sheet, Position pos) {
+    const CellInterface* cell = sheet.GetCell(pos);
+    return cell != nullptr ? cell->GetValue() : CellInterface::Value(0.0);
+}
+}  // namespace
+
+// Значение входа или формулы в одном сценарии
+class ScenarioModel::Evaluator::ValueCell : public CellInterface {
+public:
+    Value GetValue() const override {
+        return value;
+    }
+
+    std::string GetText() const override {
+        return {};
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return {};
+    }
+
+    Value value;
+};
+
+// Таблица, какой её видят формулы одного сценария: входы и формулы модели
+// берутся из ячеек сценария, области - из копий столбцов модели, остальное -
+// из таблицы
+class ScenarioModel::Evaluator::View : public SheetInterface, public LookupInterface,
+                                       public AggregateInterface {
+public:
+    View(const ScenarioModel& model, const std::vector<ValueCell>& cells)
+        : model_(model)
+        , cells_(cells) {
+    }
+
+    void SetCell(Position /* pos */, std::string /* text */) override {
+        throw std::logic_error("Scenario view is read-only");
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        auto it = model_.slots_.find(pos);
+        if(it != model_.slots_.end()) {
+            return &cells_[it->second];
+        }
+        return model_.sheet_.GetCell(pos);
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        return const_cast<CellInterface*>(static_cast<const View&>(*this).GetCell(pos));
+    }
+
+    void ClearCell(Position /* pos */) override {
+        throw std::logic_error("Scenario view is read-only");
+    }
+
+    Size GetPrintableSize() const override {
+        return model_.sheet_.GetPrintableSize();
+    }
+
+    void PrintValues(std::ostream& /* output */) const override {
+        throw std::logic_error("Scenario view cannot be printed");
+    }
+
+    void PrintTexts(std::ostream& /* output */) const override {
+        throw std::logic_error("Scenario view cannot be printed");
+    }
+
+    const LookupInterface* GetLookup() const override {
+        return this;
+    }
+
+    const AggregateInterface* GetAggregates() const override {
+        return this;
+    }
+
+    std::optional<int> Find(Range column, double key, Match match) const override {
+        const ColumnSnapshot& snapshot = model_.columns_.at(column);
+        if(snapshot.slots.empty()) {
+            auto it = indexes_.find(column);
+            if(it == indexes_.end()) {
+                it = indexes_.emplace(column, ColumnIndex(snapshot.keys)).first;
+            }
+            return it->second.Find(key, match);
+        }
+        std::vector<std::optional<double>> keys = snapshot.keys;
+        for(const auto& [row, slot]: snapshot.slots) {
+            keys[row] = ToLookupKey(cells_[slot].value);
+        }
+        return ColumnIndex(std::move(keys)).Find(key, match);
+    }
+
+    RangeAggregate Aggregate(Range range) const override {
+        RangeAggregate result;
+        for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+            const ColumnSnapshot& snapshot = model_.columns_.at(
+                {{range.top_left.row, col}, {range.bottom_right.row, col}});
+            if(snapshot.error.has_value()) {
+                throw *snapshot.error;
+            }
+            result.Merge(snapshot.aggregate);
+            for(const auto& [row, slot]: snapshot.slots) {
+                const CellInterface::Value& value = cells_[slot].value;
+                if(std::holds_alternative<FormulaError>(value)) {
+                    throw std::get<FormulaError>(value);
+                }
+                if(std::optional<double> number = ToLookupKey(value)) {
+                    result.Add(*number);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    const ScenarioModel& model_;
+    const std::vector<ValueCell>& cells_;
+    // индексы столбцов без ячеек сценария; у каждого потока свои
+    mutable std::map<Range, ColumnIndex> indexes_;
+};
+
+ScenarioModel::ScenarioModel(const Sheet& sheet, std::vector<Position> inputs, std::vector<Position> outputs)
+    : sheet_(sheet)
+    , inputs_(std::move(inputs))
+    , outputs_(std::move(outputs)) {
+    for(const auto* positions: {&inputs_, &outputs_}) {
+        for(Position pos: *positions) {
+            if(!pos.IsValid()) {
+                throw InvalidPositionException("Invalid position");
+            }
+        }
+    }
+    for(Position pos: inputs_) {
+        slots_.try_emplace(pos, slots_.size());
+    }
+
+    // формулы, зависящие от входов
+    std::unordered_set<Position, Position::HashFunc> downstream;
+    std::queue<Position> next_positions;
+    for(Position pos: inputs_) {
+        next_positions.push(pos);
+    }
+    while(!next_positions.empty()) {
+        Position current = next_positions.front();
+        next_positions.pop();
+        for(Position dependent: sheet_.GetDependentCells(current)) {
+            if(slots_.count(dependent) == 0 && downstream.insert(dependent).second) {
+                next_positions.push(dependent);
+            }
+        }
+    }
+
+    // из них те, что нужны выходам, в порядке вычисления: обход в глубину
+    // от выходов добавляет формулу после всех формул, которые она читает
+    struct Frame {
+        Position pos;
+        std::vector<Position> dependencies;
+        size_t next = 0;
+    };
+    std::vector<Position> cone;
+    std::unordered_set<Position, Position::HashFunc> visited;
+    std::vector<Frame> stack;
+    for(Position output: outputs_) {
+        if(downstream.count(output) == 0 || !visited.insert(output).second) {
+            continue;
+        }
+        stack.push_back({output, sheet_.GetFormulaDependencies(*sheet_.GetConcreteCell(output))});
+        while(!stack.empty()) {
+            Frame& frame = stack.back();
+            if(frame.next == frame.dependencies.size()) {
+                cone.push_back(frame.pos);
+                stack.pop_back();
+                continue;
+            }
+            Position next_pos = frame.dependencies[frame.next++];
+            if(downstream.count(next_pos) != 0 && visited.insert(next_pos).second) {
+                stack.push_back({next_pos, sheet_.GetFormulaDependencies(*sheet_.GetConcreteCell(next_pos))});
+            }
+        }
+    }
+
+    // Всё, что формулы модели читают из таблицы, вычисляется заранее в этом
+    // потоке: сценарии в других потоках читают из таблицы только значения
+    // отдельных ячеек, а области - из копий. Отложенные формулы модели
+    // разбираются здесь же.
+    formulas_.reserve(cone.size());
+    for(Position pos: cone) {
+        const Cell& cell = *sheet_.GetConcreteCell(pos);
+        try {
+            cell.Validate();
+        } catch (const FormulaException&) {
+        }
+        for(const auto& references: {cell.GetReferencedCells(), sheet_.GetFormulaDependencies(cell)}) {
+            for(Position referenced: references) {
+                if(slots_.count(referenced) == 0 && downstream.count(referenced) == 0) {
+                    ReadValue(sheet_, referenced);
+                }
+            }
+        }
+        formulas_.push_back(cell.GetFormula());
+        slots_.emplace(pos, slots_.size());
+    }
+    for(Position pos: cone) {
+        for(const Range& range: sheet_.GetConcreteCell(pos)->GetReferencedRanges()) {
+            AddColumnSnapshots(range);
+        }
+    }
+    constants_.resize(outputs_.size());
+    for(size_t i = 0; i < outputs_.size(); i++) {
+        if(slots_.count(outputs_[i]) == 0) {
+            constants_[i] = ReadValue(sheet_, outputs_[i]);
+        }
+    }
+}
+
+void ScenarioModel::AddColumnSnapshots(Range range) {
+    const Size size = range.GetSize();
+    std::vector<ColumnSnapshot*> columns;
+    for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+        auto [it, inserted] = columns_.try_emplace({{range.top_left.row, col}, {range.bottom_right.row, col}});
+        columns.push_back(inserted ? &it->second : nullptr);
+        if(inserted) {
+            it->second.keys.resize(size.rows);
+        }
+    }
+    sheet_.ReadRange(range.top_left, size, [&](Position pos, Cell::ValueView value) {
+        ColumnSnapshot* column = columns[pos.col - range.top_left.col];
+        if(column == nullptr) {
+            return;
+        }
+        const int row = pos.row - range.top_left.row;
+        if(auto slot = slots_.find(pos); slot != slots_.end()) {
+            column->slots.emplace_back(row, slot->second);
+        } else if(std::holds_alternative<FormulaError>(value)) {
+            column->error = std::get<FormulaError>(value);
+        } else if(std::optional<double> key = ToLookupKey(value)) {
+            column->keys[row] = key;
+            column->aggregate.Add(*key);
+        }
+    });
+    // входы могут быть пустыми ячейками, которых нет в хранилище
+    for(Position input: inputs_) {
+        if(range.Contains(input)) {
+            ColumnSnapshot* column = columns[input.col - range.top_left.col];
+            const std::pair<int, size_t> slot{input.row - range.top_left.row, slots_.at(input)};
+            if(column != nullptr
+              && std::find(column->slots.begin(), column->slots.end(), slot) == column->slots.end()) {
+                column->slots.push_back(slot);
+            }
+        }
+    }
+}
+
+size_t ScenarioModel::GetInputsCount() const {
+    return inputs_.size();
+}
+
+size_t ScenarioModel::GetOutputsCount() const {
+    return outputs_.size();
+}
+
+size_t ScenarioModel::GetConeSize() const {
+    return formulas_.size();
+}
+
+bool ScenarioModel::DependsOnInputs(size_t output) const {
+    return slots_.count(outputs_.at(output)) != 0;
+}
+
+ScenarioModel::Evaluator::Evaluator(const ScenarioModel& model)
+    : model_(model)
+    , cells_(model.slots_.size())
+    , view_(std::make_unique<View>(model, cells_)) {
+}
+
+ScenarioModel::Evaluator::~Evaluator() {}
+
+void ScenarioModel::Evaluator::Evaluate(const double* input_values, CellInterface::Value* output_values) {
+    for(size_t i = 0; i < model_.inputs_.size(); i++) {
+        cells_[model_.slots_.at(model_.inputs_[i])].value = input_values[i];
+    }
+    const size_t first_formula_slot = cells_.size() - model_.formulas_.size();
+    for(size_t i = 0; i < model_.formulas_.size(); i++) {
+        cells_[first_formula_slot + i].value = std::visit([](const auto& value) -> CellInterface::Value {
+            return value;
+        }, model_.formulas_[i]->Evaluate(*view_));
+    }
+    for(size_t i = 0; i < model_.outputs_.size(); i++) {
+        auto slot = model_.slots_.find(model_.outputs_[i]);
+        output_values[i] = slot != model_.slots_.end() ? cells_[slot->second].value : model_.constants_[i];
+    }
+}
+
+ScenarioTable EvaluateScenarios(const Sheet& sheet, const std::vector<Position>& inputs,
+                                const std::vector<Position>& outputs,
+                                const std::vector<std::vector<double>>& input_values) {
+    for(const auto& row: input_values) {
+        if(row.size() != inputs.size()) {
+            throw std::invalid_argument("Scenario row size does not match the number of inputs");
+        }
+    }
+    const ScenarioModel model(sheet, inputs, outputs);
+
+    ScenarioTable table;
+    table.scenarios = input_values.size();
+    table.outputs = outputs.size();
+    table.values.resize(table.scenarios * table.outputs);
+    ParallelFor(input_values.size(), MIN_SCENARIOS_PER_THREAD, [&](size_t begin, size_t end) {
+        ScenarioModel::Evaluator evaluator(model);
+        for(size_t scenario = begin; scenario < end; scenario++) {
+            evaluator.Evaluate(input_values[scenario].data(), table.values.data() + scenario * table.outputs);
+        }
+    });
+    return table;
+}
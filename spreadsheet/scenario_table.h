@@ -0,0 +1,98 @@
+#pragma once
+
+#include "common.h"
+#include "range_aggregates.h"
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+class FormulaInterface;
+
+// Значения выходных ячеек для каждого сценария, по строкам: значение
+// выхода output в сценарии scenario имеет индекс scenario * outputs + output
+struct ScenarioTable {
+    size_t scenarios = 0;
+    size_t outputs = 0;
+    std::vector<CellInterface::Value> values;
+
+    const CellInterface::Value& Get(size_t scenario, size_t output) const {
+        return values[scenario * outputs + output];
+    }
+};
+
+// Зависимость выходных ячеек от входных. Формулы, которые зависят от входов
+// и нужны выходам, находятся один раз и упорядочиваются по зависимостям, а
+// всё, что они читают из остальной таблицы, вычисляется заранее. Значения
+// областей, которые читают эти формулы, копируются в модель. После этого
+// сценарий вычисляет только эти формулы теми же разобранными выражениями,
+// не меняя таблицу. Таблица не должна меняться, пока модель используется.
+class ScenarioModel {
+public:
+    ScenarioModel(const Sheet& sheet, std::vector<Position> inputs, std::vector<Position> outputs);
+
+    size_t GetInputsCount() const;
+    size_t GetOutputsCount() const;
+    // Количество формул, которые вычисляются в каждом сценарии
+    size_t GetConeSize() const;
+    // Зависит ли значение выхода output от входов
+    bool DependsOnInputs(size_t output) const;
+
+    // Значения ячеек одного сценария. Разные объекты можно использовать в
+    // разных потоках одновременно.
+    class Evaluator {
+    public:
+        explicit Evaluator(const ScenarioModel& model);
+        ~Evaluator();
+
+        // Вычисляет выходы по значениям входов input_values и записывает
+        // их в output_values
+        void Evaluate(const double* input_values, CellInterface::Value* output_values);
+
+    private:
+        class ValueCell;
+        class View;
+
+        const ScenarioModel& model_;
+        std::vector<ValueCell> cells_;
+        std::unique_ptr<View> view_;
+    };
+
+private:
+    // Столбец области, которую читают формулы модели. Ячейки вне входов и
+    // формул модели от сценария не зависят и копируются один раз.
+    struct ColumnSnapshot {
+        // ключи поиска по строкам столбца; у ячеек сценария - nullopt
+        std::vector<std::optional<double>> keys;
+        // агрегат и ошибка ячеек, не зависящих от сценария
+        RangeAggregate aggregate;
+        std::optional<FormulaError> error;
+        // строки столбца, значения которых берутся из ячеек сценария, и
+        // номера этих ячеек
+        std::vector<std::pair<int, size_t>> slots;
+    };
+
+    void AddColumnSnapshots(Range range);
+
+    const Sheet& sheet_;
+    const std::vector<Position> inputs_;
+    const std::vector<Position> outputs_;
+    // ячейки сценария: сначала входы, затем формулы в порядке вычисления
+    std::unordered_map<Position, size_t, Position::HashFunc> slots_;
+    std::vector<const FormulaInterface*> formulas_;
+    // значения выходов, которые от входов не зависят
+    std::vector<CellInterface::Value> constants_;
+    // столбцы областей по области из одного столбца
+    std::map<Range, ColumnSnapshot> columns_;
+};
+
+// Вычисляет таблицу данных: для каждой строки input_values подставляет её
+// числа во входные ячейки inputs и читает значения ячеек outputs. Таблица
+// не меняется, сценарии вычисляются параллельно. Бросает
+// std::invalid_argument, если длина строки не совпадает с числом входов.
+ScenarioTable EvaluateScenarios(const Sheet& sheet, const std::vector<Position>& inputs,
+                                const std::vector<Position>& outputs,
+                                const std::vector<std::vector<double>>& input_values);
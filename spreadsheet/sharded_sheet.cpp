@@ -0,0 +1,351 @@
+#include "sharded_sheet.h"
+
+#include <algorithm>
+#include <ostream>
+#include <thread>
+#include <unordered_set>
+
+struct ShardedSheet::Shard {
+    Shard(const ShardedSheet& owner, size_t index) {
+        // формулы читают ячейки через всю таблицу, а сброшенные значения
+        // копятся, пока изменение не разошлётся по другим частям
+        sheet.SetEvaluationSheet(&owner);
+        sheet.SetInvalidationListener([this](Position pos) {
+            invalidated.push_back(pos);
+        });
+        // ячейки других частей, на которые ссылаются формулы, здесь не создаются
+        sheet.SetOwnedCells([&owner, index](Position pos) {
+            return !pos.IsValid() || owner.GetShardIndex(pos) == index;
+        });
+    }
+
+    // забирает позиции формул, значения которых сброшены последним изменением
+    void TakeInvalidated(std::vector<Position>& changed) {
+        changed.insert(changed.end(), invalidated.begin(), invalidated.end());
+        invalidated.clear();
+    }
+
+    Sheet sheet;
+    std::mutex mutex;
+    std::vector<Position> invalidated;
+};
+
+ShardedSheet::ShardedSheet(size_t shard_count, int region_rows)
+    : region_rows_(std::max(1, region_rows)) {
+    if(shard_count == 0) {
+        shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    shards_.reserve(shard_count);
+    for(size_t i = 0; i < shard_count; i++) {
+        shards_.push_back(std::make_unique<Shard>(*this, i));
+    }
+}
+
+ShardedSheet::~ShardedSheet() {}
+
+size_t ShardedSheet::GetShardCount() const {
+    return shards_.size();
+}
+
+size_t ShardedSheet::GetShardIndex(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    return static_cast<size_t>(pos.row / region_rows_) % shards_.size();
+}
+
+ShardedSheet::Shard& ShardedSheet::GetShard(Position pos) const {
+    return *shards_[GetShardIndex(pos)];
+}
+
+void ShardedSheet::SetCell(Position pos, std::string text) {
+    const size_t index = GetShardIndex(pos);
+    std::unique_ptr<FormulaInterface> formula;
+    if(Cell::IsFormulaText(text)) {
+        // формула разбирается один раз и до захвата блокировки
+        formula = ParseFormula(text.substr(1));
+    }
+    ChangeCell(index, pos, formula.get(), [&](Sheet& sheet) {
+        if(formula != nullptr) {
+            sheet.SetFormula(pos, std::move(formula));
+        } else {
+            sheet.SetCell(pos, std::move(text));
+        }
+    });
+}
+
+void ShardedSheet::ChangeCell(size_t shard_index, Position pos, const FormulaInterface* formula,
+                              const std::function<void(Sheet&)>& change) {
+    Shard& shard = *shards_[shard_index];
+    std::vector<Position> new_cells;
+    std::vector<Range> new_ranges;
+    if(formula != nullptr) {
+        new_cells = formula->GetReferencedCells();
+        new_ranges = formula->GetReferencedRanges();
+    }
+    auto get_old_references = [&](std::vector<Position>& cells, std::vector<Range>& ranges) {
+        if(const Cell* cell = shard.sheet.GetConcreteCell(pos); cell != nullptr && cell->IsFormula()) {
+            cells = cell->GetReferencedCells();
+            ranges = cell->GetReferencedRanges();
+        }
+    };
+
+    std::vector<Position> changed{pos};
+    {
+        std::shared_lock structure_lock(structure_mutex_);
+        bool changed_in_shard = false;
+        {
+            std::lock_guard lock(shard.mutex);
+            std::vector<Position> old_cells;
+            std::vector<Range> old_ranges;
+            get_old_references(old_cells, old_ranges);
+            if(!HasCrossReferences(shard_index, old_cells, old_ranges)
+              && !HasCrossReferences(shard_index, new_cells, new_ranges)
+              && (formula == nullptr || CheckCyclicDependencies(pos, *formula, true))) {
+                change(shard.sheet);
+                shard.TakeInvalidated(changed);
+                changed_in_shard = true;
+            }
+        }
+        if(changed_in_shard) {
+            PropagateInvalidation(std::move(changed));
+            return;
+        }
+    }
+
+    std::unique_lock structure_lock(structure_mutex_);
+    if(formula != nullptr) {
+        CheckCyclicDependencies(pos, *formula, false);
+    }
+    // ячейку могли изменить, пока блокировка была отпущена
+    std::vector<Position> old_cells;
+    std::vector<Range> old_ranges;
+    get_old_references(old_cells, old_ranges);
+    change(shard.sheet);
+    shard.TakeInvalidated(changed);
+    UnregisterCrossReferences(shard_index, old_cells, old_ranges);
+    RegisterCrossReferences(shard_index, new_cells, new_ranges);
+    PropagateInvalidation(std::move(changed));
+}
+
+const CellInterface* ShardedSheet::GetCell(Position pos) const {
+    return GetShard(pos).sheet.GetCell(pos);
+}
+
+CellInterface* ShardedSheet::GetCell(Position pos) {
+    return GetShard(pos).sheet.GetCell(pos);
+}
+
+void ShardedSheet::ClearCell(Position pos) {
+    ChangeCell(GetShardIndex(pos), pos, nullptr, [pos](Sheet& sheet) {
+        sheet.ClearCell(pos);
+    });
+}
+
+Size ShardedSheet::GetPrintableSize() const {
+    Size size{0, 0};
+    for(const auto& shard: shards_) {
+        const Size shard_size = shard->sheet.GetPrintableSize();
+        size.rows = std::max(size.rows, shard_size.rows);
+        size.cols = std::max(size.cols, shard_size.cols);
+    }
+    return size;
+}
+
+template <typename Print>
+void ShardedSheet::PrintCells(std::ostream& output, Print print) const {
+    const Size size = GetPrintableSize();
+    for(int row_n = 0; row_n < size.rows; row_n++) {
+        const Sheet& sheet = GetShard({row_n, 0}).sheet;
+        for(int col_n = 0; col_n < size.cols; col_n++) {
+            print(sheet, Position{row_n, col_n});
+            if(col_n == size.cols - 1) {
+                output << '\n';
+            } else {
+                output << '\t';
+            }
+        }
+    }
+}
+
+void ShardedSheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&](const Sheet& sheet, Position pos) {
+        sheet.PrintValue(pos, output);
+    });
+}
+
+void ShardedSheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&](const Sheet& sheet, Position pos) {
+        sheet.PrintText(pos, output);
+    });
+}
+
+bool ShardedSheet::CheckCyclicDependencies(Position pos, const FormulaInterface& formula, bool local) const {
+    const size_t own_index = GetShardIndex(pos);
+    // обход вышел за часть pos
+    bool leaves_shard = false;
+    // ячейки, от которых зависит current: прямые ссылки и формулы внутри
+    // областей из всех частей
+    auto get_references = [&](Position current) {
+        std::vector<Position> references;
+        std::vector<Range> ranges;
+        if(current == pos) {
+            references = formula.GetReferencedCells();
+            ranges = formula.GetReferencedRanges();
+        } else if(GetShard(current).sheet.GetStoredNumber(current).has_value()) {
+            // число ни на что не ссылается
+        } else if(const Cell* cell = GetShard(current).sheet.GetConcreteCell(current)) {
+            references = cell->GetReferencedCells();
+            ranges = cell->GetReferencedRanges();
+        }
+        if(local && HasCrossReferences(own_index, references, ranges)) {
+            leaves_shard = true;
+            return references;
+        }
+        for(const Range& range: ranges) {
+            // новая формула ещё не значится среди формул своей части
+            if(range.Contains(pos)) {
+                references.push_back(pos);
+            }
+            for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+                for(size_t index = 0; index < shards_.size(); index++) {
+                    // область внутри полосы части pos не содержит формул
+                    // других частей
+                    if(local && index != own_index) {
+                        continue;
+                    }
+                    const std::set<int>* rows = shards_[index]->sheet.GetFormulaRows(col);
+                    if(rows == nullptr) {
+                        continue;
+                    }
+                    for(auto row = rows->lower_bound(range.top_left.row);
+                        row != rows->end() && *row <= range.bottom_right.row; ++row) {
+                        references.push_back({*row, col});
+                    }
+                }
+            }
+        }
+        return references;
+    };
+
+    // граф без новой формулы ацикличен, поэтому цикл может пройти только
+    // через pos
+    std::unordered_set<Position, Position::HashFunc> visited;
+    std::vector<Position> stack = get_references(pos);
+    while(!stack.empty() && !leaves_shard) {
+        Position current = stack.back();
+        stack.pop_back();
+        if(current == pos) {
+            throw CircularDependencyException("Circular dependency exception");
+        }
+        if(!visited.insert(current).second) {
+            continue;
+        }
+        for(Position next: get_references(current)) {
+            stack.push_back(next);
+        }
+    }
+    return !leaves_shard;
+}
+
+bool ShardedSheet::IsCrossReference(size_t shard_index, Position referenced) const {
+    return referenced.IsValid() && GetShardIndex(referenced) != shard_index;
+}
+
+bool ShardedSheet::IsCrossReference(size_t shard_index, const Range& range) const {
+    const int first_band = range.top_left.row / region_rows_;
+    const int last_band = range.bottom_right.row / region_rows_;
+    return first_band != last_band || GetShardIndex(range.top_left) != shard_index;
+}
+
+bool ShardedSheet::HasCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                                      const std::vector<Range>& ranges) const {
+    return std::any_of(cells.begin(), cells.end(), [&](Position referenced) {
+        return IsCrossReference(shard_index, referenced);
+    }) || std::any_of(ranges.begin(), ranges.end(), [&](const Range& range) {
+        return IsCrossReference(shard_index, range);
+    });
+}
+
+void ShardedSheet::RegisterCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                                           const std::vector<Range>& ranges) {
+    for(Position referenced: cells) {
+        if(IsCrossReference(shard_index, referenced)) {
+            cross_refs_[referenced].push_back(shard_index);
+        }
+    }
+    for(const Range& range: ranges) {
+        if(IsCrossReference(shard_index, range)) {
+            cross_ranges_[range].push_back(shard_index);
+        }
+    }
+}
+
+void ShardedSheet::UnregisterCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                                             const std::vector<Range>& ranges) {
+    // удаляется одна запись: на ту же ячейку могут ссылаться другие формулы части
+    auto remove = [shard_index](auto& references, auto it) {
+        std::vector<size_t>& shards = it->second;
+        shards.erase(std::find(shards.begin(), shards.end(), shard_index));
+        if(shards.empty()) {
+            references.erase(it);
+        }
+    };
+    for(Position referenced: cells) {
+        if(IsCrossReference(shard_index, referenced)) {
+            remove(cross_refs_, cross_refs_.find(referenced));
+        }
+    }
+    for(const Range& range: ranges) {
+        if(IsCrossReference(shard_index, range)) {
+            remove(cross_ranges_, cross_ranges_.find(range));
+        }
+    }
+}
+
+size_t ShardedSheet::GetCrossReferenceCount() const {
+    size_t count = 0;
+    for(const auto& [pos, shards]: cross_refs_) {
+        count += shards.size();
+    }
+    for(const auto& [range, shards]: cross_ranges_) {
+        count += shards.size();
+    }
+    return count;
+}
+
+std::vector<size_t> ShardedSheet::GetDependentShards(Position pos) const {
+    const size_t own_index = GetShardIndex(pos);
+    std::vector<size_t> result;
+    auto add = [&](const std::vector<size_t>& shards) {
+        for(size_t index: shards) {
+            if(index != own_index && std::find(result.begin(), result.end(), index) == result.end()) {
+                result.push_back(index);
+            }
+        }
+    };
+    if(auto it = cross_refs_.find(pos); it != cross_refs_.end()) {
+        add(it->second);
+    }
+    for(const auto& [range, shards]: cross_ranges_) {
+        if(range.Contains(pos)) {
+            add(shards);
+        }
+    }
+    return result;
+}
+
+void ShardedSheet::PropagateInvalidation(std::vector<Position> changed) {
+    // сброс находит только формулы со значением в кеше, поэтому каждая
+    // формула попадает в changed не больше одного раза за изменение
+    while(!changed.empty()) {
+        const Position current = changed.back();
+        changed.pop_back();
+        for(size_t index: GetDependentShards(current)) {
+            Shard& shard = *shards_[index];
+            std::lock_guard lock(shard.mutex);
+            shard.sheet.InvalidateCell(current);
+            shard.TakeInvalidated(changed);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Таблица, разделённая на части по полосам строк: полоса из region_rows
+// строк с номером band хранится в части band % shard_count. У каждой части
+// своё хранилище и своя блокировка, поэтому SetCell и ClearCell значений
+// можно вызывать из разных потоков одновременно, и изменения в разных
+// частях выполняются параллельно. Формула, все ссылки и цепочки ссылок
+// которой остаются в её части, задаётся так же. Монопольно, пока другие
+// изменения ждут, выполняются только изменения связей между частями:
+// формула со ссылками на другие части, замена или удаление такой формулы
+// и формула, для проверки цикла которой нужны другие части. Чтение и
+// печать не должны выполняться одновременно с изменениями.
+class ShardedSheet : public SheetInterface {
+public:
+    // shard_count == 0 - по числу аппаратных потоков
+    explicit ShardedSheet(size_t shard_count = 0, int region_rows = 1024);
+    ~ShardedSheet();
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    size_t GetShardCount() const;
+    // Номер части, в которой хранится ячейка pos
+    size_t GetShardIndex(Position pos) const;
+    // Число ссылок формул на ячейки и области других частей
+    size_t GetCrossReferenceCount() const;
+
+private:
+    struct Shard;
+
+    Shard& GetShard(Position pos) const;
+    // Меняет ячейку pos части shard_index вызовом change. Если ячейка
+    // содержит или получит формулу formula со ссылками на другие части или
+    // для проверки цикла нужны другие части, изменение выполняется под
+    // монопольной блокировкой и обновляет связи между частями.
+    void ChangeCell(size_t shard_index, Position pos, const FormulaInterface* formula,
+                    const std::function<void(Sheet&)>& change);
+    // Бросает CircularDependencyException, если формула formula в ячейке
+    // pos замкнёт цикл, возможно через несколько частей. Если local, обход
+    // не выходит за часть ячейки pos и возвращает false, когда ему нужны
+    // ячейки или области других частей.
+    bool CheckCyclicDependencies(Position pos, const FormulaInterface& formula, bool local) const;
+    // Ссылка формулы части shard_index ведёт в другую часть: область целиком
+    // внутри одной полосы своей части обслуживается самой частью
+    bool IsCrossReference(size_t shard_index, Position referenced) const;
+    bool IsCrossReference(size_t shard_index, const Range& range) const;
+    bool HasCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                            const std::vector<Range>& ranges) const;
+    // Запоминает, какие части нужно оповещать об изменении ячеек, на которые
+    // ссылается формула части shard_index, и забывает это для удалённой формулы
+    void RegisterCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                                 const std::vector<Range>& ranges);
+    void UnregisterCrossReferences(size_t shard_index, const std::vector<Position>& cells,
+                                   const std::vector<Range>& ranges);
+    // Части, кроме части самой ячейки, формулы которых зависят от pos
+    std::vector<size_t> GetDependentShards(Position pos) const;
+    // Сбрасывает значения формул других частей, зависящих от ячеек changed,
+    // и дальше по цепочке. Блокирует части по одной.
+    void PropagateInvalidation(std::vector<Position> changed);
+    template <typename Print>
+    void PrintCells(std::ostream& output, Print print) const;
+
+    const int region_rows_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // Формулы меняют связи между частями и проверяются на циклы по всем
+    // частям, поэтому задаются под монопольной блокировкой; значения - под
+    // разделяемой вместе с блокировкой своей части
+    std::shared_mutex structure_mutex_;
+    // части формул, которые ссылаются на ячейки и области других частей, -
+    // по одной записи на формулу; записи удаляются вместе с формулами
+    std::unordered_map<Position, std::vector<size_t>, Position::HashFunc> cross_refs_;
+    std::map<Range, std::vector<size_t>> cross_ranges_;
+};
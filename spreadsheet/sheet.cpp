@@ -2,6 +2,8 @@
 
 #include "cell.h"
 #include "common.h"
+#include "parallel.h"
+#include "trace_events.h"
 
 #include <algorithm>
 #include <functional>
@@ -9,126 +11,697 @@
 #include <optional>
 #include <map>
 #include <queue>
+#include <sstream>
+#include <thread>
 
 using namespace std::literals;
 
+namespace {
+// меньше формул на поток не окупают запуск потока
+constexpr size_t MIN_FORMULAS_PER_THREAD = 256;
+// ячеек в одной части параллельной печати
+constexpr size_t PRINT_CHUNK_CELLS = 16 * 1024;
+// повторов вычисления формулы с функциями, после которых она ждёт все
+// формулы, на которые ссылается: так формула, читающая много формул
+// области, не вычисляется заново для каждой из них
+constexpr int MAX_EVALUATION_RETRIES = 4;
+
+// Вычисление формулы дошло до формулы cell таблицы sheet, значения которой
+// нет в кеше. Не наследуется от std::exception, чтобы его не перехватили
+// обработчики ошибок на пути от формулы к планировщику.
+struct PendingEvaluation {
+    const Sheet* sheet;
+    const Cell* cell;
+};
+
+// Узлы std::map и std::set: элемент, три указателя и цвет
+template <typename Tree>
+size_t GetTreeMemoryUsage(const Tree& tree) {
+    return tree.size() * (sizeof(typename Tree::value_type) + 4 * sizeof(void*));
+}
+
+// Узлы std::unordered_map и std::unordered_set: элемент, указатель на
+// следующий узел и закешированный хеш, а также массив корзин
+template <typename Table>
+size_t GetTableMemoryUsage(const Table& table) {
+    return table.size() * (sizeof(typename Table::value_type) + sizeof(void*) + sizeof(size_t))
+        + table.bucket_count() * sizeof(void*);
+}
+}  // namespace
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
+    TRACE_SCOPE("SetCell");
     if(pos.col >= Position::MAX_COLS || pos.row >= Position::MAX_ROWS
       || pos.col < 0 || pos.row < 0) {
         throw InvalidPositionException("Invalid position");
     }
     
-    //invalidate cache
-    if(cells_.find(pos) != cells_.end() && cells_[pos] != nullptr) {
-        std::queue<Position> next_positions;
-        std::unordered_set<std::string> visited_cells;
-        cells_[pos]->InvalidateCache();
-        for(auto p: cells_[pos]->GetReferedCells()) {
-            next_positions.push(p);
-            cells_[p]->InvalidateCache();
-            visited_cells.insert(p.ToString());
+    if(std::optional<double> number = NumericColumns::ParseLiteral(text); number && PrepareNumberStorage(pos)) {
+        InstallNumber(pos, *number, text);
+        return;
+    }
+    ReplaceCell(pos, std::make_unique<Cell>(text, *this));
+}
+
+void Sheet::SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula) {
+    TRACE_SCOPE("SetCell");
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    ReplaceCell(pos, std::make_unique<Cell>(std::move(formula), *this));
+}
+
+void Sheet::ReplaceCell(Position pos, std::unique_ptr<Cell> cell) {
+    FormulaReferences references{cell->GetReferencedCells(), cell->GetReferencedRanges()};
+    CheckCyclicDependencies({{pos, references}});
+    InstallCell(pos, std::move(cell), references);
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    TRACE_SCOPE("SetCells");
+    for(const auto& [pos, text]: cells) {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
         }
-        
-        while (!next_positions.empty()) {
-            Position current_pos = next_positions.front();
-            next_positions.pop();
-            for(auto p: cells_[current_pos]->GetReferedCells()) {
-                if(visited_cells.find(p.ToString()) == visited_cells.end()) {
-                    next_positions.push(p);
-                }
-                cells_[p]->InvalidateCache();
-                visited_cells.insert(p.ToString());
+    }
+    
+    // для повторяющихся позиций действует последний текст
+    std::unordered_map<Position, size_t, Position::HashFunc> last_indexes;
+    for(size_t i = 0; i < cells.size(); i++) {
+        last_indexes[cells[i].first] = i;
+    }
+    std::vector<size_t> formula_indexes;
+    for(size_t i = 0; i < cells.size(); i++) {
+        if(last_indexes.at(cells[i].first) == i && Cell::IsFormulaText(cells[i].second)) {
+            formula_indexes.push_back(i);
+        }
+    }
+    
+    // каждый поток разбирает свою часть формул собственным парсером
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(cells.size());
+    ParallelFor(formula_indexes.size(), MIN_FORMULAS_PER_THREAD, [&](size_t begin, size_t end) {
+        TRACE_SCOPE("ParseBatch");
+        for(size_t i = begin; i < end; i++) {
+            const size_t index = formula_indexes[i];
+            std::string expression = cells[index].second.substr(1);
+            formulas[index] = deferred_parsing_ ? ParseFormulaDeferred(std::move(expression))
+                                                : ParseFormula(std::move(expression));
+        }
+    });
+    
+    References new_references;
+    for(const auto& [pos, index]: last_indexes) {
+        if(formulas[index] != nullptr) {
+            new_references[pos] = {formulas[index]->GetReferencedCells(),
+                                   formulas[index]->GetReferencedRanges()};
+        } else {
+            new_references[pos] = {};
+        }
+    }
+    CheckCyclicDependencies(new_references);
+    
+    for(size_t i = 0; i < cells.size(); i++) {
+        auto& [pos, text] = cells[i];
+        if(last_indexes.at(pos) != i) {
+            continue;
+        }
+        if(formulas[i] == nullptr) {
+            std::optional<double> number = NumericColumns::ParseLiteral(text);
+            if(number && PrepareNumberStorage(pos)) {
+                InstallNumber(pos, *number, text);
+                continue;
             }
         }
+        std::unique_ptr<Cell> cell = formulas[i] != nullptr
+            ? std::make_unique<Cell>(std::move(formulas[i]), *this)
+            : std::make_unique<Cell>(std::move(text), *this);
+        InstallCell(pos, std::move(cell), new_references.at(pos));
     }
+}
+
+void Sheet::InstallCell(Position pos, std::unique_ptr<Cell> cell,
+                        const FormulaReferences& references) {
+    TRACE_SCOPE("Link");
+    InvalidateDependentCells(pos);
+    RemoveStoredNumber(pos);
     
-    std::unique_ptr<Cell> cell = std::make_unique<Cell>(text, *this);
-    std::unique_ptr<Cell> tmp_cell = std::move(cells_[pos]);
-    cells_[pos] = std::move(cell);
-    for(Position referenced_cell_pos: cells_[pos]->GetReferencedCells()) {
-        if(cells_.find(referenced_cell_pos) == cells_.end()) {
-            cells_[referenced_cell_pos] = std::make_unique<Cell>("", *this);
+    std::unique_ptr<Cell>& current_cell = cells_[pos];
+    if(current_cell != nullptr) {
+        if(profiler_ != nullptr) {
+            profiler_->Forget(current_cell.get());
         }
-        cells_[referenced_cell_pos]->AddReferedCell(pos);
+        UnlinkReferences(pos, *current_cell);
+        ForgetLiteralCell(pos, *current_cell);
+        tile_hashes_.Toggle(pos, current_cell->GetText());
+        cell->SetReferedCells(current_cell->GetReferedCells());
+        if(!current_cell->IsEmpty()) {
+            RemoveFromPrintableArea(pos);
+        }
+    }
+    current_cell = std::move(cell);
+    tile_hashes_.Toggle(pos, current_cell->GetText());
+    if(!current_cell->IsEmpty()) {
+        AddToPrintableArea(pos);
     }
+    if(current_cell->IsFormula()) {
+        formula_rows_[pos.col].insert(pos.row);
+    }
+    aggregates_.Update(pos);
     
-    try {
-        CheckCyclicDependencies(pos);
-    } catch (CircularDependencyException& e) {
-        cells_[pos] = std::move(tmp_cell);
-        throw e;
+    for(Position referenced_cell_pos: references.cells) {
+        if(IsForeignCell(referenced_cell_pos)) {
+            foreign_dependents_[referenced_cell_pos].push_back(pos);
+            continue;
+        }
+        // у числа из колонок нет объекта, в котором хранить зависимые ячейки
+        if(cells_.find(referenced_cell_pos) == cells_.end()) {
+            MaterializeNumber(referenced_cell_pos);
+        }
+        std::unique_ptr<Cell>& referenced_cell = cells_[referenced_cell_pos];
+        if(referenced_cell == nullptr) {
+            referenced_cell = std::make_unique<Cell>("", *this);
+        }
+        referenced_cell->AddReferedCell(pos);
+    }
+    for(const Range& range: references.ranges) {
+        auto& range_dependents = range_dependents_[range];
+        if(range_dependents.empty()) {
+            UpdateRangeCoverage(range, 1);
+        }
+        range_dependents.insert(pos);
+    }
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+    auto it = cells_.find(pos);
+    return it != cells_.end() ? it->second.get() : nullptr;
+}
+
+Cell* Sheet::MaterializeNumber(Position pos) {
+    // содержимое таблицы не меняется: у ячейки тот же текст и то же значение,
+    // меняется только место хранения
+    std::optional<double> number = numbers_.Erase(pos);
+    if(!number.has_value()) {
+        return nullptr;
+    }
+    std::unique_ptr<Cell>& cell = cells_[pos];
+    cell = std::make_unique<Cell>(NumericColumns::FormatLiteral(*number), *this);
+    return cell.get();
+}
+
+bool Sheet::PrepareNumberStorage(Position pos) {
+    const Cell* cell = FindCell(pos);
+    if(cell != nullptr && !cell->GetReferedCells().empty()) {
+        return false;
+    }
+    if(numbers_.HasSegment(pos)) {
+        return true;
+    }
+    if(!numbers_.CountLiteralCell(pos)) {
+        return false;
+    }
+    PromoteSegment(pos);
+    return true;
+}
+
+void Sheet::ForgetLiteralCell(Position pos, const Cell& cell) {
+    if(!cell.IsFormula() && !numbers_.HasSegment(pos) && NumericColumns::ParseLiteral(cell.GetText())) {
+        numbers_.UncountLiteralCell(pos);
+    }
+}
+
+void Sheet::PromoteSegment(Position pos) {
+    const int first_row = pos.row - pos.row % NumericColumns::SEGMENT_ROWS;
+    const int last_row = std::min(first_row + NumericColumns::SEGMENT_ROWS, int{Position::MAX_ROWS});
+    for(int row = first_row; row < last_row; row++) {
+        auto it = cells_.find({row, pos.col});
+        if(it == cells_.end() || it->second->IsFormula() || !it->second->GetReferedCells().empty()) {
+            continue;
+        }
+        // текст, значение и область печати не меняются
+        if(std::optional<double> number = NumericColumns::ParseLiteral(it->second->GetText())) {
+            cells_.erase(it);
+            numbers_.Set({row, pos.col}, *number);
+        }
+    }
+}
+
+void Sheet::InstallNumber(Position pos, double value, std::string_view text) {
+    if(cells_.find(pos) != cells_.end()) {
+        // на ячейку не ссылаются формулы, поэтому она удаляется целиком
+        ClearCell(pos);
+    } else {
+        InvalidateDependentCells(pos);
+        RemoveStoredNumber(pos);
+    }
+    numbers_.Set(pos, value);
+    tile_hashes_.Toggle(pos, text);
+    AddToPrintableArea(pos);
+    aggregates_.Update(pos);
+}
+
+void Sheet::RemoveStoredNumber(Position pos) {
+    if(std::optional<double> number = numbers_.Erase(pos)) {
+        tile_hashes_.Toggle(pos, NumericColumns::FormatLiteral(*number));
+        RemoveFromPrintableArea(pos);
+    }
+}
+
+Cell::ValueView Sheet::GetRangeValue(const Cell& cell) {
+    Cell::ValueView value = cell.GetValueView();
+    if(std::holds_alternative<std::string_view>(value)) {
+        if(std::optional<double> number = NumericColumns::ParseLiteral(std::get<std::string_view>(value))) {
+            return *number;
+        }
+    }
+    return value;
+}
+
+std::optional<double> Sheet::GetStoredNumber(Position pos) const {
+    return numbers_.Find(pos);
+}
+
+void Sheet::UnlinkReferences(Position pos, const Cell& cell) {
+    for(Position referenced_cell_pos: cell.GetReferencedCells()) {
+        if(IsForeignCell(referenced_cell_pos)) {
+            auto it = foreign_dependents_.find(referenced_cell_pos);
+            std::vector<Position>& dependents = it->second;
+            dependents.erase(std::remove(dependents.begin(), dependents.end(), pos), dependents.end());
+            if(dependents.empty()) {
+                foreign_dependents_.erase(it);
+            }
+            continue;
+        }
+        cells_.at(referenced_cell_pos)->RemoveReferedCell(pos);
+    }
+    for(const Range& range: cell.GetReferencedRanges()) {
+        auto it = range_dependents_.find(range);
+        it->second.erase(pos);
+        if(it->second.empty()) {
+            range_dependents_.erase(it);
+            read_ranges_.erase(range);
+            UpdateRangeCoverage(range, -1);
+        }
+    }
+    if(cell.IsFormula()) {
+        auto it = formula_rows_.find(pos.col);
+        it->second.erase(pos.row);
+        if(it->second.empty()) {
+            formula_rows_.erase(it);
+        }
+    }
+}
+
+bool Sheet::IsForeignCell(Position pos) const {
+    return owns_cell_ && !owns_cell_(pos);
+}
+
+void Sheet::UpdateRangeCoverage(const Range& range, int delta) {
+    for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+        std::map<int, int>& segments = range_coverage_[col];
+        // границы области становятся границами отрезков
+        auto split = [&](int row) {
+            auto it = segments.upper_bound(row);
+            const int count = it == segments.begin() ? 0 : std::prev(it)->second;
+            return segments.try_emplace(row, count).first;
+        };
+        auto first = split(range.top_left.row);
+        auto last = split(range.bottom_right.row + 1);
+        for(auto it = first; it != last; ++it) {
+            it->second += delta;
+        }
+        // соседние отрезки с одинаковым числом областей сливаются
+        for(auto it: {first, last}) {
+            const int previous = it == segments.begin() ? 0 : std::prev(it)->second;
+            if(it->second == previous) {
+                segments.erase(it);
+            }
+        }
+        if(segments.empty()) {
+            range_coverage_.erase(col);
+        }
+    }
+}
+
+bool Sheet::IsCoveredByRange(Position pos) const {
+    auto segments = range_coverage_.find(pos.col);
+    if(segments == range_coverage_.end()) {
+        return false;
+    }
+    auto it = segments->second.upper_bound(pos.row);
+    return it != segments->second.begin() && std::prev(it)->second > 0;
+}
+
+void Sheet::InvalidateDependentCells(Position pos) {
+    TRACE_SCOPE("Invalidate");
+    auto it = cells_.find(pos);
+    if(it != cells_.end() && it->second != nullptr) {
+        it->second->InvalidateCache();
     }
     
-    if(pos.col >= size_.cols) {
-        size_.cols = pos.col + 1;
+    // ячейка без кеша не может быть прочитана закешированной формулой, поэтому
+    // обход не идёт дальше ячеек без кеша и ячеек, которые при последнем
+    // вычислении не читали изменённую (невыбранная ветвь IF)
+    std::queue<Position> next_positions;
+    next_positions.push(pos);
+    // сброшенные формулы передаются профилировщику одним вызовом
+    std::vector<const Cell*> invalidated;
+    while (!next_positions.empty()) {
+        Position current_pos = next_positions.front();
+        next_positions.pop();
+        lookup_indexes_.Invalidate(current_pos);
+        
+        // формулы, ссылающиеся на ячейку напрямую
+        const std::vector<Position>* dependents = nullptr;
+        if(auto current = cells_.find(current_pos); current != cells_.end() && current->second != nullptr) {
+            dependents = &current->second->GetReferedCells();
+        } else if(auto foreign = foreign_dependents_.find(current_pos); foreign != foreign_dependents_.end()) {
+            dependents = &foreign->second;
+        }
+        if(dependents != nullptr) {
+            for(auto p: *dependents) {
+                Cell* cell = cells_.at(p).get();
+                if(cell->HasCache() && cell->UsesCell(current_pos)) {
+                    cell->InvalidateCache();
+                    if(profiler_ != nullptr) {
+                        invalidated.push_back(cell);
+                    }
+                    if(invalidation_listener_) {
+                        invalidation_listener_(p);
+                    }
+                    next_positions.push(p);
+                }
+            }
+        }
+        // ячейка могла быть пустой, но всё равно входить в области формул
+        for(auto range = read_ranges_.begin(); range != read_ranges_.end();) {
+            if(!range->Contains(current_pos)) {
+                ++range;
+                continue;
+            }
+            for(Position p: range_dependents_.at(*range)) {
+                Cell* cell = cells_.at(p).get();
+                if(cell->HasCache()) {
+                    cell->InvalidateCache();
+                    if(profiler_ != nullptr) {
+                        invalidated.push_back(cell);
+                    }
+                    if(invalidation_listener_) {
+                        invalidation_listener_(p);
+                    }
+                    next_positions.push(p);
+                }
+            }
+            range = read_ranges_.erase(range);
+        }
     }
-    if(pos.row >= size_.rows) {
-        size_.rows = pos.row + 1;
+    if(!invalidated.empty()) {
+        profiler_->RecordInvalidations(invalidated);
     }
 }
 
+void Sheet::SetDeferredParsing(bool deferred) {
+    deferred_parsing_ = deferred;
+}
+
+bool Sheet::IsDeferredParsing() const {
+    return deferred_parsing_;
+}
+
+std::vector<Position> Sheet::ValidateFormulas() const {
+    std::vector<const Cell*> formulas;
+    std::vector<Position> positions;
+    for(const auto& [col, rows]: formula_rows_) {
+        for(int row: rows) {
+            positions.push_back({row, col});
+            formulas.push_back(cells_.at({row, col}).get());
+        }
+    }
+    // формулы разбираются параллельно, как при SetCells
+    std::vector<char> invalid(formulas.size());
+    ParallelFor(formulas.size(), MIN_FORMULAS_PER_THREAD, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            try {
+                formulas[i]->Validate();
+            } catch (const FormulaException&) {
+                invalid[i] = true;
+            }
+        }
+    });
+
+    std::vector<Position> result;
+    for(size_t i = 0; i < positions.size(); i++) {
+        if(invalid[i]) {
+            result.push_back(positions[i]);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
 const CellInterface* Sheet::GetCell(Position pos) const {
     if(pos.col >= Position::MAX_COLS || pos.row >= Position::MAX_ROWS
       || pos.col < 0 || pos.row < 0) {
         throw InvalidPositionException("Invalid position");
     }
-    if(cells_.find(pos) == cells_.end()) {
-        return nullptr;
+    auto it = cells_.find(pos);
+    if(it != cells_.end()) {
+        return it->second.get();
     }
-    return cells_.at(pos).get();
+    return numbers_.FindCell(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
+    // ячейка-число из колонок не изменяется через CellInterface
+    return const_cast<CellInterface*>(static_cast<const Sheet&>(*this).GetCell(pos));
+}
+
+void Sheet::ClearCell(Position pos) {
     if(pos.col >= Position::MAX_COLS || pos.row >= Position::MAX_ROWS
       || pos.col < 0 || pos.row < 0) {
         throw InvalidPositionException("Invalid position");
     }
-    if(cells_.find(pos) == cells_.end()) {
-        return nullptr;
+    if(numbers_.Find(pos).has_value()) {
+        InvalidateDependentCells(pos);
+        RemoveStoredNumber(pos);
+        aggregates_.Update(pos);
+        return;
+    }
+    auto it = cells_.find(pos);
+    if(it == cells_.end() || it->second == nullptr) {
+        return;
+    }
+    InvalidateDependentCells(pos);
+    if(!it->second->IsEmpty()) {
+        RemoveFromPrintableArea(pos);
     }
-    return cells_.at(pos).get();
+    UnlinkReferences(pos, *it->second);
+    if(profiler_ != nullptr) {
+        profiler_->Forget(it->second.get());
+    }
+    ForgetLiteralCell(pos, *it->second);
+    tile_hashes_.Toggle(pos, it->second->GetText());
+    // на ячейку ссылаются формулы: оставляем пустую ячейку, чтобы не
+    // потерять список зависимых от неё ячеек
+    if(!it->second->GetReferedCells().empty()) {
+        it->second->Clear();
+    } else {
+        cells_.erase(it);
+    }
+    aggregates_.Update(pos);
 }
 
-void Sheet::ClearCell(Position pos) {
-    if(pos.col >= Position::MAX_COLS || pos.row >= Position::MAX_ROWS
-      || pos.col < 0 || pos.row < 0) {
-        throw InvalidPositionException("Invalid position");
+Size Sheet::GetPrintableSize() const {
+    if(row_counts_.empty()) {
+        return {0, 0};
     }
-    cells_.erase(pos);
-    
-    if((pos.row + 1) == size_.rows || (pos.col + 1) == size_.cols) {
-        Size new_size = {0, 0};
-        for(const auto& [pos, _]: cells_) {
-            if(pos.row >= new_size.rows) {
-                new_size.rows = pos.row + 1;
+    return {row_counts_.rbegin()->first + 1, col_counts_.rbegin()->first + 1};
+}
+
+void Sheet::AddToPrintableArea(Position pos) {
+    ++row_counts_[pos.row];
+    ++col_counts_[pos.col];
+}
+
+void Sheet::RemoveFromPrintableArea(Position pos) {
+    auto decrement = [](std::map<int, int>& counts, int key) {
+        auto it = counts.find(key);
+        if(--it->second == 0) {
+            counts.erase(it);
+        }
+    };
+    decrement(row_counts_, pos.row);
+    decrement(col_counts_, pos.col);
+}
+
+const LookupInterface* Sheet::GetLookup() const {
+    return &lookup_indexes_;
+}
+
+const AggregateInterface* Sheet::GetAggregates() const {
+    return &aggregates_;
+}
+
+void Sheet::SetEvaluationSheet(const SheetInterface* sheet) {
+    evaluation_sheet_ = sheet != nullptr ? sheet : this;
+}
+
+const SheetInterface& Sheet::GetEvaluationSheet() const {
+    return *evaluation_sheet_;
+}
+
+void Sheet::SetInvalidationListener(std::function<void(Position)> listener) {
+    invalidation_listener_ = std::move(listener);
+}
+
+void Sheet::SetOwnedCells(std::function<bool(Position)> owns) {
+    owns_cell_ = std::move(owns);
+}
+
+void Sheet::InvalidateCell(Position pos) {
+    InvalidateDependentCells(pos);
+}
+
+const TileHashes& Sheet::GetTileHashes() const {
+    return tile_hashes_;
+}
+
+void Sheet::MarkRangesRead(const std::vector<Range>& ranges) const {
+    read_ranges_.insert(ranges.begin(), ranges.end());
+}
+
+void Sheet::EvaluateFormula(const Cell& cell) const {
+    if(evaluating_ != nullptr) {
+        // вычисляемая формула дошла до формулы без значения в кеше
+        throw PendingEvaluation{this, &cell};
+    }
+    struct Frame {
+        const Cell* cell;
+        std::vector<Position> dependencies;
+        size_t next = 0;
+        int retries = 0;
+    };
+    // формула без функций читает все ячейки, на которые ссылается, поэтому
+    // ждёт все формулы; формула с функциями ждёт только те, до которых
+    // дошло её вычисление, а после MAX_EVALUATION_RETRIES повторов - все
+    auto make_frame = [&](const Cell* formula) {
+        Frame frame{formula, {}};
+        if(!formula->GetFormula()->HasBranches()) {
+            frame.dependencies = GetFormulaDependencies(*formula);
+        }
+        return frame;
+    };
+    // вычисление верхнего уровня измеряется вместе с формулами, которые
+    // для него вычислены
+    std::optional<EvaluationProfiler::Scope> scope;
+    if(profiler_ != nullptr) {
+        scope.emplace(*profiler_, &cell);
+    }
+    std::vector<Frame> stack;
+    stack.push_back(make_frame(&cell));
+    while(!stack.empty()) {
+        Frame& frame = stack.back();
+        if(frame.next < frame.dependencies.size()) {
+            const Cell* next = FindCell(frame.dependencies[frame.next++]);
+            if(next != nullptr && next->IsFormula() && !next->HasCache()) {
+                stack.push_back(make_frame(next));
             }
-            if(pos.col >= new_size.cols) {
-                new_size.cols = pos.col + 1;
+            continue;
+        }
+        if(frame.cell->HasCache()) {
+            stack.pop_back();
+            continue;
+        }
+        evaluating_ = frame.cell;
+        std::optional<EvaluationProfiler::Scope> frame_scope;
+        if(profiler_ != nullptr && frame.cell != &cell) {
+            frame_scope.emplace(*profiler_, frame.cell);
+        }
+        try {
+            frame.cell->Recalculate();
+        } catch (const PendingEvaluation& pending) {
+            evaluating_ = nullptr;
+            if(frame_scope.has_value()) {
+                frame_scope->Abort();
+            }
+            // формула другой таблицы дождётся её в планировщике той таблицы
+            if(pending.sheet != this) {
+                throw;
             }
+            if(++frame.retries > MAX_EVALUATION_RETRIES) {
+                frame.dependencies = GetFormulaDependencies(*frame.cell);
+                frame.next = 0;
+            }
+            stack.push_back(make_frame(pending.cell));
+            continue;
+        } catch (...) {
+            evaluating_ = nullptr;
+            throw;
         }
-        size_ = new_size;
+        evaluating_ = nullptr;
+        stack.pop_back();
     }
 }
 
-Size Sheet::GetPrintableSize() const {
-    return size_;
+void Sheet::PrintValues(std::ostream& output) const {
+    TRACE_SCOPE("PrintValues");
+    const Size size = GetPrintableSize();
+    PrintValueRows(0, size.rows, size, output);
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for(int row_n = 0; row_n < size_.rows; row_n++) {
-        for(int col_n = 0; col_n < size_.cols; col_n++) {
-            if(cells_.find({row_n, col_n}) != cells_.end()) {
-                auto value = cells_.at({row_n, col_n})->GetValue();
-                if(std::holds_alternative<double>(value)) {
-                    output << std::get<double>(value);
-                } else if (std::holds_alternative<std::string>(value)) {
-                    output << std::get<std::string>(value);
-                } else {
-                    output << std::get<FormulaError>(value);
-                }
+void Sheet::PrintValuesParallel(std::ostream& output) const {
+    TRACE_SCOPE("PrintValuesParallel");
+    const Size size = GetPrintableSize();
+    if(static_cast<size_t>(size.rows) * size.cols < PRINT_CHUNK_CELLS) {
+        PrintValueRows(0, size.rows, size, output);
+        return;
+    }
+    // вычисление формул меняет кеши, поэтому идёт до форматирования;
+    // потоки только читают значения
+    for(const auto& [col, rows]: formula_rows_) {
+        if(col >= size.cols) {
+            continue;
+        }
+        for(int row: rows) {
+            if(row < size.rows) {
+                FindCell({row, col})->GetValueView();
             }
-            if(col_n == size_.cols - 1) {
+        }
+    }
+    
+    // части выводятся раундами по одной на поток, чтобы в памяти не
+    // копилась вся выгрузка
+    const int chunk_rows = static_cast<int>(std::max<size_t>(1, PRINT_CHUNK_CELLS / size.cols));
+    const size_t round_chunks = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::stringstream> buffers(round_chunks);
+    for(auto& buffer: buffers) {
+        buffer.copyfmt(output);
+    }
+    for(int round_begin = 0; round_begin < size.rows; ) {
+        const size_t chunks = std::min(round_chunks,
+                                       static_cast<size_t>((size.rows - round_begin + chunk_rows - 1) / chunk_rows));
+        ParallelFor(chunks, 1, [&](size_t begin, size_t end) {
+            TRACE_SCOPE("FormatChunk");
+            for(size_t chunk = begin; chunk < end; chunk++) {
+                const int first_row = round_begin + static_cast<int>(chunk) * chunk_rows;
+                PrintValueRows(first_row, std::min(size.rows, first_row + chunk_rows), size, buffers[chunk]);
+            }
+        });
+        for(size_t chunk = 0; chunk < chunks; chunk++) {
+            output << buffers[chunk].rdbuf();
+            buffers[chunk].str({});
+            buffers[chunk].clear();
+        }
+        round_begin += static_cast<int>(chunks) * chunk_rows;
+    }
+}
+
+void Sheet::PrintValueRows(int first_row, int last_row, Size size, std::ostream& output) const {
+    for(int row_n = first_row; row_n < last_row; row_n++) {
+        for(int col_n = 0; col_n < size.cols; col_n++) {
+            PrintValue({row_n, col_n}, output);
+            if(col_n == size.cols - 1) {
                 output << '\n';
             } else {
                 output << '\t';
@@ -137,12 +710,11 @@ void Sheet::PrintValues(std::ostream& output) const {
     }
 }
 void Sheet::PrintTexts(std::ostream& output) const {
-    for(int row_n = 0; row_n < size_.rows; row_n++) {
-        for(int col_n = 0; col_n < size_.cols; col_n++) {
-            if(cells_.find({row_n, col_n}) != cells_.end()) {
-                output << cells_.at({row_n, col_n})->GetText();
-            }
-            if(col_n == size_.cols - 1) {
+    const Size size = GetPrintableSize();
+    for(int row_n = 0; row_n < size.rows; row_n++) {
+        for(int col_n = 0; col_n < size.cols; col_n++) {
+            PrintText({row_n, col_n}, output);
+            if(col_n == size.cols - 1) {
                 output << '\n';
             } else {
                 output << '\t';
@@ -151,6 +723,26 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
+void Sheet::PrintValue(Position pos, std::ostream& output) const {
+    auto it = cells_.find(pos);
+    if(it != cells_.end()) {
+        std::visit([&](const auto& value) {
+            output << value;
+        }, it->second->GetValueView());
+    } else if(std::optional<double> number = numbers_.Find(pos)) {
+        output << NumericColumns::FormatLiteral(*number);
+    }
+}
+
+void Sheet::PrintText(Position pos, std::ostream& output) const {
+    auto it = cells_.find(pos);
+    if(it != cells_.end()) {
+        output << it->second->GetText();
+    } else if(std::optional<double> number = numbers_.Find(pos)) {
+        output << NumericColumns::FormatLiteral(*number);
+    }
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
@@ -160,44 +752,400 @@ const Cell* Sheet::GetConcreteCell(Position pos) const {
       || pos.col < 0 || pos.row < 0) {
         throw InvalidPositionException("Invalid position");
     }
-    if(cells_.find(pos) == cells_.end()) {
-        return nullptr;
-    }
-    return cells_.at(pos).get();
+    return FindCell(pos);
 }
 
 Cell* Sheet::GetConcreteCell(Position pos) {
-    if(pos.col >= Position::MAX_COLS || pos.row >= Position::MAX_ROWS
-      || pos.col < 0 || pos.row < 0) {
+    return const_cast<Cell*>(static_cast<const Sheet&>(*this).GetConcreteCell(pos));
+}
+
+StringPool& Sheet::GetStringPool() {
+    return strings_;
+}
+
+const std::set<int>* Sheet::GetFormulaRows(int col) const {
+    auto it = formula_rows_.find(col);
+    return it != formula_rows_.end() ? &it->second : nullptr;
+}
+
+std::vector<Position> Sheet::GetDependentCells(Position pos) const {
+    std::vector<Position> dependents;
+    if(const Cell* cell = FindCell(pos)) {
+        dependents = cell->GetReferedCells();
+    } else if(auto it = foreign_dependents_.find(pos); it != foreign_dependents_.end()) {
+        dependents = it->second;
+    }
+    if(!IsCoveredByRange(pos)) {
+        return dependents;
+    }
+    for(const auto& [range, range_dependents]: range_dependents_) {
+        if(range.Contains(pos)) {
+            dependents.insert(dependents.end(), range_dependents.begin(), range_dependents.end());
+        }
+    }
+    return dependents;
+}
+
+const std::map<int, int>& Sheet::GetRowCounts() const {
+    return row_counts_;
+}
+
+const std::map<int, int>& Sheet::GetColCounts() const {
+    return col_counts_;
+}
+
+SheetFork Sheet::Fork() const {
+    return SheetFork(*this);
+}
+
+Size Sheet::ClampRange(Position top_left, Size size) {
+    if(!top_left.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
-    if(cells_.find(pos) == cells_.end()) {
-        return nullptr;
+    size.rows = std::clamp(size.rows, 0, Position::MAX_ROWS - top_left.row);
+    size.cols = std::clamp(size.cols, 0, Position::MAX_COLS - top_left.col);
+    return size;
+}
+
+void Sheet::ReadRange(Position top_left, Size size, RangeBuffer& buffer) const {
+    buffer.size = ClampRange(top_left, size);
+    const size_t area = static_cast<size_t>(buffer.size.rows) * buffer.size.cols;
+    buffer.types.assign(area, RangeBuffer::Type::Empty);
+    buffer.numbers.assign(area, 0);
+    buffer.texts.assign(area, {});
+
+    ReadRange(top_left, buffer.size, [&](Position pos, Cell::ValueView value) {
+        size_t index = static_cast<size_t>(pos.row - top_left.row) * buffer.size.cols
+                       + (pos.col - top_left.col);
+        if(std::holds_alternative<double>(value)) {
+            buffer.types[index] = RangeBuffer::Type::Number;
+            buffer.numbers[index] = std::get<double>(value);
+        } else if(std::holds_alternative<std::string_view>(value)) {
+            std::string_view text = std::get<std::string_view>(value);
+            if(!text.empty()) {
+                buffer.types[index] = RangeBuffer::Type::Text;
+                buffer.texts[index] = text;
+            }
+        } else {
+            buffer.types[index] = RangeBuffer::Type::Error;
+            buffer.texts[index] = std::get<FormulaError>(value).ToString();
+        }
+    });
+}
+
+MemoryUsage Sheet::GetCellMemoryUsage(const Cell& cell) {
+    // узел unordered_map: пара ключ-значение, указатель на следующий узел
+    // и закешированный хеш
+    static constexpr size_t node_size = sizeof(std::pair<const Position, std::unique_ptr<Cell>>)
+                                        + sizeof(void*) + sizeof(size_t);
+    MemoryUsage usage = cell.GetMemoryUsage();
+    usage.storage += node_size;
+    return usage;
+}
+
+MemoryUsage Sheet::GetMemoryUsage() const {
+    MemoryUsage usage;
+    // вспомогательные структуры сами учитывают свой размер
+    usage.storage = sizeof(*this) - sizeof(strings_) - sizeof(numbers_) - sizeof(lookup_indexes_)
+                    - sizeof(aggregates_) - sizeof(tile_hashes_)
+                    + cells_.bucket_count() * sizeof(void*);
+    usage.storage += numbers_.GetMemoryUsage();
+    usage.storage += GetTreeMemoryUsage(row_counts_) + GetTreeMemoryUsage(col_counts_);
+    usage.texts = strings_.GetIndexMemoryUsage();
+    usage.dependencies += GetTreeMemoryUsage(range_dependents_);
+    for(const auto& [range, dependents]: range_dependents_) {
+        usage.dependencies += GetTableMemoryUsage(dependents);
+    }
+    usage.dependencies += GetTreeMemoryUsage(read_ranges_);
+    usage.dependencies += GetTableMemoryUsage(formula_rows_);
+    for(const auto& [col, rows]: formula_rows_) {
+        usage.dependencies += GetTreeMemoryUsage(rows);
+    }
+    usage.dependencies += GetTableMemoryUsage(foreign_dependents_);
+    for(const auto& [pos, dependents]: foreign_dependents_) {
+        usage.dependencies += dependents.capacity() * sizeof(Position);
+    }
+    usage.dependencies += GetTableMemoryUsage(range_coverage_);
+    for(const auto& [col, segments]: range_coverage_) {
+        usage.dependencies += GetTreeMemoryUsage(segments);
+    }
+    usage.caches += lookup_indexes_.GetMemoryUsage() + aggregates_.GetMemoryUsage()
+                    + tile_hashes_.GetMemoryUsage();
+    for(const auto& [pos, cell]: cells_) {
+        if(cell != nullptr) {
+            usage += GetCellMemoryUsage(*cell);
+        }
+    }
+    return usage;
+}
+
+MemoryUsage Sheet::GetMemoryUsage(Position top_left, Size size) const {
+    MemoryUsage usage;
+    for(const auto& [pos, cell]: cells_) {
+        if(cell != nullptr
+          && pos.row >= top_left.row && pos.row < top_left.row + size.rows
+          && pos.col >= top_left.col && pos.col < top_left.col + size.cols) {
+            usage += GetCellMemoryUsage(*cell);
+        }
+    }
+    numbers_.ForEach(top_left, size, [&](Position, double) {
+        usage.storage += sizeof(double);
+    });
+    return usage;
+}
+
+std::map<int, MemoryUsage> Sheet::GetMemoryUsageByRow() const {
+    std::map<int, MemoryUsage> usage;
+    for(const auto& [pos, cell]: cells_) {
+        if(cell != nullptr) {
+            usage[pos.row] += GetCellMemoryUsage(*cell);
+        }
+    }
+    numbers_.ForEach({0, 0}, GetPrintableSize(), [&](Position pos, double) {
+        usage[pos.row].storage += sizeof(double);
+    });
+    return usage;
+}
+
+std::vector<std::pair<Position, size_t>> Sheet::GetLargestFormulas(size_t count) const {
+    std::vector<std::pair<Position, size_t>> formulas;
+    for(const auto& [pos, cell]: cells_) {
+        if(cell != nullptr && cell->IsFormula()) {
+            formulas.emplace_back(pos, cell->GetMemoryUsage().formulas);
+        }
+    }
+    count = std::min(count, formulas.size());
+    std::partial_sort(formulas.begin(), formulas.begin() + count, formulas.end(),
+                      [](const auto& lhs, const auto& rhs) {
+        return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+    });
+    formulas.resize(count);
+    return formulas;
+}
+
+void Sheet::EnableProfiling(uint32_t sample_period) {
+    profiler_ = std::make_unique<EvaluationProfiler>(sample_period);
+}
+
+void Sheet::DisableProfiling() {
+    profiler_.reset();
+}
+
+EvaluationProfiler* Sheet::GetProfiler() const {
+    return profiler_.get();
+}
+
+ProfileReport Sheet::GetProfileReport(size_t count) const {
+    ProfileReport report;
+    if(profiler_ == nullptr) {
+        return report;
+    }
+    const auto profiles = profiler_->GetProfiles();
+    for(const auto& [pos, cell]: cells_) {
+        auto it = cell != nullptr ? profiles.find(cell.get()) : profiles.end();
+        if(it != profiles.end()) {
+            report.hottest.push_back({pos, it->second});
+        }
+    }
+    const size_t hottest_count = std::min(count, report.hottest.size());
+    std::partial_sort(report.hottest.begin(), report.hottest.begin() + hottest_count, report.hottest.end(),
+                      [](const CellProfile& lhs, const CellProfile& rhs) {
+        return lhs.profile.self_time > rhs.profile.self_time
+            || (lhs.profile.self_time == rhs.profile.self_time && lhs.pos < rhs.pos);
+    });
+    report.hottest.resize(hottest_count);
+
+    // длина самой длинной цепочки, которая начинается с формулы, и следующая
+    // формула этой цепочки; считается обходом в глубину без рекурсии
+    struct Chain {
+        size_t length = 0;
+        std::optional<Position> next;
+    };
+    struct Frame {
+        Position pos;
+        std::vector<Position> dependencies;
+        size_t next = 0;
+    };
+    std::unordered_map<Position, Chain, Position::HashFunc> chains;
+    std::vector<Frame> stack;
+    for(const auto& [start_pos, start_cell]: cells_) {
+        if(start_cell == nullptr || !start_cell->IsFormula() || chains.count(start_pos) != 0) {
+            continue;
+        }
+        stack.push_back({start_pos, GetFormulaDependencies(*start_cell)});
+        while(!stack.empty()) {
+            Frame& frame = stack.back();
+            if(frame.next < frame.dependencies.size()) {
+                Position next_pos = frame.dependencies[frame.next++];
+                if(chains.count(next_pos) == 0) {
+                    stack.push_back({next_pos, GetFormulaDependencies(*cells_.at(next_pos))});
+                }
+                continue;
+            }
+            Chain chain{1, std::nullopt};
+            for(Position dependency: frame.dependencies) {
+                const Chain& dependency_chain = chains.at(dependency);
+                if(dependency_chain.length + 1 > chain.length) {
+                    chain = {dependency_chain.length + 1, dependency};
+                }
+            }
+            chains[frame.pos] = chain;
+            stack.pop_back();
+        }
+    }
+
+    std::vector<std::pair<size_t, Position>> starts;
+    for(const auto& [pos, chain]: chains) {
+        starts.emplace_back(chain.length, pos);
+    }
+    const size_t chains_count = std::min(count, starts.size());
+    std::partial_sort(starts.begin(), starts.begin() + chains_count, starts.end(),
+                      [](const auto& lhs, const auto& rhs) {
+        return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+    });
+    for(size_t i = 0; i < chains_count; i++) {
+        std::vector<Position> positions;
+        for(std::optional<Position> pos = starts[i].second; pos; pos = chains.at(*pos).next) {
+            positions.push_back(*pos);
+        }
+        report.longest_chains.push_back(std::move(positions));
+    }
+    return report;
+}
+
+std::vector<Position> Sheet::GetFormulaDependencies(const Cell& cell) const {
+    std::vector<Position> dependencies;
+    for(Position pos: cell.GetReferencedCells()) {
+        const Cell* referenced = FindCell(pos);
+        if(referenced != nullptr && referenced->IsFormula()) {
+            dependencies.push_back(pos);
+        }
     }
-    return cells_.at(pos).get();
+    for(const Range& range: cell.GetReferencedRanges()) {
+        for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+            const std::set<int>* rows = GetFormulaRows(col);
+            if(rows == nullptr) {
+                continue;
+            }
+            for(auto row = rows->lower_bound(range.top_left.row);
+                row != rows->end() && *row <= range.bottom_right.row; ++row) {
+                dependencies.push_back({*row, col});
+            }
+        }
+    }
+    return dependencies;
 }
 
+void Sheet::CheckCyclicDependencies(const References& new_references) const {
+    TRACE_SCOPE("CheckCycles");
+    // строки формул из пачки, которые ссылаются на другие ячейки
+    std::unordered_map<int, std::set<int>> new_formula_rows;
+    for(const auto& [pos, references]: new_references) {
+        if(!references.cells.empty() || !references.ranges.empty()) {
+            new_formula_rows[pos.col].insert(pos.row);
+        }
+    }
+    const std::unordered_map<int, std::set<int>>* formula_rows[] = {&formula_rows_, &new_formula_rows};
 
-void Sheet::CheckCyclicDependencies(Position cell_position) {
-    std::queue<Position> cells_queue;
-    for(auto cell_pos: GetConcreteCell(cell_position)->GetReferencedCells()) {
-        cells_queue.push(cell_pos);
+    // до изменения циклов нет, поэтому цикл проходит через ячейку пачки, на
+    // которую кто-то ссылается. Обход начинается только с таких ячеек: при
+    // добавлении формулы в конец цепочки цепочка заново не просматривается.
+    std::unordered_map<int, std::set<int>> new_rows;
+    for(const auto& [pos, _]: new_references) {
+        new_rows[pos.col].insert(pos.row);
     }
-    std::unordered_set<std::string> visited_cells;
+    std::unordered_set<Position, Position::HashFunc> referenced;
+    std::set<Range> new_ranges;
+    for(const auto& [pos, references]: new_references) {
+        for(Position referenced_pos: references.cells) {
+            if(new_references.count(referenced_pos) != 0) {
+                referenced.insert(referenced_pos);
+            }
+        }
+        new_ranges.insert(references.ranges.begin(), references.ranges.end());
+    }
+    for(const Range& range: new_ranges) {
+        for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+            auto rows = new_rows.find(col);
+            if(rows == new_rows.end()) {
+                continue;
+            }
+            for(auto row = rows->second.lower_bound(range.top_left.row);
+                row != rows->second.end() && *row <= range.bottom_right.row; ++row) {
+                referenced.insert({*row, col});
+            }
+        }
+    }
+    auto has_dependents = [&](Position pos) {
+        if(referenced.count(pos) != 0) {
+            return true;
+        }
+        if(const Cell* cell = FindCell(pos); cell != nullptr && !cell->GetReferedCells().empty()) {
+            return true;
+        }
+        return IsCoveredByRange(pos);
+    };
     
-    while(!cells_queue.empty()) {
-        Position p = cells_queue.front();
-        cells_queue.pop();
-        
-        if(visited_cells.find(p.ToString()) == visited_cells.end()) {
-            for(auto cell_pos: GetConcreteCell(p)->GetReferencedCells()) {
-                cells_queue.push(cell_pos);
+    // ячейки, от которых зависит pos: прямые ссылки и формулы внутри областей
+    auto get_references = [&](Position pos) {
+        std::vector<Position> references;
+        std::vector<Range> ranges;
+        auto it = new_references.find(pos);
+        if(it != new_references.end()) {
+            references = it->second.cells;
+            ranges = it->second.ranges;
+        } else if(const Cell* cell = FindCell(pos)) {
+            references = cell->GetReferencedCells();
+            ranges = cell->GetReferencedRanges();
+        }
+        for(const Range& range: ranges) {
+            for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+                for(const auto* rows_by_col: formula_rows) {
+                    auto rows = rows_by_col->find(col);
+                    if(rows == rows_by_col->end()) {
+                        continue;
+                    }
+                    for(auto row = rows->second.lower_bound(range.top_left.row);
+                        row != rows->second.end() && *row <= range.bottom_right.row; ++row) {
+                        references.push_back({*row, col});
+                    }
+                }
             }
         }
-        visited_cells.insert(p.ToString());
-        
-        if(p == cell_position) {
-            throw CircularDependencyException("Circular dependency exception");
+        return references;
+    };
+    
+    // обход в глубину; цикл есть, если встречается ячейка, обход которой
+    // ещё не завершён
+    enum class State { InProgress, Done };
+    struct Frame {
+        Position pos;
+        std::vector<Position> references;
+        size_t next = 0;
+    };
+    std::unordered_map<Position, State, Position::HashFunc> states;
+    std::vector<Frame> stack;
+    for(const auto& [start_pos, _]: new_references) {
+        if(states.count(start_pos) != 0 || !has_dependents(start_pos)) {
+            continue;
+        }
+        states[start_pos] = State::InProgress;
+        stack.push_back({start_pos, get_references(start_pos)});
+        while(!stack.empty()) {
+            Frame& frame = stack.back();
+            if(frame.next == frame.references.size()) {
+                states[frame.pos] = State::Done;
+                stack.pop_back();
+                continue;
+            }
+            Position next_pos = frame.references[frame.next++];
+            auto it = states.find(next_pos);
+            if(it == states.end()) {
+                states[next_pos] = State::InProgress;
+                stack.push_back({next_pos, get_references(next_pos)});
+            } else if(it->second == State::InProgress) {
+                throw CircularDependencyException("Circular dependency exception");
+            }
         }
     }
-}
\ No newline at end of file
+}
@@ -2,18 +2,62 @@
 
 #include "cell.h"
 #include "common.h"
+#include "evaluation_profiler.h"
+#include "lookup_index.h"
+#include "numeric_columns.h"
+#include "range_aggregates.h"
+#include "sheet_diff.h"
+#include "sheet_fork.h"
+#include "string_pool.h"
 
 #include <functional>
+#include <map>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
+
+// Значения прямоугольной области в колоночном виде. Ячейки хранятся по
+// строкам: ячейка (row, col) области имеет индекс row * size.cols + col.
+struct RangeBuffer {
+    enum class Type : unsigned char { Empty, Text, Number, Error };
+
+    Size size;
+    std::vector<Type> types;
+    std::vector<double> numbers;
+    // текст ячейки или описание ошибки; действителен до изменения таблицы
+    std::vector<std::string_view> texts;
+};
 
 class Sheet : public SheetInterface {
 public:
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
+    // Задаёт содержимое нескольких ячеек как одно изменение. Формулы
+    // разбираются параллельно, затем вся пачка проверяется на циклические
+    // зависимости. Если какая-то формула некорректна или образует цикл,
+    // исключение бросается до изменения таблицы. Если позиция повторяется,
+    // используется последний текст.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+    // Задаёт формулу, разобранную заранее, как SetCell с её текстом
+    void SetFormula(Position pos, std::unique_ptr<FormulaInterface> formula);
 
+    // Для числа из колонок возвращается ячейка-представление из колонок:
+    // чтение ячеек не меняет хранилище
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
+    // Число, если ячейка pos хранится в колонках чисел
+    std::optional<double> GetStoredNumber(Position pos) const;
+
+    // В режиме отложенного разбора SetCell и SetCells не разбирают формулы:
+    // ссылки находятся просмотром текста, и циклы по-прежнему обнаруживаются
+    // сразу, а разбор выполняется при первом вычислении формулы. Синтаксически
+    // некорректная формула принимается, её значение - ошибка #VALUE!.
+    void SetDeferredParsing(bool deferred);
+    bool IsDeferredParsing() const;
+    // Разбирает отложенные формулы и возвращает позиции синтаксически
+    // некорректных по возрастанию
+    std::vector<Position> ValidateFormulas() const;
 
     void ClearCell(Position pos) override;
 
@@ -21,17 +65,243 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // Печатает то же, что PrintValues, байт в байт, для выгрузки больших
+    // таблиц: строки делятся на части, части форматируются параллельно в
+    // свои буферы, и буферы выводятся по порядку. Формулы без значения в
+    // кеше сначала вычисляются в текущем потоке.
+    void PrintValuesParallel(std::ostream& output) const;
+    // Печатают значение или текст одной ячейки, если она есть
+    void PrintValue(Position pos, std::ostream& output) const;
+    void PrintText(Position pos, std::ostream& output) const;
+
+    // Таблица, через которую формулы читают ячейки; по умолчанию эта же.
+    // Позволяет хранить часть ячеек, на которые ссылаются формулы, в других
+    // таблицах.
+    void SetEvaluationSheet(const SheetInterface* sheet);
+    const SheetInterface& GetEvaluationSheet() const;
+    // Вызывается для каждой формулы, значение которой сброшено из кеша
+    // из-за изменения ячеек, от которых она зависит
+    void SetInvalidationListener(std::function<void(Position)> listener);
+    // Позиции, ячейки которых хранит эта таблица; по умолчанию все. Ссылка
+    // формулы на другую позицию не создаёт здесь ячейку: формулы, зависящие
+    // от неё, запоминаются отдельно и сбрасываются через InvalidateCell.
+    void SetOwnedCells(std::function<bool(Position)> owns);
+    // Сбрасывает значения формул, зависящих от ячейки pos, так же, как при
+    // её изменении. Ячейка pos может храниться в другой таблице.
+    void InvalidateCell(Position pos);
 
+    // Индексы столбцов строятся при первом поиске в области и удаляются при
+    // изменении значения любой ячейки внутри неё
+    const LookupInterface* GetLookup() const override;
+    // Формула, ссылающаяся на области ranges, вычислена. Пока её значение в
+    // кеше, изменение ячеек этих областей должно его сбрасывать.
+    void MarkRangesRead(const std::vector<Range>& ranges) const;
+    // Вычисляет формулу cell этой таблицы и кеширует её значение. Формулы без
+    // значения в кеше, которые она читает, вычисляются раньше неё по явному
+    // стеку, поэтому вычисление не уходит в рекурсию по цепочке формул, и её
+    // длина ограничена только памятью. Формулы с функциями читают ячейки
+    // выборочно (невыбранная ветвь IF не читается), поэтому для них
+    // вычисляются только формулы, до которых действительно доходит
+    // вычисление.
+    void EvaluateFormula(const Cell& cell) const;
+    // Агрегаты областей поддерживаются деревьями отрезков по столбцам
+    const AggregateInterface* GetAggregates() const override;
+    // Хеши блоков обновляются при каждом изменении текста ячейки
+    const TileHashes& GetTileHashes() const;
+
+    // Копия таблицы, которая делит с ней ячейки и хранит только свои
+    // изменения. Таблица не должна меняться, пока копия используется.
+    SheetFork Fork() const;
+
+    // Объект ячейки из хранилища ячеек; для числа из колонок - nullptr
+    // (см. GetStoredNumber)
     const Cell* GetConcreteCell(Position pos) const;
     Cell* GetConcreteCell(Position pos);
 
+    StringPool& GetStringPool();
+    // Строки формульных ячеек столбца по возрастанию или nullptr, если
+    // формул в столбце нет
+    const std::set<int>* GetFormulaRows(int col) const;
+    // Формулы, которые ссылаются на ячейку pos напрямую или через области
+    std::vector<Position> GetDependentCells(Position pos) const;
+    // Формулы, которые читает формула cell: прямые ссылки и формулы внутри
+    // областей
+    std::vector<Position> GetFormulaDependencies(const Cell& cell) const;
+    // Количество непустых ячеек в каждой строке и в каждом столбце
+    const std::map<int, int>& GetRowCounts() const;
+    const std::map<int, int>& GetColCounts() const;
+
+    // Передаёт visitor(Position, Cell::ValueView) значения всех ячеек
+    // прямоугольной области, которые есть в хранилище. Строки не копируются,
+    // порядок обхода не определён. Значение-текст, который записывает число
+    // (NumericColumns::ParseLiteral), передаётся числом: так же передаются
+    // числа из колонок, для которых текста в памяти нет.
+    template <typename Visitor>
+    void ReadRange(Position top_left, Size size, Visitor&& visitor) const;
+    // Заполняет буфер значениями области. Память буфера переиспользуется
+    // между вызовами.
+    void ReadRange(Position top_left, Size size, RangeBuffer& buffer) const;
+    // Передаёт visitor(Position) позиции всех ячеек прямоугольной области,
+    // которые есть в хранилище, как ReadRange, но без вычисления формул
+    template <typename Visitor>
+    void ForEachPosition(Position top_left, Size size, Visitor&& visitor) const;
+
+    // Приблизительный объём памяти, занимаемый всей таблицей
+    MemoryUsage GetMemoryUsage() const;
+    // Объём памяти ячеек прямоугольной области
+    MemoryUsage GetMemoryUsage(Position top_left, Size size) const;
+    // Объём памяти ячеек по строкам; строки без ячеек не включаются
+    std::map<int, MemoryUsage> GetMemoryUsageByRow() const;
+    // Формулы, занимающие больше всего памяти, по убыванию размера
+    std::vector<std::pair<Position, size_t>> GetLargestFormulas(size_t count) const;
+
+    // Включает сбор статистики вычислений формул, сбрасывая собранную
+    // раньше. Время измеряется для каждого sample_period-го вычисления.
+    void EnableProfiling(uint32_t sample_period = 1);
+    void DisableProfiling();
+    // nullptr, если статистика не собирается
+    EvaluationProfiler* GetProfiler() const;
+    // count формул с наибольшим собственным временем вычисления и count
+    // самых длинных цепочек зависимых формул
+    ProfileReport GetProfileReport(size_t count) const;
+
 private:
-    void CheckCyclicDependencies(Position cell_position);
-    void MaybeIncreaseSizeToIncludePosition(Position pos);
+    // ячейки и области, на которые ссылается формула
+    struct FormulaReferences {
+        std::vector<Position> cells;
+        std::vector<Range> ranges;
+    };
+    // новые ссылки формул по позициям
+    using References = std::unordered_map<Position, FormulaReferences, Position::HashFunc>;
+
+    // Бросает CircularDependencyException, если после замены ссылок ячеек
+    // на new_references в таблице появится цикл
+    void CheckCyclicDependencies(const References& new_references) const;
+    // Проверяет циклы и заменяет ячейку pos формулой или текстом cell
+    void ReplaceCell(Position pos, std::unique_ptr<Cell> cell);
+    void InstallCell(Position pos, std::unique_ptr<Cell> cell,
+                     const FormulaReferences& references);
+    // Удаляет ячейку pos из списков зависимых ячеек, на которые она ссылается
+    void UnlinkReferences(Position pos, const Cell& cell);
+    // Ячейка pos хранится в другой таблице (см. SetOwnedCells)
+    bool IsForeignCell(Position pos) const;
+    // Меняет на delta число областей, покрывающих ячейки range
+    void UpdateRangeCoverage(const Range& range, int delta);
+    // Ячейка pos лежит внутри области, на которую ссылается формула
+    bool IsCoveredByRange(Position pos) const;
+    void InvalidateDependentCells(Position pos);
+    // Ячейка pos из хранилища ячеек без проверки позиции
+    const Cell* FindCell(Position pos) const;
+    // Переносит число pos из колонок в обычное хранилище, когда на него
+    // начинает ссылаться формула; nullptr, если числа там нет
+    Cell* MaterializeNumber(Position pos);
+    // Число можно записать в ячейку pos в колонки: на ячейку не ссылаются
+    // формулы, и блок уже в колонках или его пора туда перевести
+    bool PrepareNumberStorage(Position pos);
+    // Переносит в колонки числа блока ячейки pos, на которые не ссылаются
+    // формулы
+    void PromoteSegment(Position pos);
+    // Ячейка cell удаляется из хранилища; ячейка-число больше не учитывается
+    // для перевода её блока в колонки
+    void ForgetLiteralCell(Position pos, const Cell& cell);
+    void InstallNumber(Position pos, double value, std::string_view text);
+    void RemoveStoredNumber(Position pos);
+    static Cell::ValueView GetRangeValue(const Cell& cell);
+    void AddToPrintableArea(Position pos);
+    void RemoveFromPrintableArea(Position pos);
+    // Печатает значения строк [first_row, last_row) области size
+    void PrintValueRows(int first_row, int last_row, Size size, std::ostream& output) const;
     void PrintCells(std::ostream& output,
                     const std::function<void(const CellInterface&)>& printCell) const;
     Size GetActualSize() const;
+    static MemoryUsage GetCellMemoryUsage(const Cell& cell);
+    static Size ClampRange(Position top_left, Size size);
+    // Передаёт visitor(Position, const Cell&) ячейки хранилища внутри уже
+    // ограниченной области
+    template <typename Visitor>
+    void ForEachStoredCell(Position top_left, Size size, Visitor&& visitor) const;
 
+    // объявлен до ячеек: ячейки освобождают свои строки при удалении
+    StringPool strings_;
     std::unordered_map<Position, std::unique_ptr<Cell>, Position::HashFunc> cells_;
-    Size size_;
-};
\ No newline at end of file
+    // числа, которые хранятся без объектов ячеек; позиция хранится либо в
+    // cells_, либо здесь
+    NumericColumns numbers_;
+    // количество непустых ячеек в каждой строке и в каждом столбце;
+    // пустые строки и столбцы не хранятся
+    std::map<int, int> row_counts_;
+    std::map<int, int> col_counts_;
+    // формулы, ссылающиеся на каждую область; изменение ячейки внутри
+    // области сбрасывает их значения
+    std::map<Range, std::unordered_set<Position, Position::HashFunc>> range_dependents_;
+    // области, зависимые формулы которых могут хранить значения в кеше; при
+    // массовой загрузке таблицы это множество пусто, и изменение ячейки не
+    // просматривает формулы, ещё ни разу не вычисленные
+    mutable std::set<Range> read_ranges_;
+    // строки формульных ячеек по столбцам: при проверке циклов по ним
+    // находятся формулы внутри областей без обхода всех ячеек области
+    std::unordered_map<int, std::set<int>> formula_rows_;
+    // число областей из range_dependents_, покрывающих строки столбца: ключ -
+    // первая строка отрезка, значение - число областей до следующего ключа;
+    // непокрытые столбцы не хранятся
+    std::unordered_map<int, std::map<int, int>> range_coverage_;
+    LookupIndexCache lookup_indexes_{*this};
+    SheetAggregates aggregates_{*this};
+    TileHashes tile_hashes_;
+    bool deferred_parsing_ = false;
+    std::unique_ptr<EvaluationProfiler> profiler_;
+    const SheetInterface* evaluation_sheet_ = this;
+    std::function<void(Position)> invalidation_listener_;
+    std::function<bool(Position)> owns_cell_;
+    // формулы, ссылающиеся на каждую ячейку другой таблицы
+    std::unordered_map<Position, std::vector<Position>, Position::HashFunc> foreign_dependents_;
+    // формула, которую сейчас вычисляет EvaluateFormula, или nullptr
+    mutable const Cell* evaluating_ = nullptr;
+};
+
+template <typename Visitor>
+void Sheet::ReadRange(Position top_left, Size size, Visitor&& visitor) const {
+    size = ClampRange(top_left, size);
+    ForEachStoredCell(top_left, size, [&](Position pos, const Cell& cell) {
+        visitor(pos, GetRangeValue(cell));
+    });
+    numbers_.ForEach(top_left, size, [&](Position pos, double value) {
+        visitor(pos, Cell::ValueView(value));
+    });
+}
+
+template <typename Visitor>
+void Sheet::ForEachPosition(Position top_left, Size size, Visitor&& visitor) const {
+    size = ClampRange(top_left, size);
+    ForEachStoredCell(top_left, size, [&](Position pos, const Cell&) {
+        visitor(pos);
+    });
+    numbers_.ForEach(top_left, size, [&](Position pos, double) {
+        visitor(pos);
+    });
+}
+
+template <typename Visitor>
+void Sheet::ForEachStoredCell(Position top_left, Size size, Visitor&& visitor) const {
+    const size_t area = static_cast<size_t>(size.rows) * size.cols;
+    // для небольшой области дешевле найти каждую её позицию, для большой -
+    // один раз пройти по всем ячейкам хранилища
+    if(area < cells_.size()) {
+        for(int row = top_left.row; row < top_left.row + size.rows; row++) {
+            for(int col = top_left.col; col < top_left.col + size.cols; col++) {
+                auto it = cells_.find({row, col});
+                if(it != cells_.end() && it->second != nullptr) {
+                    visitor(it->first, *it->second);
+                }
+            }
+        }
+    } else {
+        for(const auto& [pos, cell]: cells_) {
+            if(cell != nullptr
+              && pos.row >= top_left.row && pos.row < top_left.row + size.rows
+              && pos.col >= top_left.col && pos.col < top_left.col + size.cols) {
+                visitor(pos, *cell);
+            }
+        }
+    }
+}
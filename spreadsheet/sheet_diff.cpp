@@ -0,0 +1,109 @@
+#include "sheet_diff.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace {
+// перемешивание splitmix64: соседние позиции дают непохожие хеши
+uint64_t Mix(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+uint64_t HashCell(Position pos, std::string_view text) {
+    const uint64_t position = (static_cast<uint64_t>(pos.row) << 32) | static_cast<uint32_t>(pos.col);
+    return Mix(Mix(position) ^ std::hash<std::string_view>{}(text));
+}
+
+// позиции ячеек таблицы внутри блока
+void CollectTileCells(const Sheet& sheet, Position tile, std::vector<Position>& positions) {
+    sheet.ForEachPosition(tile, {TileHashes::TILE_SIZE, TileHashes::TILE_SIZE}, [&](Position pos) {
+        positions.push_back(pos);
+    });
+}
+
+std::string GetText(const Sheet& sheet, Position pos) {
+    if(std::optional<double> number = sheet.GetStoredNumber(pos)) {
+        return NumericColumns::FormatLiteral(*number);
+    }
+    const Cell* cell = sheet.GetConcreteCell(pos);
+    return cell != nullptr ? cell->GetText() : std::string();
+}
+}  // namespace
+
+void TileHashes::Toggle(Position pos, std::string_view text) {
+    if(text.empty()) {
+        return;
+    }
+    auto it = hashes_.try_emplace(GetKey(pos), 0).first;
+    it->second ^= HashCell(pos, text);
+    if(it->second == 0) {
+        hashes_.erase(it);
+    }
+}
+
+uint64_t TileHashes::GetHash(Position pos) const {
+    auto it = hashes_.find(GetKey(pos));
+    return it != hashes_.end() ? it->second : 0;
+}
+
+std::vector<Position> TileHashes::GetTiles() const {
+    std::vector<Position> tiles;
+    tiles.reserve(hashes_.size());
+    for(const auto& [key, hash]: hashes_) {
+        tiles.push_back({static_cast<int>(key >> 32) * TILE_SIZE,
+                         static_cast<int>(key & 0xffffffff) * TILE_SIZE});
+    }
+    return tiles;
+}
+
+size_t TileHashes::GetMemoryUsage() const {
+    // узел unordered_map: пара ключ-значение, указатель на следующий узел
+    // и закешированный хеш
+    static constexpr size_t node_size = sizeof(std::pair<const uint64_t, uint64_t>)
+                                        + sizeof(void*) + sizeof(size_t);
+    return sizeof(*this) + hashes_.size() * node_size + hashes_.bucket_count() * sizeof(void*);
+}
+
+uint64_t TileHashes::GetKey(Position pos) {
+    return (static_cast<uint64_t>(pos.row / TILE_SIZE) << 32) | static_cast<uint32_t>(pos.col / TILE_SIZE);
+}
+
+SheetPatch DiffSheets(const Sheet& from, const Sheet& to) {
+    const TileHashes& from_hashes = from.GetTileHashes();
+    const TileHashes& to_hashes = to.GetTileHashes();
+    std::vector<Position> tiles = from_hashes.GetTiles();
+    const std::vector<Position> to_tiles = to_hashes.GetTiles();
+    tiles.insert(tiles.end(), to_tiles.begin(), to_tiles.end());
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+
+    SheetPatch patch;
+    std::vector<Position> positions;
+    for(Position tile: tiles) {
+        if(from_hashes.GetHash(tile) == to_hashes.GetHash(tile)) {
+            continue;
+        }
+        positions.clear();
+        CollectTileCells(from, tile, positions);
+        CollectTileCells(to, tile, positions);
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+        for(Position pos: positions) {
+            std::string text = GetText(to, pos);
+            if(text != GetText(from, pos)) {
+                patch.emplace_back(pos, std::move(text));
+            }
+        }
+    }
+    std::sort(patch.begin(), patch.end());
+    return patch;
+}
+
+void ApplyPatch(Sheet& sheet, SheetPatch patch) {
+    sheet.SetCells(std::move(patch));
+}
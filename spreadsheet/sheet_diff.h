@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Хеши квадратных блоков таблицы. Хеш блока - XOR хешей позиций и текстов
+// его непустых ячеек, поэтому при изменении ячейки он пересчитывается за
+// O(1), а у одинаковых блоков разных таблиц хеши совпадают.
+class TileHashes {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    // Добавляет в хеш блока ячейку pos с текстом text или убирает её оттуда
+    void Toggle(Position pos, std::string_view text);
+    // Хеш блока, в который входит pos; у блока без ячеек он равен 0
+    uint64_t GetHash(Position pos) const;
+    // Левые верхние углы блоков с ячейками
+    std::vector<Position> GetTiles() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    static uint64_t GetKey(Position pos);
+
+    std::unordered_map<uint64_t, uint64_t> hashes_;
+};
+
+// Изменения ячеек: текст, который нужно задать, пустой текст очищает ячейку
+using SheetPatch = std::vector<std::pair<Position, std::string>>;
+
+// Изменения, которые превращают таблицу from в таблицу to, по возрастанию
+// позиций. Блоки с одинаковыми хешами пропускаются без обхода их ячеек.
+SheetPatch DiffSheets(const Sheet& from, const Sheet& to);
+
+// Применяет изменения одним вызовом SetCells: если какая-то формула
+// некорректна или образует цикл, таблица не меняется
+void ApplyPatch(Sheet& sheet, SheetPatch patch);
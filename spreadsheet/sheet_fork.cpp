@@ -0,0 +1,543 @@
+#include "sheet_fork.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <ostream>
+#include <queue>
+
+namespace {
+// повторов вычисления формулы с функциями, после которых она ждёт все
+// формулы, на которые ссылается (как в Sheet::EvaluateFormula)
+constexpr int MAX_EVALUATION_RETRIES = 4;
+}  // namespace
+
+SheetFork::SheetFork(const Sheet& parent)
+    : parent_(parent) {
+}
+
+SheetFork::~SheetFork() {}
+
+void SheetFork::SetCell(Position pos, std::string text) {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    std::unique_ptr<FormulaInterface> formula;
+    if(Cell::IsFormulaText(text)) {
+        formula = ParseFormula(text.substr(1));
+        CheckCyclicDependencies(pos, *formula);
+    }
+    auto cell = std::make_unique<ForkCell>(*this, std::move(text), std::move(formula));
+
+    const std::string old_text = GetCurrentText(pos);
+    std::unique_ptr<ForkCell>& current = edits_[pos];
+    if(current != nullptr) {
+        Link(pos, *current, false);
+    }
+    recalculated_.erase(pos);
+    current = std::move(cell);
+    AddOwnCell(pos);
+    Link(pos, *current, true);
+    UpdatePrintableArea(pos, old_text, current->GetText());
+    InvalidateDependentCells(pos);
+}
+
+const CellInterface* SheetFork::GetCell(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    if(auto it = edits_.find(pos); it != edits_.end()) {
+        return it->second->IsEmpty() ? nullptr : it->second.get();
+    }
+    if(auto it = recalculated_.find(pos); it != recalculated_.end()) {
+        return it->second.get();
+    }
+    return parent_.GetCell(pos);
+}
+
+CellInterface* SheetFork::GetCell(Position pos) {
+    return const_cast<CellInterface*>(static_cast<const SheetFork&>(*this).GetCell(pos));
+}
+
+void SheetFork::ClearCell(Position pos) {
+    SetCell(pos, std::string());
+}
+
+Size SheetFork::GetPrintableSize() const {
+    // последняя строка или столбец, в которых остались непустые ячейки
+    auto last = [](const std::map<int, int>& counts, const std::map<int, int>& deltas) {
+        auto count = [&](int key) {
+            auto it = counts.find(key);
+            auto delta = deltas.find(key);
+            return (it != counts.end() ? it->second : 0) + (delta != deltas.end() ? delta->second : 0);
+        };
+        int result = -1;
+        for(auto it = counts.rbegin(); it != counts.rend(); ++it) {
+            if(count(it->first) > 0) {
+                result = it->first;
+                break;
+            }
+        }
+        for(auto it = deltas.rbegin(); it != deltas.rend() && it->first > result; ++it) {
+            if(count(it->first) > 0) {
+                result = it->first;
+                break;
+            }
+        }
+        return result + 1;
+    };
+    Size size{last(parent_.GetRowCounts(), row_deltas_), last(parent_.GetColCounts(), col_deltas_)};
+    if(size.rows == 0 || size.cols == 0) {
+        return {0, 0};
+    }
+    return size;
+}
+
+template <typename Print, typename PrintParent>
+void SheetFork::PrintCells(std::ostream& output, Print print, PrintParent print_parent) const {
+    const Size size = GetPrintableSize();
+    for(int row_n = 0; row_n < size.rows; row_n++) {
+        for(int col_n = 0; col_n < size.cols; col_n++) {
+            const Position pos{row_n, col_n};
+            if(auto it = edits_.find(pos); it != edits_.end()) {
+                if(!it->second->IsEmpty()) {
+                    print(*it->second);
+                }
+            } else if(auto it = recalculated_.find(pos); it != recalculated_.end()) {
+                print(*it->second);
+            } else {
+                print_parent(pos);
+            }
+            if(col_n == size.cols - 1) {
+                output << '\n';
+            } else {
+                output << '\t';
+            }
+        }
+    }
+}
+
+void SheetFork::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&](const CellInterface& cell) {
+        std::visit([&](const auto& value) {
+            output << value;
+        }, cell.GetValue());
+    }, [&](Position pos) {
+        parent_.PrintValue(pos, output);
+    });
+}
+
+void SheetFork::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&](const CellInterface& cell) {
+        output << cell.GetText();
+    }, [&](Position pos) {
+        parent_.PrintText(pos, output);
+    });
+}
+
+const LookupInterface* SheetFork::GetLookup() const {
+    return this;
+}
+
+const AggregateInterface* SheetFork::GetAggregates() const {
+    return this;
+}
+
+std::optional<int> SheetFork::Find(Range column, double key, Match match) const {
+    if(!HasOwnCells(column)) {
+        return parent_.GetLookup()->Find(column, key, match);
+    }
+    auto it = lookup_indexes_.find(column);
+    if(it == lookup_indexes_.end()) {
+        // ключи собираются до изменения кеша: чтение формулы может прервать
+        // построение
+        std::vector<std::optional<double>> keys(column.GetSize().rows);
+        for(int row = column.top_left.row; row <= column.bottom_right.row; row++) {
+            if(const CellInterface* cell = GetCell({row, column.top_left.col})) {
+                keys[row - column.top_left.row] = ToLookupKey(cell->GetValue());
+            }
+        }
+        it = lookup_indexes_.emplace(column, ColumnIndex(std::move(keys))).first;
+    }
+    return it->second.Find(key, match);
+}
+
+RangeAggregate SheetFork::Aggregate(Range range) const {
+    const AggregateInterface& parent_aggregates = *parent_.GetAggregates();
+    if(!HasOwnCells(range)) {
+        return parent_aggregates.Aggregate(range);
+    }
+    RangeAggregate result;
+    for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+        // отрезки исходной таблицы между ячейками копии
+        int first_row = range.top_left.row;
+        if(auto rows = own_rows_.find(col); rows != own_rows_.end()) {
+            for(auto row = rows->second.lower_bound(range.top_left.row);
+                row != rows->second.end() && *row <= range.bottom_right.row; ++row) {
+                if(first_row < *row) {
+                    result.Merge(parent_aggregates.Aggregate({{first_row, col}, {*row - 1, col}}));
+                }
+                first_row = *row + 1;
+                const CellInterface::Value value = FindForkCell({*row, col})->GetValue();
+                if(std::holds_alternative<FormulaError>(value)) {
+                    throw std::get<FormulaError>(value);
+                }
+                if(std::optional<double> number = ToLookupKey(value)) {
+                    result.Add(*number);
+                }
+            }
+        }
+        if(first_row <= range.bottom_right.row) {
+            result.Merge(parent_aggregates.Aggregate({{first_row, col}, {range.bottom_right.row, col}}));
+        }
+    }
+    return result;
+}
+
+void SheetFork::EvaluateFormula(const ForkCell& cell) const {
+    if(evaluating_ != nullptr) {
+        // вычисляемая формула дошла до формулы копии без значения в кеше
+        throw PendingEvaluation{this, &cell};
+    }
+    struct Frame {
+        const ForkCell* cell;
+        std::vector<Position> dependencies;
+        size_t next = 0;
+        int retries = 0;
+    };
+    auto get_dependencies = [&](const ForkCell& formula) {
+        return GetFormulaReferences(formula.GetReferencedCells(), formula.GetReferencedRanges());
+    };
+    // формула без функций ждёт все ячейки, на которые ссылается; формула с
+    // функциями - только те, до которых дошло её вычисление
+    auto make_frame = [&](const ForkCell* formula) {
+        Frame frame{formula, {}};
+        if(!formula->HasBranches()) {
+            frame.dependencies = get_dependencies(*formula);
+        }
+        return frame;
+    };
+    std::vector<Frame> stack;
+    stack.push_back(make_frame(&cell));
+    while(!stack.empty()) {
+        Frame& frame = stack.back();
+        if(frame.next < frame.dependencies.size()) {
+            const ForkCell* next = FindForkCell(frame.dependencies[frame.next++]);
+            if(next != nullptr && next->IsFormula() && !next->HasCache()) {
+                stack.push_back(make_frame(next));
+            }
+            continue;
+        }
+        if(frame.cell->HasCache()) {
+            stack.pop_back();
+            continue;
+        }
+        evaluating_ = frame.cell;
+        try {
+            frame.cell->Recalculate();
+        } catch (const PendingEvaluation& pending) {
+            evaluating_ = nullptr;
+            if(pending.fork != this) {
+                throw;
+            }
+            if(++frame.retries > MAX_EVALUATION_RETRIES) {
+                frame.dependencies = get_dependencies(*frame.cell);
+                frame.next = 0;
+            }
+            stack.push_back(make_frame(pending.cell));
+            continue;
+        } catch (...) {
+            evaluating_ = nullptr;
+            throw;
+        }
+        evaluating_ = nullptr;
+        stack.pop_back();
+    }
+}
+
+const SheetFork::ForkCell* SheetFork::FindForkCell(Position pos) const {
+    if(auto it = edits_.find(pos); it != edits_.end()) {
+        return it->second.get();
+    }
+    if(auto it = recalculated_.find(pos); it != recalculated_.end()) {
+        return it->second.get();
+    }
+    return nullptr;
+}
+
+bool SheetFork::HasOwnCells(const Range& range) const {
+    for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+        auto rows = own_rows_.find(col);
+        if(rows == own_rows_.end()) {
+            continue;
+        }
+        auto row = rows->second.lower_bound(range.top_left.row);
+        if(row != rows->second.end() && *row <= range.bottom_right.row) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SheetFork::AddOwnCell(Position pos) {
+    own_rows_[pos.col].insert(pos.row);
+}
+
+void SheetFork::InvalidateLookupIndexes(Position pos) {
+    for(auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+        if(it->first.Contains(pos)) {
+            it = lookup_indexes_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+size_t SheetFork::GetRecalculatedCount() const {
+    return recalculated_.size();
+}
+
+std::string SheetFork::GetCurrentText(Position pos) const {
+    const CellInterface* cell = GetCell(pos);
+    return cell != nullptr ? cell->GetText() : std::string();
+}
+
+bool SheetFork::IsFormulaAt(Position pos) const {
+    if(auto it = edits_.find(pos); it != edits_.end()) {
+        return it->second->IsFormula();
+    }
+    const Cell* cell = parent_.GetConcreteCell(pos);
+    return cell != nullptr && cell->IsFormula();
+}
+
+std::vector<Position> SheetFork::GetFormulaReferences(const std::vector<Position>& cells,
+                                                      const std::vector<Range>& ranges) const {
+    std::vector<Position> references = cells;
+    for(const Range& range: ranges) {
+        for(int col = range.top_left.col; col <= range.bottom_right.col; col++) {
+            auto fork_rows = formula_rows_.find(col);
+            const std::set<int>* rows_by_sheet[] = {
+                parent_.GetFormulaRows(col),
+                fork_rows != formula_rows_.end() ? &fork_rows->second : nullptr,
+            };
+            for(const std::set<int>* rows: rows_by_sheet) {
+                if(rows == nullptr) {
+                    continue;
+                }
+                for(auto row = rows->lower_bound(range.top_left.row);
+                    row != rows->end() && *row <= range.bottom_right.row; ++row) {
+                    if(IsFormulaAt({*row, col})) {
+                        references.push_back({*row, col});
+                    }
+                }
+            }
+        }
+    }
+    return references;
+}
+
+void SheetFork::CheckCyclicDependencies(Position pos, const FormulaInterface& formula) const {
+    auto get_references = [&](Position current) {
+        std::vector<Position> cells;
+        std::vector<Range> ranges;
+        if(current == pos) {
+            cells = formula.GetReferencedCells();
+            ranges = formula.GetReferencedRanges();
+        } else if(auto it = edits_.find(current); it != edits_.end()) {
+            cells = it->second->GetReferencedCells();
+            ranges = it->second->GetReferencedRanges();
+        } else if(const Cell* cell = parent_.GetConcreteCell(current)) {
+            cells = cell->GetReferencedCells();
+            ranges = cell->GetReferencedRanges();
+        }
+        std::vector<Position> references = GetFormulaReferences(cells, ranges);
+        // новая формула ещё не значится среди формул столбца
+        for(const Range& range: ranges) {
+            if(range.Contains(pos)) {
+                references.push_back(pos);
+            }
+        }
+        return references;
+    };
+
+    // граф без новой формулы ацикличен, поэтому цикл может пройти только
+    // через pos
+    std::unordered_set<Position, Position::HashFunc> visited;
+    std::vector<Position> stack = get_references(pos);
+    while(!stack.empty()) {
+        Position current = stack.back();
+        stack.pop_back();
+        if(current == pos) {
+            throw CircularDependencyException("Circular dependency exception");
+        }
+        if(!visited.insert(current).second) {
+            continue;
+        }
+        for(Position next: get_references(current)) {
+            stack.push_back(next);
+        }
+    }
+}
+
+void SheetFork::Link(Position pos, const ForkCell& cell, bool add) {
+    for(Position referenced: cell.GetReferencedCells()) {
+        if(add) {
+            dependents_[referenced].insert(pos);
+        } else if(auto it = dependents_.find(referenced); it != dependents_.end()) {
+            it->second.erase(pos);
+            if(it->second.empty()) {
+                dependents_.erase(it);
+            }
+        }
+    }
+    for(const Range& range: cell.GetReferencedRanges()) {
+        if(add) {
+            range_dependents_[range].insert(pos);
+        } else if(auto it = range_dependents_.find(range); it != range_dependents_.end()) {
+            it->second.erase(pos);
+            if(it->second.empty()) {
+                range_dependents_.erase(it);
+            }
+        }
+    }
+    if(cell.IsFormula()) {
+        if(add) {
+            formula_rows_[pos.col].insert(pos.row);
+        } else if(auto it = formula_rows_.find(pos.col); it != formula_rows_.end()) {
+            it->second.erase(pos.row);
+            if(it->second.empty()) {
+                formula_rows_.erase(it);
+            }
+        }
+    }
+}
+
+void SheetFork::InvalidateDependentCells(Position pos) {
+    std::unordered_set<Position, Position::HashFunc> visited{pos};
+    std::queue<Position> next_positions;
+    next_positions.push(pos);
+    auto invalidate = [&](Position dependent) {
+        if(!visited.insert(dependent).second) {
+            return;
+        }
+        if(auto it = edits_.find(dependent); it != edits_.end()) {
+            it->second->InvalidateCache();
+        } else if(auto it = recalculated_.find(dependent); it != recalculated_.end()) {
+            it->second->InvalidateCache();
+        } else {
+            recalculated_.emplace(dependent, std::make_unique<ForkCell>(*this, *parent_.GetConcreteCell(dependent)));
+            AddOwnCell(dependent);
+        }
+        next_positions.push(dependent);
+    };
+
+    while(!next_positions.empty()) {
+        Position current = next_positions.front();
+        next_positions.pop();
+        InvalidateLookupIndexes(current);
+        // формулы исходной таблицы, заменённые в копии, больше не зависят от
+        // своих ячеек; за формулами копии следят её собственные списки
+        for(Position dependent: parent_.GetDependentCells(current)) {
+            if(edits_.count(dependent) == 0) {
+                invalidate(dependent);
+            }
+        }
+        if(auto it = dependents_.find(current); it != dependents_.end()) {
+            for(Position dependent: it->second) {
+                invalidate(dependent);
+            }
+        }
+        for(const auto& [range, dependents]: range_dependents_) {
+            if(range.Contains(current)) {
+                for(Position dependent: dependents) {
+                    invalidate(dependent);
+                }
+            }
+        }
+    }
+}
+
+void SheetFork::UpdatePrintableArea(Position pos, const std::string& old_text, const std::string& new_text) {
+    const int delta = static_cast<int>(!new_text.empty()) - static_cast<int>(!old_text.empty());
+    if(delta == 0) {
+        return;
+    }
+    for(auto [deltas, key]: {std::pair{&row_deltas_, pos.row}, std::pair{&col_deltas_, pos.col}}) {
+        auto it = deltas->try_emplace(key, 0).first;
+        it->second += delta;
+        if(it->second == 0) {
+            deltas->erase(it);
+        }
+    }
+}
+
+SheetFork::ForkCell::ForkCell(const SheetFork& fork, std::string text,
+                              std::unique_ptr<FormulaInterface> formula)
+    : fork_(fork)
+    , text_(std::move(text))
+    , own_formula_(std::move(formula))
+    , formula_(own_formula_.get()) {
+}
+
+SheetFork::ForkCell::ForkCell(const SheetFork& fork, const Cell& parent)
+    : fork_(fork)
+    , parent_(&parent)
+    , formula_(parent.GetFormula()) {
+}
+
+CellInterface::Value SheetFork::ForkCell::GetValue() const {
+    if(formula_ == nullptr) {
+        if(!text_.empty() && text_[0] == ESCAPE_SIGN) {
+            return text_.substr(1);
+        }
+        return text_;
+    }
+    if(!cache_.has_value()) {
+        fork_.EvaluateFormula(*this);
+    }
+    return *cache_;
+}
+
+std::string SheetFork::ForkCell::GetText() const {
+    if(parent_ != nullptr) {
+        return parent_->GetText();
+    }
+    if(own_formula_ != nullptr) {
+        return FORMULA_SIGN + own_formula_->GetExpression();
+    }
+    return text_;
+}
+
+std::vector<Position> SheetFork::ForkCell::GetReferencedCells() const {
+    return formula_ != nullptr ? formula_->GetReferencedCells() : std::vector<Position>();
+}
+
+std::vector<Range> SheetFork::ForkCell::GetReferencedRanges() const {
+    return formula_ != nullptr ? formula_->GetReferencedRanges() : std::vector<Range>();
+}
+
+bool SheetFork::ForkCell::IsFormula() const {
+    return formula_ != nullptr;
+}
+
+bool SheetFork::ForkCell::IsEmpty() const {
+    return formula_ == nullptr && text_.empty();
+}
+
+bool SheetFork::ForkCell::HasBranches() const {
+    return formula_ != nullptr && formula_->HasBranches();
+}
+
+bool SheetFork::ForkCell::HasCache() const {
+    return cache_.has_value();
+}
+
+void SheetFork::ForkCell::Recalculate() const {
+    cache_ = std::visit([](const auto& value) -> Value {
+        return value;
+    }, formula_->Evaluate(fork_));
+}
+
+void SheetFork::ForkCell::InvalidateCache() {
+    cache_.reset();
+}
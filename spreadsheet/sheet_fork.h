@@ -0,0 +1,142 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "lookup_index.h"
+#include "range_aggregates.h"
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+class Cell;
+class Sheet;
+
+// Копия таблицы для сценариев "что если". Создание копии ничего не
+// копирует: ячейки, разобранные формулы, граф зависимостей и вычисленные
+// значения остаются в исходной таблице, а копия хранит только свои
+// изменения. Формулы исходной таблицы, которые зависят от изменённых в
+// копии ячеек, вычисляются в копии заново тем же разобранным выражением;
+// значения остальных ячеек берутся из кеша исходной таблицы. Исходная
+// таблица не должна меняться, пока существует копия.
+class SheetFork : public SheetInterface, private LookupInterface, private AggregateInterface {
+public:
+    explicit SheetFork(const Sheet& parent);
+    ~SheetFork();
+
+    SheetFork(SheetFork&&) = default;
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Поиск и агрегаты областей без ячеек копии выполняются индексами
+    // исходной таблицы. Для областей с ячейками копии агрегаты собираются из
+    // агрегатов исходной таблицы между ними, а индексы столбцов строятся в
+    // копии и удаляются при изменении значения ячейки внутри области.
+    const LookupInterface* GetLookup() const override;
+    const AggregateInterface* GetAggregates() const override;
+
+    // Количество формул исходной таблицы, которые вычисляются в копии заново
+    size_t GetRecalculatedCount() const;
+
+private:
+    class ForkCell : public CellInterface {
+    public:
+        // ячейка, заданная в копии
+        ForkCell(const SheetFork& fork, std::string text, std::unique_ptr<FormulaInterface> formula);
+        // формула исходной таблицы, которая вычисляется в копии
+        ForkCell(const SheetFork& fork, const Cell& parent);
+
+        // значение формулы без кеша вычисляет планировщик копии
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        std::vector<Range> GetReferencedRanges() const;
+
+        bool IsFormula() const;
+        bool IsEmpty() const;
+        bool HasBranches() const;
+        bool HasCache() const;
+        // вычисляет формулу и кеширует её значение
+        void Recalculate() const;
+        void InvalidateCache();
+
+    private:
+        const SheetFork& fork_;
+        const Cell* parent_ = nullptr;
+        std::string text_;
+        std::unique_ptr<FormulaInterface> own_formula_;
+        const FormulaInterface* formula_ = nullptr;
+        mutable std::optional<Value> cache_;
+    };
+
+    // Вычисление формулы дошло до формулы копии без значения в кеше
+    struct PendingEvaluation {
+        const SheetFork* fork;
+        const ForkCell* cell;
+    };
+
+    std::optional<int> Find(Range column, double key, Match match) const override;
+    RangeAggregate Aggregate(Range range) const override;
+
+    // Вычисляет формулу cell копии так же, как Sheet::EvaluateFormula: формулы
+    // копии без значения в кеше, которые она читает, вычисляются раньше неё
+    // по явному стеку. Формулы исходной таблицы вычисляет её планировщик.
+    void EvaluateFormula(const ForkCell& cell) const;
+    // ячейка, заданная или пересчитываемая в копии, или nullptr
+    const ForkCell* FindForkCell(Position pos) const;
+    // в области есть ячейки, заданные или пересчитываемые в копии
+    bool HasOwnCells(const Range& range) const;
+    void AddOwnCell(Position pos);
+    // удаляет индексы копии, в области которых лежит pos
+    void InvalidateLookupIndexes(Position pos);
+    // текст ячейки с учётом изменений копии
+    std::string GetCurrentText(Position pos) const;
+    bool IsFormulaAt(Position pos) const;
+    // ячейки, которые читает формула, включая формулы внутри её областей
+    std::vector<Position> GetFormulaReferences(const std::vector<Position>& cells,
+                                               const std::vector<Range>& ranges) const;
+    void CheckCyclicDependencies(Position pos, const FormulaInterface& formula) const;
+    void Link(Position pos, const ForkCell& cell, bool add);
+    // сбрасывает значения формул, зависящих от pos; формулы исходной таблицы
+    // среди них начинают вычисляться в копии
+    void InvalidateDependentCells(Position pos);
+    void UpdatePrintableArea(Position pos, const std::string& old_text, const std::string& new_text);
+    // print(cell) печатает ячейку копии, print_parent(pos) - ячейку
+    // исходной таблицы, не изменённую в копии
+    template <typename Print, typename PrintParent>
+    void PrintCells(std::ostream& output, Print print, PrintParent print_parent) const;
+
+    const Sheet& parent_;
+    // ячейки, заданные или очищенные в копии
+    std::unordered_map<Position, std::unique_ptr<ForkCell>, Position::HashFunc> edits_;
+    // формулы исходной таблицы, которые вычисляются в копии
+    std::unordered_map<Position, std::unique_ptr<ForkCell>, Position::HashFunc> recalculated_;
+    // формулы копии, ссылающиеся на ячейки и области
+    std::unordered_map<Position, std::unordered_set<Position, Position::HashFunc>, Position::HashFunc> dependents_;
+    std::map<Range, std::unordered_set<Position, Position::HashFunc>> range_dependents_;
+    // формулы копии по столбцам
+    std::unordered_map<int, std::set<int>> formula_rows_;
+    // строки ячеек из edits_ и recalculated_ по столбцам
+    std::unordered_map<int, std::set<int>> own_rows_;
+    // индексы столбцов с ячейками копии
+    mutable std::map<Range, ColumnIndex> lookup_indexes_;
+    // изменение количества непустых ячеек строк и столбцов относительно
+    // исходной таблицы
+    std::map<int, int> row_deltas_;
+    std::map<int, int> col_deltas_;
+    // формула, которую сейчас вычисляет EvaluateFormula, или nullptr
+    mutable const ForkCell* evaluating_ = nullptr;
+};
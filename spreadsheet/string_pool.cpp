@@ -0,0 +1,65 @@
+#include "string_pool.h"
+
+#include <cassert>
+
+StringPool::Handle StringPool::Add(std::string_view text) {
+    auto it = index_.find(text);
+    if(it != index_.end()) {
+        entries_[it->second].ref_count++;
+        return it->second;
+    }
+
+    Handle handle;
+    if(!free_handles_.empty()) {
+        handle = free_handles_.back();
+        free_handles_.pop_back();
+    } else {
+        handle = static_cast<Handle>(entries_.size());
+        entries_.emplace_back();
+    }
+    Entry& entry = entries_[handle];
+    entry.text = text;
+    entry.ref_count = 1;
+    index_.emplace(entry.text, handle);
+    return handle;
+}
+
+void StringPool::Release(Handle handle) {
+    Entry& entry = entries_[handle];
+    assert(entry.ref_count > 0);
+    if(--entry.ref_count == 0) {
+        index_.erase(entry.text);
+        // освобождаем память строки, а не только очищаем её
+        std::string().swap(entry.text);
+        free_handles_.push_back(handle);
+    }
+}
+
+std::string_view StringPool::Get(Handle handle) const {
+    return entries_[handle].text;
+}
+
+size_t StringPool::GetSize() const {
+    return index_.size();
+}
+
+size_t StringPool::GetSharedMemoryUsage(Handle handle) const {
+    static const size_t inline_capacity = std::string().capacity();
+    const Entry& entry = entries_[handle];
+    size_t size = sizeof(Entry);
+    if(entry.text.capacity() > inline_capacity) {
+        size += entry.text.capacity() + 1;
+    }
+    return size / entry.ref_count;
+}
+
+size_t StringPool::GetIndexMemoryUsage() const {
+    // узел индекса: ключ, дескриптор, указатель на следующий узел и хеш
+    const size_t node_size = sizeof(std::pair<const std::string_view, Handle>)
+                             + sizeof(void*) + sizeof(size_t);
+    return sizeof(*this)
+        + index_.size() * node_size
+        + index_.bucket_count() * sizeof(void*)
+        + free_handles_.capacity() * sizeof(Handle)
+        + free_handles_.size() * sizeof(Entry);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Пул строк таблицы: одинаковые тексты хранятся в единственном экземпляре.
+// Строка живёт, пока на неё есть хотя бы одна ссылка. Представления,
+// возвращаемые Get(), действительны до освобождения последней ссылки.
+class StringPool {
+public:
+    using Handle = uint32_t;
+
+    // Возвращает дескриптор строки и увеличивает число ссылок на неё
+    Handle Add(std::string_view text);
+    // Уменьшает число ссылок на строку и удаляет её, если ссылок не осталось
+    void Release(Handle handle);
+
+    std::string_view Get(Handle handle) const;
+
+    // Количество различных строк в пуле
+    size_t GetSize() const;
+    // Память под строку, приходящаяся на одну ссылку
+    size_t GetSharedMemoryUsage(Handle handle) const;
+    // Память служебных структур пула без учёта самих строк
+    size_t GetIndexMemoryUsage() const;
+
+private:
+    struct Entry {
+        std::string text;
+        uint32_t ref_count = 0;
+    };
+
+    // deque не перемещает элементы при добавлении, поэтому ключи индекса
+    // могут ссылаться на строки записей
+    std::deque<Entry> entries_;
+    std::vector<Handle> free_handles_;
+    std::unordered_map<std::string_view, Handle> index_;
+};
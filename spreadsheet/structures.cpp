@@ -74,11 +74,37 @@ Position Position::FromString(std::string_view str) {
 }
 
 size_t Position::HashFunc::operator()(const Position& pos) const {
-    size_t rowHash = std::hash<int>()(pos.row);
-    size_t colHash = std::hash<int>()(pos.col) << 1;
-    return rowHash ^ colHash;
+    // номер ячейки различен для всех допустимых позиций, а XOR номеров
+    // строки и сдвинутого столбца совпадает у многих ячеек одного блока
+    return static_cast<size_t>(pos.row) * Position::MAX_COLS + static_cast<size_t>(pos.col);
 }
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Range::operator==(Range rhs) const {
+    return top_left == rhs.top_left && bottom_right == rhs.bottom_right;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(top_left, bottom_right) < std::tie(rhs.top_left, rhs.bottom_right);
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && bottom_right.IsValid()
+        && top_left.row <= bottom_right.row && top_left.col <= bottom_right.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= top_left.row && pos.row <= bottom_right.row
+        && pos.col >= top_left.col && pos.col <= bottom_right.col;
+}
+
+Size Range::GetSize() const {
+    return {bottom_right.row - top_left.row + 1, bottom_right.col - top_left.col + 1};
+}
+
+std::string Range::ToString() const {
+    return top_left.ToString() + ':' + bottom_right.ToString();
+}
@@ -0,0 +1,175 @@
+#include "trace_events.h"
+
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace {
+constexpr uint64_t TRACE_RING_CAPACITY = 1 << 15;
+
+// Кольцевой буфер событий одного потока. Пишет в него только владеющий
+// поток, а выгрузка читает без блокировок: запись сначала увеличивает
+// claimed, потом меняет ячейку буфера и только затем публикует её в head,
+// поэтому по claimed после чтения видно, какие ячейки успели перезаписать.
+struct TraceRing {
+    struct Event {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<int64_t> start{0};
+        std::atomic<int64_t> end{0};
+    };
+
+    explicit TraceRing(uint32_t id)
+        : id(id)
+        , events(std::make_unique<Event[]>(TRACE_RING_CAPACITY)) {
+    }
+
+    const uint32_t id;
+    // количество начатых и законченных записей событий
+    std::atomic<uint64_t> claimed{0};
+    std::atomic<uint64_t> head{0};
+    std::unique_ptr<Event[]> events;
+    // буфер принадлежит живому потоку; защищено мьютексом реестра
+    bool owned = true;
+};
+
+// Буферы не удаляются: события завершившихся потоков остаются до выгрузки,
+// а их буферы достаются новым потокам, поэтому число буферов не превышает
+// наибольшее число одновременно трассирующих потоков
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+};
+
+TraceRegistry& GetRegistry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+// начало текущей записи в наносекундах часов steady_clock
+std::atomic<int64_t> trace_start{0};
+
+int64_t ToNanoseconds(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+class RingOwner {
+public:
+    ~RingOwner() {
+        if(ring_ != nullptr) {
+            std::lock_guard lock(GetRegistry().mutex);
+            ring_->owned = false;
+        }
+    }
+
+    TraceRing& Get() {
+        if(ring_ == nullptr) {
+            TraceRegistry& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            for(const auto& ring: registry.rings) {
+                if(!ring->owned) {
+                    ring_ = ring.get();
+                    break;
+                }
+            }
+            if(ring_ == nullptr) {
+                registry.rings.push_back(
+                    std::make_unique<TraceRing>(static_cast<uint32_t>(registry.rings.size())));
+                ring_ = registry.rings.back().get();
+            }
+            ring_->owned = true;
+        }
+        return *ring_;
+    }
+
+private:
+    TraceRing* ring_ = nullptr;
+};
+
+thread_local RingOwner ring_owner;
+
+// время в микросекундах с тремя знаками после точки
+void WriteMicroseconds(std::ostream& output, int64_t nanoseconds) {
+    output << nanoseconds / 1000 << '.' << std::setw(3) << std::setfill('0') << nanoseconds % 1000;
+}
+}  // namespace
+
+void StartTracing() {
+    trace_start.store(ToNanoseconds(std::chrono::steady_clock::now()), std::memory_order_relaxed);
+    tracing_enabled.store(true, std::memory_order_relaxed);
+}
+
+void StopTracing() {
+    tracing_enabled.store(false, std::memory_order_relaxed);
+}
+
+void TraceScope::Record(const char* name, std::chrono::steady_clock::time_point start,
+                        std::chrono::steady_clock::time_point end) {
+    TraceRing& ring = ring_owner.Get();
+    const uint64_t index = ring.head.load(std::memory_order_relaxed);
+    ring.claimed.store(index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    TraceRing::Event& event = ring.events[index % TRACE_RING_CAPACITY];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(ToNanoseconds(start), std::memory_order_relaxed);
+    event.end.store(ToNanoseconds(end), std::memory_order_relaxed);
+    ring.head.store(index + 1, std::memory_order_release);
+}
+
+void WriteChromeTrace(std::ostream& output) {
+    struct Event {
+        const char* name;
+        int64_t start;
+        int64_t end;
+    };
+    const int64_t start = trace_start.load(std::memory_order_relaxed);
+    std::vector<std::pair<uint32_t, std::vector<Event>>> threads;
+    {
+        TraceRegistry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        for(const auto& ring: registry.rings) {
+            const uint64_t head = ring->head.load(std::memory_order_acquire);
+            const uint64_t first = head > TRACE_RING_CAPACITY ? head - TRACE_RING_CAPACITY : 0;
+            std::vector<Event> events;
+            events.reserve(head - first);
+            for(uint64_t i = first; i < head; i++) {
+                const TraceRing::Event& event = ring->events[i % TRACE_RING_CAPACITY];
+                events.push_back({event.name.load(std::memory_order_relaxed),
+                                  event.start.load(std::memory_order_relaxed),
+                                  event.end.load(std::memory_order_relaxed)});
+            }
+            // события, ячейки которых начали перезаписывать во время чтения
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t claimed = ring->claimed.load(std::memory_order_relaxed);
+            const uint64_t valid = claimed > TRACE_RING_CAPACITY ? claimed - TRACE_RING_CAPACITY : 0;
+            if(valid > first) {
+                events.erase(events.begin(), events.begin() + std::min(valid - first, head - first));
+            }
+            threads.emplace_back(ring->id, std::move(events));
+        }
+    }
+
+    const auto flags = output.flags();
+    const char fill = output.fill();
+    output << "{\"traceEvents\":[";
+    bool first_event = true;
+    for(const auto& [tid, events]: threads) {
+        for(const Event& event: events) {
+            if(event.start < start) {
+                continue;
+            }
+            output << (first_event ? "\n" : ",\n");
+            first_event = false;
+            output << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                   << ",\"ts\":";
+            WriteMicroseconds(output, event.start - start);
+            output << ",\"dur\":";
+            WriteMicroseconds(output, event.end - event.start);
+            output << '}';
+        }
+    }
+    output << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    output.flags(flags);
+    output.fill(fill);
+}
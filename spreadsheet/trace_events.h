@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+// События трассы - интервалы времени с именем, которые показываются на
+// временной шкале по потокам. Каждый поток записывает события в свой
+// кольцевой буфер без блокировок; при переполнении буфера старые события
+// перезаписываются. Запись включается StartTracing, а пока она выключена,
+// событие стоит одной проверки атомарного флага. Если проект собран без
+// SPREADSHEET_TRACING, макрос TRACE_SCOPE ничего не делает.
+
+// Начинает новую запись: события, записанные до вызова, не выгружаются
+void StartTracing();
+void StopTracing();
+
+inline std::atomic<bool> tracing_enabled{false};
+
+inline bool IsTracing() {
+    return tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Выгружает события текущей записи в формате Chrome trace JSON, который
+// открывают chrome://tracing и Perfetto. Можно вызывать во время записи:
+// события, перезаписанные во время выгрузки, пропускаются.
+void WriteChromeTrace(std::ostream& output);
+
+// Записывает событие с именем name от создания до удаления объекта. Имя
+// должно жить до выгрузки трассы, обычно это строковый литерал.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name)
+        : name_(IsTracing() ? name : nullptr) {
+        if(name_ != nullptr) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if(name_ != nullptr) {
+            Record(name_, start_, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    static void Record(const char* name, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end);
+
+    const char* name_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#ifdef SPREADSHEET_TRACING
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) static_cast<void>(0)
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// Числа переменной длины в трассах нагрузки и журнале изменений: по 7 бит в
+// байте начиная с младших, старший бит байта означает продолжение числа
+constexpr size_t MAX_VARINT_SIZE = 10;
+
+// Записывает value в buffer и возвращает количество записанных байтов
+inline size_t EncodeVarint(uint64_t value, char* buffer) {
+    size_t size = 0;
+    while(value >= 0x80) {
+        buffer[size++] = static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = static_cast<char>(value);
+    return size;
+}
+
+// Читает число из data с позиции offset и переносит offset за него.
+// Возвращает nullopt, если данные оборваны или число слишком длинное.
+inline std::optional<uint64_t> DecodeVarint(std::string_view data, size_t& offset) {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+        const auto byte = static_cast<uint8_t>(data[offset++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
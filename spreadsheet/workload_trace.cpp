@@ -0,0 +1,124 @@
+#include "workload_trace.h"
+
+#include "varint.h"
+
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+namespace {
+constexpr std::string_view TRACE_MAGIC = "SPRTRACE";
+constexpr uint8_t TRACE_VERSION = 1;
+constexpr uint8_t FAILED_FLAG = 0x80;
+
+void WriteVarint(std::ostream& output, uint64_t value) {
+    char buffer[MAX_VARINT_SIZE];
+    output.write(buffer, EncodeVarint(value, buffer));
+}
+
+uint64_t ReadVarint(std::istream& input) {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if(byte == std::char_traits<char>::eof()) {
+            throw std::runtime_error("Unexpected end of trace");
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Invalid number in trace");
+}
+}  // namespace
+
+std::string_view ToString(TraceOp op) {
+    switch(op) {
+        case TraceOp::SetCell:
+            return "SetCell";
+        case TraceOp::ClearCell:
+            return "ClearCell";
+        case TraceOp::GetValue:
+            return "GetValue";
+        case TraceOp::GetText:
+            return "GetText";
+        case TraceOp::GetPrintableSize:
+            return "GetPrintableSize";
+        case TraceOp::PrintValues:
+            return "PrintValues";
+        case TraceOp::PrintTexts:
+            return "PrintTexts";
+    }
+    return "";
+}
+
+bool HasPosition(TraceOp op) {
+    return op == TraceOp::SetCell || op == TraceOp::ClearCell
+        || op == TraceOp::GetValue || op == TraceOp::GetText;
+}
+
+TraceWriter::TraceWriter(std::ostream& output)
+    : output_(output) {
+    output_.write(TRACE_MAGIC.data(), TRACE_MAGIC.size());
+    output_.put(static_cast<char>(TRACE_VERSION));
+}
+
+void TraceWriter::Write(const TraceRecord& record) {
+    uint8_t code = static_cast<uint8_t>(record.op);
+    if(record.failed) {
+        code |= FAILED_FLAG;
+    }
+    output_.put(static_cast<char>(code));
+    WriteVarint(output_, (record.timestamp - last_timestamp_).count());
+    WriteVarint(output_, record.duration.count());
+    last_timestamp_ = record.timestamp;
+
+    if(HasPosition(record.op)) {
+        WriteVarint(output_, record.pos.row);
+        WriteVarint(output_, record.pos.col);
+    }
+    if(record.op == TraceOp::SetCell) {
+        WriteVarint(output_, record.text.size());
+        output_.write(record.text.data(), record.text.size());
+    }
+}
+
+TraceReader::TraceReader(std::istream& input)
+    : input_(input) {
+    std::string magic(TRACE_MAGIC.size(), '\0');
+    input_.read(magic.data(), magic.size());
+    if(!input_ || magic != TRACE_MAGIC || input_.get() != TRACE_VERSION) {
+        throw std::runtime_error("Not a workload trace");
+    }
+}
+
+bool TraceReader::Read(TraceRecord& record) {
+    int code = input_.get();
+    if(code == std::char_traits<char>::eof()) {
+        return false;
+    }
+    record.failed = (code & FAILED_FLAG) != 0;
+    code &= ~FAILED_FLAG;
+    if(code > static_cast<int>(TraceOp::PrintTexts)) {
+        throw std::runtime_error("Unknown operation in trace");
+    }
+    record.op = static_cast<TraceOp>(code);
+    last_timestamp_ += std::chrono::nanoseconds(ReadVarint(input_));
+    record.timestamp = last_timestamp_;
+    record.duration = std::chrono::nanoseconds(ReadVarint(input_));
+
+    record.pos = Position::NONE;
+    if(HasPosition(record.op)) {
+        record.pos.row = static_cast<int>(ReadVarint(input_));
+        record.pos.col = static_cast<int>(ReadVarint(input_));
+    }
+    record.text.clear();
+    if(record.op == TraceOp::SetCell) {
+        record.text.resize(ReadVarint(input_));
+        input_.read(record.text.data(), record.text.size());
+        if(!input_) {
+            throw std::runtime_error("Unexpected end of trace");
+        }
+    }
+    return true;
+}
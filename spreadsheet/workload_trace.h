@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Операции над таблицей, которые сохраняются в трассе нагрузки
+enum class TraceOp : uint8_t {
+    SetCell,
+    ClearCell,
+    GetValue,
+    GetText,
+    GetPrintableSize,
+    PrintValues,
+    PrintTexts,
+};
+
+std::string_view ToString(TraceOp op);
+// Операция относится к одной ячейке и в записи хранится её позиция
+bool HasPosition(TraceOp op);
+
+struct TraceRecord {
+    TraceOp op = TraceOp::SetCell;
+    // время начала операции от начала записи трассы
+    std::chrono::nanoseconds timestamp{0};
+    // время выполнения операции при записи
+    std::chrono::nanoseconds duration{0};
+    // операция завершилась исключением
+    bool failed = false;
+    // позиция ячейки; не используется операциями над всей таблицей
+    Position pos;
+    // текст для SetCell
+    std::string text;
+};
+
+// Записывает трассу в компактном двоичном виде: после заголовка каждая
+// запись хранит код операции, время от предыдущей записи и длительность в
+// виде чисел переменной длины, затем позицию и текст, если они нужны.
+class TraceWriter {
+public:
+    explicit TraceWriter(std::ostream& output);
+
+    void Write(const TraceRecord& record);
+
+private:
+    std::ostream& output_;
+    std::chrono::nanoseconds last_timestamp_{0};
+};
+
+// Читает трассу, записанную TraceWriter. Бросает std::runtime_error, если
+// данные повреждены.
+class TraceReader {
+public:
+    explicit TraceReader(std::istream& input);
+
+    // Возвращает false, когда записи закончились
+    bool Read(TraceRecord& record);
+
+private:
+    std::istream& input_;
+    std::chrono::nanoseconds last_timestamp_{0};
+};
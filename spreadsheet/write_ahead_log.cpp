@@ -0,0 +1,544 @@
+#include "write_ahead_log.h"
+
+#include "varint.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr std::string_view SEGMENT_MAGIC = "SPRWALOG";
+constexpr std::string_view SNAPSHOT_MAGIC = "SPRSNAPS";
+constexpr uint8_t LOG_VERSION = 1;
+constexpr size_t HEADER_SIZE = SEGMENT_MAGIC.size() + 1;
+constexpr size_t CHECKSUM_SIZE = 4;
+constexpr std::string_view SNAPSHOT_NAME = "snapshot";
+constexpr std::string_view SEGMENT_PREFIX = "wal.";
+
+// Файловые операции, которых нет в стандартной библиотеке: запись без
+// буферизации и сброс на диск
+#ifdef _WIN32
+int OpenFile(const fs::path& path) {
+    return _wopen(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, 0644);
+}
+
+bool WriteFile(int fd, const char* data, size_t size) {
+    return _write(fd, data, static_cast<unsigned>(size)) == static_cast<int>(size);
+}
+
+bool SyncFile(int fd) {
+    return _commit(fd) == 0;
+}
+
+void CloseFile(int fd) {
+    _close(fd);
+}
+
+// изменения каталога сохраняются самой файловой системой
+void SyncDirectory(const fs::path& /* directory */) {
+}
+#else
+int OpenFile(const fs::path& path) {
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+bool WriteFile(int fd, const char* data, size_t size) {
+    while(size > 0) {
+        ssize_t written = write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool SyncFile(int fd) {
+    return fsync(fd) == 0;
+}
+
+void CloseFile(int fd) {
+    close(fd);
+}
+
+// после fsync каталога созданный или переименованный файл не пропадёт
+void SyncDirectory(const fs::path& directory) {
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot open " + directory.string());
+    }
+    bool synced = SyncFile(fd);
+    CloseFile(fd);
+    if(!synced) {
+        throw std::system_error(errno, std::generic_category(), "Cannot sync " + directory.string());
+    }
+}
+#endif
+
+[[noreturn]] void ThrowFileError(std::string_view action, const fs::path& path) {
+    throw std::system_error(errno, std::generic_category(),
+                            std::string(action) + " " + path.string());
+}
+
+// Создаёт файл с содержимым data и сохраняет его на диск
+void WriteDurably(const fs::path& path, std::string_view data) {
+    int fd = OpenFile(path);
+    if(fd < 0) {
+        ThrowFileError("Cannot open", path);
+    }
+    bool written = WriteFile(fd, data.data(), data.size()) && SyncFile(fd);
+    CloseFile(fd);
+    if(!written) {
+        ThrowFileError("Cannot write", path);
+    }
+}
+
+std::string ReadFile(const fs::path& path) {
+    std::ifstream input(path, std::ios::binary);
+    if(!input) {
+        throw std::runtime_error("Cannot read " + path.string());
+    }
+    return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+std::string MakeHeader(std::string_view magic) {
+    std::string header(magic);
+    header.push_back(static_cast<char>(LOG_VERSION));
+    return header;
+}
+
+bool HasHeader(std::string_view data, std::string_view magic) {
+    return data.size() >= HEADER_SIZE && data.substr(0, magic.size()) == magic
+        && static_cast<uint8_t>(data[magic.size()]) == LOG_VERSION;
+}
+
+void AppendVarint(std::string& output, uint64_t value) {
+    char buffer[MAX_VARINT_SIZE];
+    output.append(buffer, EncodeVarint(value, buffer));
+}
+
+// FNV-1a: отличает записи, оборванные при сбое, от целых
+uint32_t Checksum(std::string_view data) {
+    uint32_t hash = 2166136261u;
+    for(char c: data) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+void AppendChecksum(std::string& output, size_t record_begin) {
+    uint32_t checksum = Checksum(std::string_view(output).substr(record_begin));
+    for(size_t i = 0; i < CHECKSUM_SIZE; i++) {
+        output.push_back(static_cast<char>(checksum >> (8 * i)));
+    }
+}
+
+bool ReadChecksum(std::string_view data, size_t record_begin, size_t& offset) {
+    if(data.size() - offset < CHECKSUM_SIZE) {
+        return false;
+    }
+    uint32_t checksum = 0;
+    for(size_t i = 0; i < CHECKSUM_SIZE; i++) {
+        checksum |= static_cast<uint32_t>(static_cast<uint8_t>(data[offset + i])) << (8 * i);
+    }
+    bool valid = checksum == Checksum(data.substr(record_begin, offset - record_begin));
+    offset += CHECKSUM_SIZE;
+    return valid;
+}
+
+std::optional<Position> ReadPosition(std::string_view data, size_t& offset) {
+    auto row = DecodeVarint(data, offset);
+    auto col = DecodeVarint(data, offset);
+    if(!row || !col || *row >= Position::MAX_ROWS || *col >= Position::MAX_COLS) {
+        return std::nullopt;
+    }
+    return Position{static_cast<int>(*row), static_cast<int>(*col)};
+}
+
+std::optional<std::string_view> ReadText(std::string_view data, size_t& offset) {
+    auto size = DecodeVarint(data, offset);
+    if(!size || *size > data.size() - offset) {
+        return std::nullopt;
+    }
+    std::string_view text = data.substr(offset, *size);
+    offset += *size;
+    return text;
+}
+
+fs::path GetSegmentPath(const fs::path& directory, uint64_t segment) {
+    return directory / (std::string(SEGMENT_PREFIX) + std::to_string(segment));
+}
+
+// номера сегментов журнала в каталоге по возрастанию
+std::vector<uint64_t> ListSegments(const fs::path& directory) {
+    std::vector<uint64_t> segments;
+    for(const auto& entry: fs::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        if(name.size() > SEGMENT_PREFIX.size() && name.compare(0, SEGMENT_PREFIX.size(), SEGMENT_PREFIX) == 0
+          && name.find_first_not_of("0123456789", SEGMENT_PREFIX.size()) == std::string::npos) {
+            segments.push_back(std::stoull(name.substr(SEGMENT_PREFIX.size())));
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Применяет записи сегмента к cells и возвращает размер его целой части.
+// Чтение останавливается на первой повреждённой или оборванной записи.
+size_t ApplySegment(std::string_view data, WriteAheadLog::CellTexts& cells) {
+    if(!HasHeader(data, SEGMENT_MAGIC)) {
+        return 0;
+    }
+    size_t valid_size = HEADER_SIZE;
+    while(valid_size < data.size()) {
+        size_t offset = valid_size;
+        const auto op = static_cast<uint8_t>(data[offset++]);
+        auto pos = ReadPosition(data, offset);
+        if(!pos) {
+            break;
+        }
+        // коды операций WriteAheadLog::Op: 0 - SetCell, 1 - ClearCell
+        std::optional<std::string_view> text;
+        if(op == 0) {
+            text = ReadText(data, offset);
+            if(!text) {
+                break;
+            }
+        } else if(op != 1) {
+            break;
+        }
+        if(!ReadChecksum(data, valid_size, offset)) {
+            break;
+        }
+        if(text) {
+            cells[*pos] = std::string(*text);
+        } else {
+            cells.erase(*pos);
+        }
+        valid_size = offset;
+    }
+    return valid_size;
+}
+
+// Читает снимок в cells и возвращает номер первого сегмента, который в
+// снимок не вошёл; без снимка это 0
+uint64_t LoadSnapshot(const fs::path& directory, WriteAheadLog::CellTexts& cells) {
+    const fs::path path = directory / SNAPSHOT_NAME;
+    if(!fs::exists(path)) {
+        return 0;
+    }
+    const std::string data = ReadFile(path);
+    size_t offset = HEADER_SIZE;
+    auto first_segment = HasHeader(data, SNAPSHOT_MAGIC) ? DecodeVarint(data, offset) : std::nullopt;
+    auto count = DecodeVarint(data, offset);
+    if(!first_segment || !count) {
+        throw std::runtime_error("Corrupted snapshot " + path.string());
+    }
+    for(uint64_t i = 0; i < *count; i++) {
+        auto pos = ReadPosition(data, offset);
+        auto text = pos ? ReadText(data, offset) : std::nullopt;
+        if(!text) {
+            throw std::runtime_error("Corrupted snapshot " + path.string());
+        }
+        cells[*pos] = std::string(*text);
+    }
+    if(!ReadChecksum(data, 0, offset) || offset != data.size()) {
+        throw std::runtime_error("Corrupted snapshot " + path.string());
+    }
+    return *first_segment;
+}
+
+// Заменяет снимок: новый файл сохраняется на диск и переименовывается, так
+// что при сбое остаётся либо старый снимок, либо новый целиком
+void WriteSnapshot(const fs::path& directory, const WriteAheadLog::CellTexts& cells,
+                   uint64_t first_segment) {
+    std::string data = MakeHeader(SNAPSHOT_MAGIC);
+    AppendVarint(data, first_segment);
+    AppendVarint(data, cells.size());
+    for(const auto& [pos, text]: cells) {
+        AppendVarint(data, pos.row);
+        AppendVarint(data, pos.col);
+        AppendVarint(data, text.size());
+        data += text;
+    }
+    AppendChecksum(data, 0);
+
+    const fs::path temp_path = directory / (std::string(SNAPSHOT_NAME) + ".tmp");
+    fs::remove(temp_path);
+    WriteDurably(temp_path, data);
+    fs::rename(temp_path, directory / SNAPSHOT_NAME);
+    SyncDirectory(directory);
+}
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(const fs::path& directory, WalOptions options)
+    : directory_(directory)
+    , options_(options) {
+    fs::create_directories(directory_);
+    const uint64_t first_segment = LoadSnapshot(directory_, recovered_);
+    const std::vector<uint64_t> segments = ListSegments(directory_);
+    for(uint64_t segment: segments) {
+        const fs::path path = GetSegmentPath(directory_, segment);
+        // сегмент уже в снимке, но контрольная точка не успела его удалить
+        if(segment < first_segment) {
+            fs::remove(path);
+            continue;
+        }
+        const std::string data = ReadFile(path);
+        const size_t valid_size = ApplySegment(data, recovered_);
+        if(valid_size == data.size()) {
+            continue;
+        }
+        // оборваться при сбое могла только запись в конце последнего сегмента
+        if(segment != segments.back()) {
+            throw std::runtime_error("Corrupted write-ahead log segment " + path.string());
+        }
+        if(valid_size == 0) {
+            fs::remove(path);
+        } else {
+            fs::resize_file(path, valid_size);
+            WriteDurably(path, {});
+        }
+    }
+
+    // дописывать всегда начинаем в новый сегмент
+    segment_ = segments.empty() ? first_segment : std::max(first_segment, segments.back() + 1);
+    RotateSegment();
+    writer_ = std::thread([this] {
+        WriterLoop();
+    });
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    if(checkpoint_thread_.joinable()) {
+        checkpoint_thread_.join();
+    }
+    if(fd_ >= 0) {
+        CloseFile(fd_);
+    }
+}
+
+WriteAheadLog::CellTexts WriteAheadLog::TakeRecoveredCells() {
+    return std::move(recovered_);
+}
+
+uint64_t WriteAheadLog::AppendSetCell(Position pos, std::string_view text) {
+    return Append(Op::SetCell, pos, text);
+}
+
+uint64_t WriteAheadLog::AppendClearCell(Position pos) {
+    return Append(Op::ClearCell, pos, {});
+}
+
+uint64_t WriteAheadLog::Append(Op op, Position pos, std::string_view text) {
+    std::lock_guard lock(mutex_);
+    ThrowIfFailed();
+    const size_t record_begin = pending_.size();
+    pending_.push_back(static_cast<char>(op));
+    AppendVarint(pending_, pos.row);
+    AppendVarint(pending_, pos.col);
+    if(op == Op::SetCell) {
+        AppendVarint(pending_, text.size());
+        pending_ += text;
+    }
+    AppendChecksum(pending_, record_begin);
+    if(pending_.size() >= options_.group_commit_bytes) {
+        wake_.notify_one();
+    }
+    return ++appended_lsn_;
+}
+
+void WriteAheadLog::Sync(uint64_t lsn) {
+    std::unique_lock lock(mutex_);
+    ThrowIfFailed();
+    if(durable_lsn_ < lsn) {
+        sync_requested_ = true;
+        wake_.notify_one();
+        done_.wait(lock, [&] {
+            return durable_lsn_ >= lsn || error_;
+        });
+        ThrowIfFailed();
+    }
+    ThrowIfCheckpointFailed();
+}
+
+void WriteAheadLog::Flush() {
+    uint64_t lsn;
+    {
+        std::lock_guard lock(mutex_);
+        lsn = appended_lsn_;
+    }
+    Sync(lsn);
+}
+
+void WriteAheadLog::Checkpoint() {
+    std::unique_lock lock(mutex_);
+    ThrowIfFailed();
+    done_.wait(lock, [&] {
+        return !checkpoint_running_ || error_;
+    });
+    const uint64_t target = checkpoints_done_ + 1;
+    checkpoint_requested_ = true;
+    wake_.notify_one();
+    done_.wait(lock, [&] {
+        return checkpoints_done_ >= target || error_;
+    });
+    ThrowIfFailed();
+    ThrowIfCheckpointFailed();
+}
+
+uint64_t WriteAheadLog::GetDurableLsn() const {
+    std::lock_guard lock(mutex_);
+    return durable_lsn_;
+}
+
+void WriteAheadLog::WriterLoop() {
+    std::string batch;
+    std::unique_lock lock(mutex_);
+    while(true) {
+        wake_.wait_for(lock, options_.group_commit_interval, [this] {
+            return stop_ || sync_requested_ || (checkpoint_requested_ && !checkpoint_running_)
+                || pending_.size() >= options_.group_commit_bytes;
+        });
+        const bool checkpoint = !checkpoint_running_
+            && (checkpoint_requested_ || segment_size_ >= options_.checkpoint_bytes);
+        if(pending_.empty() && !checkpoint) {
+            if(stop_) {
+                break;
+            }
+            continue;
+        }
+        // пока пачка пишется на диск, новые записи копятся в pending_
+        batch.swap(pending_);
+        const uint64_t lsn = appended_lsn_;
+        sync_requested_ = false;
+        lock.unlock();
+        try {
+            if(!batch.empty()) {
+                if(!WriteFile(fd_, batch.data(), batch.size()) || !SyncFile(fd_)) {
+                    ThrowFileError("Cannot write", GetSegmentPath(directory_, segment_));
+                }
+                segment_size_ += batch.size();
+                batch.clear();
+            }
+        } catch (...) {
+            lock.lock();
+            error_ = std::current_exception();
+            done_.notify_all();
+            return;
+        }
+        lock.lock();
+        durable_lsn_ = lsn;
+        done_.notify_all();
+
+        if(checkpoint_running_
+          || !(checkpoint_requested_ || segment_size_ >= options_.checkpoint_bytes)) {
+            continue;
+        }
+        checkpoint_requested_ = false;
+        checkpoint_running_ = true;
+        lock.unlock();
+        try {
+            CloseFile(fd_);
+            fd_ = -1;
+            segment_++;
+            RotateSegment();
+        } catch (...) {
+            lock.lock();
+            error_ = std::current_exception();
+            checkpoint_running_ = false;
+            done_.notify_all();
+            return;
+        }
+        if(checkpoint_thread_.joinable()) {
+            checkpoint_thread_.join();
+        }
+        checkpoint_thread_ = std::thread([this, segment = segment_] {
+            RunCheckpoint(segment);
+        });
+        lock.lock();
+    }
+}
+
+void WriteAheadLog::RotateSegment() {
+    const fs::path path = GetSegmentPath(directory_, segment_);
+    const std::string header = MakeHeader(SEGMENT_MAGIC);
+    WriteDurably(path, header);
+    SyncDirectory(directory_);
+    fd_ = OpenFile(path);
+    if(fd_ < 0) {
+        ThrowFileError("Cannot open", path);
+    }
+    segment_size_ = header.size();
+}
+
+void WriteAheadLog::RunCheckpoint(uint64_t segment) {
+    try {
+        // сегменты до segment закрыты и сохранены на диск, поэтому снимок
+        // строится из файлов без остановки записи
+        CellTexts cells;
+        LoadSnapshot(directory_, cells);
+        std::vector<uint64_t> segments = ListSegments(directory_);
+        segments.erase(std::lower_bound(segments.begin(), segments.end(), segment), segments.end());
+        for(uint64_t old_segment: segments) {
+            const fs::path path = GetSegmentPath(directory_, old_segment);
+            const std::string data = ReadFile(path);
+            if(ApplySegment(data, cells) != data.size()) {
+                throw std::runtime_error("Corrupted write-ahead log segment " + path.string());
+            }
+        }
+        WriteSnapshot(directory_, cells, segment);
+        for(uint64_t old_segment: segments) {
+            fs::remove(GetSegmentPath(directory_, old_segment));
+        }
+        // снимок включает сегменты, оставшиеся после прошлых ошибок
+        std::lock_guard lock(mutex_);
+        checkpoint_error_ = nullptr;
+    } catch (...) {
+        std::lock_guard lock(mutex_);
+        checkpoint_error_ = std::current_exception();
+    }
+    std::lock_guard lock(mutex_);
+    checkpoint_running_ = false;
+    checkpoints_done_++;
+    done_.notify_all();
+    wake_.notify_one();
+}
+
+void WriteAheadLog::ThrowIfFailed() const {
+    if(error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void WriteAheadLog::ThrowIfCheckpointFailed() {
+    if(checkpoint_error_) {
+        std::rethrow_exception(std::exchange(checkpoint_error_, nullptr));
+    }
+}
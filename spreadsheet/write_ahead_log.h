@@ -0,0 +1,112 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+struct WalOptions {
+    // Записи копятся в памяти и сохраняются одной записью с fsync, когда их
+    // набралось group_commit_bytes или прошло group_commit_interval
+    size_t group_commit_bytes = 64 * 1024;
+    std::chrono::milliseconds group_commit_interval{10};
+    // Когда сегмент журнала вырастает до checkpoint_bytes, начинается новый
+    // сегмент, а фоновая контрольная точка переносит старые в снимок
+    size_t checkpoint_bytes = 64 * 1024 * 1024;
+};
+
+// Журнал изменений ячеек в каталоге: снимок содержимого всех ячеек и
+// сегменты журнала с изменениями после него. Добавление записи только
+// копирует её в буфер; на диск буфер сохраняет фоновый поток, поэтому fsync
+// не задерживает изменения, а последние group_commit_interval изменений
+// могут потеряться при сбое. Контрольные точки тоже строятся в фоне из
+// файлов журнала, не обращаясь к таблице.
+class WriteAheadLog {
+public:
+    // тексты ячеек по позициям
+    using CellTexts = std::unordered_map<Position, std::string, Position::HashFunc>;
+
+    // Открывает журнал в каталоге directory, создавая каталог при
+    // необходимости, и восстанавливает содержимое ячеек. Оборванная при
+    // сбое последняя запись отбрасывается. Бросает std::runtime_error, если
+    // файлы журнала повреждены.
+    explicit WriteAheadLog(const std::filesystem::path& directory, WalOptions options = {});
+    // Сохраняет все добавленные записи и дожидается контрольной точки
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Содержимое ячеек на момент открытия журнала; вызывается один раз
+    CellTexts TakeRecoveredCells();
+
+    // Добавляют запись и возвращают её номер
+    uint64_t AppendSetCell(Position pos, std::string_view text);
+    uint64_t AppendClearCell(Position pos);
+
+    // Дожидается сохранения на диск записи с номером lsn и всех предыдущих.
+    // Затем бросает ошибку фоновой контрольной точки, если она не удалась
+    // после прошлого сообщения о такой ошибке: записи при этом сохранены, а
+    // старые сегменты остаются до следующей контрольной точки.
+    void Sync(uint64_t lsn);
+    // Дожидается сохранения всех добавленных записей; ошибки - как у Sync
+    void Flush();
+    // Начинает новый сегмент и дожидается переноса старых в снимок
+    void Checkpoint();
+
+    // Номер последней записи, сохранённой на диск
+    uint64_t GetDurableLsn() const;
+
+private:
+    enum class Op : uint8_t {
+        SetCell,
+        ClearCell,
+    };
+
+    uint64_t Append(Op op, Position pos, std::string_view text);
+    void WriterLoop();
+    // Закрывает текущий сегмент и открывает следующий
+    void RotateSegment();
+    void RunCheckpoint(uint64_t segment);
+    void ThrowIfFailed() const;
+    // Бросает ошибку контрольной точки один раз
+    void ThrowIfCheckpointFailed();
+
+    const std::filesystem::path directory_;
+    const WalOptions options_;
+    CellTexts recovered_;
+
+    mutable std::mutex mutex_;
+    // будит поток записи
+    std::condition_variable wake_;
+    // сообщает о сохранённых записях и завершённых контрольных точках
+    std::condition_variable done_;
+    std::string pending_;
+    uint64_t appended_lsn_ = 0;
+    uint64_t durable_lsn_ = 0;
+    bool sync_requested_ = false;
+    bool checkpoint_requested_ = false;
+    bool checkpoint_running_ = false;
+    uint64_t checkpoints_done_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    // ошибка последней контрольной точки, о которой ещё не сообщалось;
+    // удачная контрольная точка её сбрасывает
+    std::exception_ptr checkpoint_error_;
+
+    // состояние текущего сегмента; используется только потоком записи
+    int fd_ = -1;
+    uint64_t segment_ = 0;
+    size_t segment_size_ = 0;
+
+    std::thread checkpoint_thread_;
+    std::thread writer_;
+};